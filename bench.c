@@ -0,0 +1,601 @@
+/*
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1(the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/.
+ *
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis,WITHOUT WARRANTY OF ANY KIND,either express or implied. See
+ * the License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * Alternatively,the contents of this file may be used under the terms
+ * of the GNU General Public License(the "GPL"),in which case the
+ * provisions of GPL are applicable instead of those above.  If you wish
+ * to allow use of your version of this file only under the terms of the
+ * GPL and not to allow others to use your version of this file under the
+ * License,indicate your decision by deleting the provisions above and
+ * replace them with the notice and other provisions required by the GPL.
+ * If you do not delete the provisions above,a recipient may use your
+ * version of this file under either the License or the GPL.
+ *
+ */
+
+/*
+ * bench.c --
+ *
+ *      Standalone benchmark for the driver. The driver is linked into the
+ *      program and called via its dbProcs, the nsdb functions used by the
+ *      driver are replaced by the minimal versions below, so no server is
+ *      needed. Every thread works on a handle of its own, the latencies
+ *      of all operations are recorded and reported as percentiles.
+ *
+ *      Usage: nsdbbdb-bench ?-option value ...?, see Usage() below.
+ */
+
+#include "ns.h"
+#include "nsdb.h"
+
+#include <math.h>
+
+#define BENCH_POOL "bench"
+
+typedef enum {
+    OpGet, OpPut, OpScan, OpNone
+} benchOp;
+
+static const char *const opNames[] = {"GET", "PUT", "SCAN"};
+
+/*
+ * Latency samples of one operation in nanoseconds.
+ */
+typedef struct {
+    uint64_t    *samples;
+    size_t       count;
+    size_t       size;
+    size_t       errors;
+    size_t       rows;
+} benchSamples;
+
+typedef struct {
+    Ns_DbHandle *handle;
+    uint64_t     seed;
+    char        *query;
+    char        *value;
+    benchSamples ops[OpNone];
+} benchThread;
+
+/*
+ * Workload, set via command line options.
+ */
+static struct {
+    const char *datasource;
+    int         threads;
+    long        ops;
+    long        keys;
+    int         reads;
+    int         scans;
+    int         scanLength;
+    int         keyMin, keyMax;
+    int         valueMin, valueMax;
+    double      theta;
+    bool        load;
+} workload = {
+    "bench.db", 4, 100000, 100000, 90, 0, 10, 16, 16, 100, 100, 0.99, NS_TRUE
+};
+
+/*
+ * Constants of the Zipfian distribution, see Gray et al., "Quickly
+ * Generating Billion-Record Synthetic Databases", SIGMOD 1994.
+ */
+static double zipfZetan, zipfAlpha, zipfEta;
+
+static const Ns_DbProc *driverProcs;
+
+extern NsDb_DriverInitProc Ns_DbDriverInit;
+
+static ns_funcptr_t GetProc(Ns_DbProcId id);
+static Ns_ThreadProc BenchThread;
+
+
+/*
+ * Minimal replacements of the nsdb functions used by the driver.
+ */
+Ns_ReturnCode Ns_DbRegisterDriver(const char *UNUSED(driver), const Ns_DbProc *procs)
+{
+    driverProcs = procs;
+    return NS_OK;
+}
+
+void Ns_DbSetException(Ns_DbHandle *handle, const char *code, const char *msg)
+{
+    strncpy(handle->cExceptionCode, code, sizeof(handle->cExceptionCode) - 1u);
+    Tcl_DStringSetLength(&handle->dsExceptionMsg, 0);
+    Tcl_DStringAppend(&handle->dsExceptionMsg, msg, TCL_INDEX_NONE);
+}
+
+const char *Ns_DbDriverName(Ns_DbHandle *handle)
+{
+    return handle->driver;
+}
+
+int Ns_TclDbGetHandle(Tcl_Interp *UNUSED(interp), const char *UNUSED(id), Ns_DbHandle **UNUSED(handlePtr))
+{
+    return TCL_ERROR;
+}
+
+static ns_funcptr_t GetProc(Ns_DbProcId id)
+{
+    const Ns_DbProc *procPtr;
+
+    for (procPtr = driverProcs; procPtr->func != NULL; procPtr++) {
+        if (procPtr->id == id) {
+            return procPtr->func;
+        }
+    }
+    fprintf(stderr, "driver has no proc %d\n", (int)id);
+    exit(1);
+}
+
+static int Exec(Ns_DbHandle *handle, char *query)
+{
+    return ((int (*)(Ns_DbHandle *, char *))GetProc(DbFn_Exec))(handle, query);
+}
+
+static Ns_Set *BindRow(Ns_DbHandle *handle)
+{
+    return ((Ns_Set *(*)(Ns_DbHandle *))GetProc(DbFn_BindRow))(handle);
+}
+
+static int GetRow(Ns_DbHandle *handle, Ns_Set *row)
+{
+    return ((int (*)(Ns_DbHandle *, Ns_Set *))GetProc(DbFn_GetRow))(handle, row);
+}
+
+static Ns_DbHandle *OpenHandle(void)
+{
+    Ns_DbHandle *handle = ns_calloc(1u, sizeof(Ns_DbHandle));
+
+    handle->driver = BENCH_POOL;
+    handle->poolname = BENCH_POOL;
+    handle->datasource = workload.datasource;
+    handle->row = Ns_SetCreate(BENCH_POOL);
+    Tcl_DStringInit(&handle->dsExceptionMsg);
+    if (((int (*)(Ns_DbHandle *))GetProc(DbFn_OpenDb))(handle) != NS_OK) {
+        fprintf(stderr, "could not open %s: %s\n", workload.datasource, handle->dsExceptionMsg.string);
+        exit(1);
+    }
+    handle->connected = NS_TRUE;
+    return handle;
+}
+
+static void CloseHandle(Ns_DbHandle *handle)
+{
+    (void)((int (*)(Ns_DbHandle *))GetProc(DbFn_CloseDb))(handle);
+    Ns_SetFree(handle->row);
+    Tcl_DStringFree(&handle->dsExceptionMsg);
+    ns_free(handle);
+}
+
+/*
+ * Execute a query and fetch all rows like "ns_db select" does. Returns the
+ * number of rows or -1 on errors.
+ */
+static long Query(Ns_DbHandle *handle, char *query)
+{
+    Ns_Set *row;
+    long    rows = 0;
+    int     rc;
+
+    rc = Exec(handle, query);
+    if (rc == NS_DML) {
+        return 0;
+    }
+    if (rc != NS_ROWS) {
+        return -1;
+    }
+    Ns_SetTrunc(handle->row, 0u);
+    row = BindRow(handle);
+    while ((rc = GetRow(handle, row)) == NS_OK) {
+        rows++;
+    }
+    return rc == NS_END_DATA ? rows : -1;
+}
+
+static uint64_t Now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * xorshift64*, each thread has its own state.
+ */
+static uint64_t Random(uint64_t *statePtr)
+{
+    uint64_t x = *statePtr;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *statePtr = x;
+    return x * 0x2545F4914F6CDD1Du;
+}
+
+static double RandomDouble(uint64_t *statePtr)
+{
+    return (double)(Random(statePtr) >> 11) / 9007199254740992.0;
+}
+
+static int RandomRange(uint64_t *statePtr, int min, int max)
+{
+    return min + (int)(Random(statePtr) % (uint64_t)(max - min + 1));
+}
+
+static uint64_t Mix(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdu;
+    x ^= x >> 33;
+    return x;
+}
+
+static void InitZipf(void)
+{
+    double zeta2 = 0.0;
+    long   i;
+
+    zipfZetan = 0.0;
+    for (i = 1; i <= workload.keys; i++) {
+        double v = 1.0 / pow((double)i, workload.theta);
+
+        zipfZetan += v;
+        if (i <= 2) {
+            zeta2 += v;
+        }
+    }
+    zipfAlpha = 1.0 / (1.0 - workload.theta);
+    zipfEta = (1.0 - pow(2.0 / (double)workload.keys, 1.0 - workload.theta))
+        / (1.0 - zeta2 / zipfZetan);
+}
+
+/*
+ * Pick the number of the next key. With a Zipfian distribution, the ranks
+ * are scattered over the key space, so the hot keys are not neighbors.
+ */
+static long NextKey(uint64_t *statePtr)
+{
+    double u, uz;
+    long   rank;
+
+    if (workload.theta <= 0.0) {
+        return (long)(Random(statePtr) % (uint64_t)workload.keys);
+    }
+    u = RandomDouble(statePtr);
+    uz = u * zipfZetan;
+    if (uz < 1.0) {
+        rank = 0;
+    } else if (uz < 1.0 + pow(0.5, workload.theta)) {
+        rank = 1;
+    } else {
+        rank = (long)((double)workload.keys * pow(zipfEta * u - zipfEta + 1.0, zipfAlpha));
+    }
+    return (long)(Mix((uint64_t)rank) % (uint64_t)workload.keys);
+}
+
+/*
+ * Number of decimal digits of a key number.
+ */
+static int Digits(long n)
+{
+    int digits = 1;
+
+    while (n >= 10) {
+        n /= 10;
+        digits++;
+    }
+    return digits;
+}
+
+/*
+ * Format the key with the given number. The length of a key is derived
+ * from its number, so every key has always the same length. The number
+ * is zero padded to that length, main() makes sure that the minimum key
+ * size holds all digits of the largest number.
+ */
+static int FormatKey(char *buf, long n)
+{
+    int length = workload.keyMin
+        + (int)(Mix((uint64_t)n + 1u) % (uint64_t)(workload.keyMax - workload.keyMin + 1));
+
+    return sprintf(buf, "%0*ld", length, n);
+}
+
+static int FormatPut(benchThread *threadPtr, long n)
+{
+    int length = FormatKey(threadPtr->query + 4, n) + 4;
+    int size = RandomRange(&threadPtr->seed, workload.valueMin, workload.valueMax);
+
+    memcpy(threadPtr->query, "PUT ", 4u);
+    threadPtr->query[length++] = '\n';
+    memcpy(threadPtr->query + length, threadPtr->value, (size_t)size);
+    threadPtr->query[length + size] = '\0';
+    return length + size;
+}
+
+static void Record(benchSamples *samplesPtr, uint64_t nsec, long rows)
+{
+    if (samplesPtr->count == samplesPtr->size) {
+        samplesPtr->size = samplesPtr->size == 0u ? 1024u : samplesPtr->size * 2u;
+        samplesPtr->samples = ns_realloc(samplesPtr->samples, samplesPtr->size * sizeof(uint64_t));
+    }
+    samplesPtr->samples[samplesPtr->count++] = nsec;
+    if (rows < 0) {
+        samplesPtr->errors++;
+    } else {
+        samplesPtr->rows += (size_t)rows;
+    }
+}
+
+static void BenchThread(void *arg)
+{
+    benchThread *threadPtr = arg;
+    long         i;
+
+    Ns_ThreadSetName("-bench-");
+    for (i = 0; i < workload.ops; i++) {
+        int      pick = RandomRange(&threadPtr->seed, 0, 99);
+        long     n = NextKey(&threadPtr->seed), rows;
+        benchOp  op;
+        uint64_t start;
+
+        if (pick < workload.scans) {
+            op = OpScan;
+            FormatKey(threadPtr->query
+                      + sprintf(threadPtr->query, "CURSOR/l%d ", workload.scanLength), n);
+        } else if (pick < workload.scans + workload.reads) {
+            op = OpGet;
+            FormatKey(threadPtr->query + 4, n);
+            memcpy(threadPtr->query, "GET ", 4u);
+        } else {
+            op = OpPut;
+            FormatPut(threadPtr, n);
+        }
+        start = Now();
+        rows = Query(threadPtr->handle, threadPtr->query);
+        Record(&threadPtr->ops[op], Now() - start, rows);
+    }
+}
+
+static int CompareSamples(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double Percentile(const benchSamples *samplesPtr, double p)
+{
+    size_t i = (size_t)ceil(p * (double)samplesPtr->count);
+
+    return (double)samplesPtr->samples[i > 0u ? i - 1u : 0u] / 1000.0;
+}
+
+static void Report(const char *name, benchSamples *samplesPtr, double seconds)
+{
+    if (samplesPtr->count == 0u) {
+        return;
+    }
+    qsort(samplesPtr->samples, samplesPtr->count, sizeof(uint64_t), CompareSamples);
+    printf("%-6s %10lu %12.0f %8lu %10lu %10.1f %10.1f %10.1f %10.1f\n",
+           name, (unsigned long)samplesPtr->count, (double)samplesPtr->count / seconds,
+           (unsigned long)samplesPtr->errors, (unsigned long)samplesPtr->rows,
+           Percentile(samplesPtr, 0.5), Percentile(samplesPtr, 0.99),
+           Percentile(samplesPtr, 0.999), Percentile(samplesPtr, 1.0));
+}
+
+static void Usage(void)
+{
+    fprintf(stderr,
+            "usage: nsdbbdb-bench ?options?\n"
+            "workload:\n"
+            "  -datasource ds    datasource (bench.db)\n"
+            "  -threads n        number of threads, each with a handle (4)\n"
+            "  -ops n            operations per thread (100000)\n"
+            "  -keys n           number of keys (100000)\n"
+            "  -reads pct        percentage of GET (90)\n"
+            "  -scans pct        percentage of CURSOR scans (0), the rest is PUT\n"
+            "  -scanlength n     rows per scan (10)\n"
+            "  -keysize min:max  key size in bytes (16)\n"
+            "  -valuesize min:max value size in bytes (100)\n"
+            "  -zipf theta       skew of the key distribution, 0 is uniform (0.99)\n"
+            "  -load bool        load all keys before the run (1)\n"
+            "pool parameters, see README:\n"
+            "  -home, -envflags, -dbflags, -cachesize, -pagesize, -bulksize,\n"
+            "  -maxreaders, -dbsync, -latency, -keycache, -bloomfpr\n");
+    exit(2);
+}
+
+static void ParseRange(const char *value, int *minPtr, int *maxPtr)
+{
+    char *end;
+
+    *minPtr = *maxPtr = (int)strtol(value, &end, 10);
+    if (*end == ':') {
+        *maxPtr = (int)strtol(end + 1, &end, 10);
+    }
+    if (*end != '\0' || *minPtr < 1 || *maxPtr < *minPtr) {
+        Usage();
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static const char *const poolParams[] = {
+        "home", "envflags", "dbflags", "cachesize", "pagesize", "bulksize",
+        "maxreaders", "dbsync", "latency", "keycache", "bloomfpr", NULL
+    };
+    Ns_Set       *config;
+    benchThread  *threads;
+    Ns_Thread    *tids;
+    benchSamples  total[OpNone];
+    double        seconds;
+    uint64_t      start;
+    int           i, op;
+
+    Nsd_LibInit();
+    config = Ns_ConfigCreateSection("ns/db/pool/" BENCH_POOL);
+    Ns_SetPutSz(config, "home", TCL_INDEX_NONE, "/tmp", TCL_INDEX_NONE);
+
+    for (i = 1; i + 1 < argc; i += 2) {
+        const char *option = argv[i], *value = argv[i + 1];
+        int         j;
+
+        if (*option != '-') {
+            Usage();
+        }
+        option++;
+        if (strcmp(option, "datasource") == 0) {
+            workload.datasource = value;
+        } else if (strcmp(option, "threads") == 0) {
+            workload.threads = atoi(value);
+        } else if (strcmp(option, "ops") == 0) {
+            workload.ops = atol(value);
+        } else if (strcmp(option, "keys") == 0) {
+            workload.keys = atol(value);
+        } else if (strcmp(option, "reads") == 0) {
+            workload.reads = atoi(value);
+        } else if (strcmp(option, "scans") == 0) {
+            workload.scans = atoi(value);
+        } else if (strcmp(option, "scanlength") == 0) {
+            workload.scanLength = atoi(value);
+        } else if (strcmp(option, "keysize") == 0) {
+            ParseRange(value, &workload.keyMin, &workload.keyMax);
+        } else if (strcmp(option, "valuesize") == 0) {
+            ParseRange(value, &workload.valueMin, &workload.valueMax);
+        } else if (strcmp(option, "zipf") == 0) {
+            workload.theta = atof(value);
+        } else if (strcmp(option, "load") == 0) {
+            workload.load = atoi(value) != 0;
+        } else {
+            for (j = 0; poolParams[j] != NULL && strcmp(option, poolParams[j]) != 0; j++) {
+                ;
+            }
+            if (poolParams[j] == NULL) {
+                Usage();
+            }
+            Ns_SetPutSz(config, option, TCL_INDEX_NONE, value, TCL_INDEX_NONE);
+        }
+    }
+    if (i != argc || workload.threads < 1 || workload.ops < 0 || workload.keys < 1
+        || workload.reads < 0 || workload.scans < 0 || workload.reads + workload.scans > 100
+        || workload.scanLength < 1 || workload.theta < 0.0 || workload.theta == 1.0) {
+        Usage();
+    }
+    if (workload.keyMin < Digits(workload.keys - 1)) {
+        fprintf(stderr, "-keysize %d is too small for %ld keys, at least %d bytes are needed\n",
+                workload.keyMin, workload.keys, Digits(workload.keys - 1));
+        return 1;
+    }
+    if (workload.theta > 0.0) {
+        InitZipf();
+    }
+
+    if (Ns_DbDriverInit(BENCH_POOL, NULL) != NS_OK) {
+        return 1;
+    }
+    threads = ns_calloc((size_t)workload.threads, sizeof(benchThread));
+    tids = ns_calloc((size_t)workload.threads, sizeof(Ns_Thread));
+    for (i = 0; i < workload.threads; i++) {
+        benchThread *threadPtr = &threads[i];
+
+        threadPtr->handle = OpenHandle();
+        threadPtr->seed = Mix((uint64_t)i + 0x9E3779B97F4A7C15u) | 1u;
+        threadPtr->query = ns_malloc((size_t)(workload.keyMax + workload.valueMax) + 64u);
+        threadPtr->value = ns_malloc((size_t)workload.valueMax);
+        memset(threadPtr->value, 'v', (size_t)workload.valueMax);
+    }
+
+    printf("%s: %d threads, %ld ops/thread, %ld keys, %d%% GET, %d%% SCAN (%d rows), "
+           "keys %d:%d, values %d:%d bytes, zipf %.2f\n",
+           ((const char *(*)(void))GetProc(DbFn_DbType))(),
+           workload.threads, workload.ops, workload.keys, workload.reads, workload.scans,
+           workload.scanLength, workload.keyMin, workload.keyMax,
+           workload.valueMin, workload.valueMax, workload.theta);
+
+    if (workload.load) {
+        benchThread *threadPtr = &threads[0];
+        long         n;
+
+        start = Now();
+        for (n = 0; n < workload.keys; n++) {
+            FormatPut(threadPtr, n);
+            if (Query(threadPtr->handle, threadPtr->query) < 0) {
+                fprintf(stderr, "load failed: %s\n", threadPtr->handle->dsExceptionMsg.string);
+                return 1;
+            }
+        }
+        seconds = (double)(Now() - start) / 1e9;
+        printf("load: %ld keys in %.2f s, %.0f ops/s\n", workload.keys, seconds,
+               (double)workload.keys / seconds);
+    }
+
+    start = Now();
+    for (i = 0; i < workload.threads; i++) {
+        Ns_ThreadCreate(BenchThread, &threads[i], 0, &tids[i]);
+    }
+    for (i = 0; i < workload.threads; i++) {
+        Ns_ThreadJoin(&tids[i], NULL);
+    }
+    seconds = (double)(Now() - start) / 1e9;
+
+    /*
+     * Merge the samples of all threads.
+     */
+    memset(total, 0, sizeof(total));
+    for (op = 0; op < OpNone; op++) {
+        for (i = 0; i < workload.threads; i++) {
+            const benchSamples *samplesPtr = &threads[i].ops[op];
+            size_t              j;
+
+            for (j = 0u; j < samplesPtr->count; j++) {
+                Record(&total[op], samplesPtr->samples[j], 0);
+            }
+            total[op].errors += samplesPtr->errors;
+            total[op].rows += samplesPtr->rows;
+        }
+    }
+
+    printf("run: %.2f s\n", seconds);
+    printf("%-6s %10s %12s %8s %10s %10s %10s %10s %10s\n",
+           "op", "count", "ops/s", "errors", "rows", "p50 us", "p99 us", "p999 us", "max us");
+    for (op = 0; op < OpNone; op++) {
+        Report(opNames[op], &total[op], seconds);
+    }
+
+    for (op = 0; op < OpNone; op++) {
+        ns_free(total[op].samples);
+    }
+    for (i = 0; i < workload.threads; i++) {
+        CloseHandle(threads[i].handle);
+        for (op = 0; op < OpNone; op++) {
+            ns_free(threads[i].ops[op].samples);
+        }
+        ns_free(threads[i].query);
+        ns_free(threads[i].value);
+    }
+    ns_free(threads);
+    ns_free(tids);
+    return 0;
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 4
+ * fill-column: 78
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -53,7 +53,10 @@
 # define NS_DB_SET         MDB_SET
 # define NS_DB_FIRST       MDB_FIRST
 # define NS_DB_NOTFOUND    MDB_NOTFOUND
+# define NS_DB_KEYEXIST    MDB_KEYEXIST
 # define NS_DB_NEXT        MDB_NEXT
+# define NS_DB_PREV        MDB_PREV
+# define NS_DB_LAST        MDB_LAST
 # define NS_DB_DBT_REALLOC 0x10000000
 # define NS_DB_DBT_MALLOC  0x20000000
 # define NS_DB_ENV_CREATE(dbEnv)         mdb_env_create(dbEnv)
@@ -66,6 +69,8 @@
 # define NS_DB_DBI_CURSOR_OPEN(txn,dbi,c) mdb_cursor_open((txn), (dbi), (c))
 # define NS_DB_DBI_CURSOR_CLOSE(c)       mdb_cursor_close((c))
 # define NS_DB_DBI_GET(txn,dbi,key,data) mdb_get((txn),(dbi), (key), (data))
+# define NS_DB_DBI_PUT(txn,dbi,key,data,flags) mdb_put((txn), (dbi), (key), (data), (flags))
+# define NS_DB_DBI_DEL(txn,dbi,key)      mdb_del((txn), (dbi), (key), NULL)
 # define NS_DB_CURSOR_GET(c,k,d,flags)   mdb_cursor_get((c), (k), (d), (flags))
 # define NS_DB_ENV_ERR(dbEnv,rc,command) Ns_Log(Error,"bdb: %s returns error: %s", (command), mdb_strerror(rc))
 # define NS_DB_ERR0(db,rc,data)          Ns_Log(Error, "error %s: %s", mdb_strerror(rc), (data))
@@ -89,7 +94,10 @@
 # define NS_DB_SET         DB_SET
 # define NS_DB_FIRST       DB_FIRST
 # define NS_DB_NOTFOUND    DB_NOTFOUND
+# define NS_DB_KEYEXIST    DB_KEYEXIST
 # define NS_DB_NEXT        DB_NEXT
+# define NS_DB_PREV        DB_PREV
+# define NS_DB_LAST        DB_LAST
 # define NS_DB_DBT_REALLOC DB_DBT_REALLOC
 # define NS_DB_DBT_MALLOC  DB_DBT_MALLOC
 # define NS_DB_ENV_CREATE(dbEnv)          db_env_create((dbEnv), 0)
@@ -99,9 +107,11 @@
 # define NS_DB_ENV_TXN_COMMIT(txn)        (txn)->commit((txn), 0)
 # define NS_DB_ENV_TXN_ABORT(txn)         (txn)->abort((txn))
 # define NS_DB_DBI_CLOSE(dbEnv,dbi)       (dbi)->close((dbi),0)
-# define NS_DB_DBI_CURSOR_OPEN(txn,dbi,c) (dbi)->cursor((dbi), NULL, (c), DB_READ_UNCOMMITTED)
+# define NS_DB_DBI_CURSOR_OPEN(txn,dbi,c) (dbi)->cursor((dbi), (txn), (c), DB_READ_UNCOMMITTED)
 # define NS_DB_DBI_CURSOR_CLOSE(c)        (c)->c_close((c))
-# define NS_DB_DBI_GET(txn,dbi,key,data)  (dbi)->get((dbi), NULL, (key), (data), DB_READ_UNCOMMITTED)
+# define NS_DB_DBI_GET(txn,dbi,key,data)  (dbi)->get((dbi), (txn), (key), (data), DB_READ_UNCOMMITTED)
+# define NS_DB_DBI_PUT(txn,dbi,key,data,flags) (dbi)->put((dbi), (txn), (key), (data), (flags))
+# define NS_DB_DBI_DEL(txn,dbi,key)       (dbi)->del((dbi), (txn), (key), 0)
 # define NS_DB_CURSOR_GET(c,k,d,flags)    (c)->c_get(c, (k), (d), (flags))
 # define NS_DB_ENV_ERR(dbEnv,rc,command)  (dbEnv)->err((dbEnv), (rc), (command))
 # define NS_DB_ERR0(db,rc,data)           (db)->err((db), (rc), "%s", (data))
@@ -113,12 +123,32 @@
 #endif
 
 #include <sys/stat.h>
+#include <dirent.h>
+#include <math.h>
+#include <limits.h>
+
+/*
+ * Size of a value given as a string. Unless in binary mode, values are
+ * stored with their terminating NUL character.
+ */
+#define NS_DB_STR_SIZE(conn,str) ((NS_DB_SIZE_T)strlen(str) + ((conn)->pool->binary ? 0u : 1u))
 
 #define DB_SELECT       1
 #define DB_GET          2
 #define DB_UPDATE       3
 #define DB_DELETE       4
 #define DB_CHECK        5
+#define DB_MGET         6
+#define DB_GETALL       7
+
+/*
+ * Options of CURSOR scans
+ */
+#define DB_SCAN_PREFIX    0x01u
+#define DB_SCAN_REVERSE   0x02u
+#define DB_SCAN_INCLUSIVE 0x04u
+#define DB_SCAN_END       0x08u
+#define DB_SCAN_UNORDERED 0x10u
 
 static const char *DbName(void);
 static const char *DbDbType(void);
@@ -130,12 +160,20 @@ static int DbGetRow(Ns_DbHandle *handle, Ns_Set *row);
 static int DbFlush(Ns_DbHandle *handle);
 static int DbCancel(Ns_DbHandle *handle);
 static int DbExec(Ns_DbHandle *handle, char *sql);
+static int DbExecBatch(Ns_DbHandle *handle, const char *list, unsigned int flags, Tcl_WideInt expiry, bool isPut);
+static int DbExecIncr(Ns_DbHandle *handle, char *args, bool decrement);
+static int DbExecCas(Ns_DbHandle *handle, char *query);
 static int DbResetHandle(Ns_DbHandle *handle);
 static int DbFree(Ns_DbHandle *handle);
 static void DbShutdown(void *arg);
 static Ns_Set *DbBindRow(Ns_DbHandle *handle);
 
 static Ns_TclTraceProc DbInterpInit;
+static Ns_SchedProc DbSampleStats;
+static Ns_SchedProc DbReapExpired;
+#ifndef LMDB
+static Ns_SchedProc DbCompactSlices;
+#endif
 static Ns_LogSeverity BdbDebug;    /* Severity at which to log verbose debugging. */
 
 #ifndef LMDB
@@ -158,58 +196,481 @@ static Ns_DbProc dbProcs[] = {
     {0, NULL}
 };
 
+/*
+ * Opened database, shared by all handles of the same datasource. A sharded
+ * datasource ("sharded:N:...") consists of N databases, in LMDB each in an
+ * environment of its own.
+ */
+#define DB_MAX_SHARDS 64
+
+#ifndef LMDB
+/*
+ * State of the background compaction of a datasource, see
+ * DbCompactSlices(). The position of the pass is only used by the
+ * scheduler thread, the other fields are guarded by the lock.
+ */
+typedef struct _dbCompact {
+    Ns_Mutex lock;
+    bool requested;             /* COMPACT was called */
+    bool running;               /* a pass is in progress */
+    int shard;                  /* shard of the next slice */
+    Tcl_DString start;          /* key to continue the shard from */
+    time_t checked;             /* last start or check of the free fraction */
+    double freeRatio;           /* free fraction at the last check */
+    Tcl_WideInt passes;
+    Tcl_WideInt slices;
+    Tcl_WideInt pagesFreed;
+    Tcl_WideInt pagesExamined;
+    Tcl_WideInt pagesTruncated;  /* pages returned to the filesystem */
+} dbCompact;
+#endif
+
+typedef struct _dbShared {
+    const struct _dbPool *pool; /* pool which opened the database */
+    int nShards;
+    NS_DBI dbis[DB_MAX_SHARDS];
+    NS_DB_ENV *envs[DB_MAX_SHARDS];
+    int refCount;           /* number of handles using the database */
+    Tcl_HashEntry *hPtr;    /* entry in dbTable */
+    struct _dbCache *cache; /* read cache, NULL when disabled */
+    struct _dbBloom *bloom; /* bloom filter of the keys, NULL when disabled */
+    struct _dbBackup *backup; /* state of the last backup, NULL when none */
+    struct _dbLoad *load;   /* state of the last bulk load, NULL when none */
+#ifndef LMDB
+    Ns_Mutex rmwLock;       /* serializes INCR and CAS without transactions */
+    dbCompact compact;
+#endif
+    NS_DB_ENV *ttlEnv;      /* environment of the expiry index, NULL when disabled */
+    NS_DBI ttlDbi;          /* expiry index */
+    Tcl_WideInt ttlReaped;  /* number of expired keys deleted */
+} dbShared;
+
+/*
+ * Scan state of a single shard in a sharded CURSOR scan.
+ */
+typedef struct _dbScanShard {
+    NS_DB_CURSOR *cursor;
+    int status;             /* 0 when key and data hold the current row */
+    Tcl_DString key;
+    Tcl_DString data;
+} dbScanShard;
+
 typedef struct _dbConn {
     struct _dbConn *next;
     int cmd;
     int status;
-    NS_DBI dbi;
+    struct _dbPool *pool;
+    dbShared *shared;
+    int shard;              /* current shard */
+    NS_DBI dbi;             /* database of the current shard */
+    NS_DB_ENV *env;         /* environment of the current shard */
     NS_DB_TXN *txn;
+#ifdef LMDB
+    NS_DB_TXN *rtxn[DB_MAX_SHARDS];
+    bool rtxnActive[DB_MAX_SHARDS];
+    NS_DB_TXN *ttlRtxn;     /* read-only transaction of the expiry index */
+    Tcl_DString ttlKeys;    /* expiry changes waiting for the commit, see TtlCommit() */
+#endif
     NS_DB_CURSOR *cursor;
     NS_DB_VAL key;
     NS_DB_VAL data;
 #ifdef LMDB
     unsigned int key_flags;
     unsigned int data_flags;
+    MDB_val dups;           /* GETALL: page of fixed size duplicates */
+    size_t dupsOffset;      /* GETALL: next duplicate in the page */
+    size_t dupSize;
 #endif
     int count;
+    unsigned int scanFlags; /* CURSOR: DB_SCAN_* options */
+    int limit;          /* CURSOR: max number of rows, 0 for unlimited */
+    int skip;           /* CURSOR: number of rows to skip */
+    NS_DB_VAL bound;    /* CURSOR: end key or prefix */
+    unsigned char keyEnc[8];   /* typed key of the statement */
+    unsigned char boundEnc[8]; /* CURSOR: typed end key */
+    size_t prefixLength;
+#ifndef LMDB
+    DBT bulk;           /* CURSOR: buffer for bulk retrieval */
+    void *bulkPtr;      /* CURSOR: next record in the bulk buffer */
+    bool bulkActive;    /* CURSOR: key and data point into the bulk buffer */
+    void *keyBuf;       /* buffer for retrieved keys, owned by the handle */
+    u_int32_t keyBufSize;
+    void *dataBuf;      /* buffer for retrieved data, owned by the handle */
+    u_int32_t dataBufSize;
+#endif
+    char *keys;         /* MGET: copy of the key list, CURSOR: copy of the keys */
+    char *keysEnd;      /* MGET: end of the key list */
+    char *nextKey;      /* MGET: key to be fetched by the next getrow */
+    dbScanShard *scan;  /* CURSOR: per shard state of a sharded scan */
+    int scanShard;      /* CURSOR: shard of the current row */
+    char *cacheBuf;     /* copy of the data of a cache hit */
+    size_t cacheBufSize;
+    Tcl_DString cacheKeys; /* keys written in the transaction, length prefixed */
+    bool cacheClear;    /* TRUNCATE in the transaction, clear the cache at its end */
+    char counterBuf[TCL_INTEGER_SPACE]; /* INCR: the new value */
 } dbConn;
 
 static int GetTempTxn(dbConn *conn, NS_DB_TXN **txnPtr);
-static void CleanTempTxn(dbConn *conn, NS_DB_TXN *txn);
+static int CleanTempTxn(dbConn *conn, NS_DB_TXN *txn);
+static int GetReadTxn(dbConn *conn, NS_DB_TXN **txnPtr);
+static int GetBatchTxn(dbConn *conn, NS_DB_TXN **txnPtr);
+static void ReleaseReadTxn(dbConn *conn);
+static void AbortTxn(dbConn *conn);
+#ifdef LMDB
+static int TtlCommit(dbConn *conn, NS_DB_TXN *txn);
+static void TtlDiscard(dbConn *conn);
+#endif
+static void DbFreeVals(dbConn *conn);
+static void CloseShared(dbShared *sharedPtr);
+static void CacheFlush(dbConn *conn);
+static struct _dbCache *CacheCreate(size_t size);
+static void CacheDestroy(struct _dbCache *cachePtr);
+static struct _dbBloom *BloomCreate(dbShared *sharedPtr, const char *datasource);
+static void BloomDestroy(struct _dbBloom *bloomPtr);
+static void BackupDestroy(struct _dbBackup *backupPtr);
+static void LoadDestroy(struct _dbLoad *loadPtr);
+
+/*
+ * Environment, shared by all pools with the same home directory.
+ */
+typedef struct _dbEnvironment {
+    const char *home;
+    NS_DB_ENV *env;
+    unsigned int envFlags;
+#ifdef LMDB
+    unsigned int maxReaders;
+    double compactFree;         /* compact on open above this free fraction, 0 for never */
+#else
+    unsigned int cacheSize;
+#endif
+} dbEnvironment;
+
+/*
+ * Types of keys, see the parameter keytype.
+ */
+typedef enum {
+    KeyString,
+    KeyInt32,
+    KeyInt64,
+    KeyUint64Be
+} dbKeyType;
+
+/*
+ * Configuration of a pool, read from its section in the config file.
+ * Parameters not set there are taken from the section of the driver.
+ */
+typedef struct _dbPool {
+    const char *name;
+    dbEnvironment *envPtr;
+    NS_DB_ENV *env;             /* copy of envPtr->env */
+    const char *delimiter;
+    size_t delimiterLength;
+    bool binary;
+    dbKeyType keyType;
+    unsigned int keyCacheSize;  /* size of the read cache of every opened datasource in bytes, 0 for none */
+    double bloomFpr;            /* false positive rate of the bloom filter, 0 for none */
+    bool ttl;                   /* keys might expire, see PUT/t */
+    unsigned int dbFlags;       /* flags of the database, e.g. for duplicates */
+#ifndef LMDB
+    unsigned int hFactor;
+    unsigned int btMinKey;
+    unsigned int pageSize;
+    unsigned int bulkSize;
+    bool sync;
+    double compactFree;         /* start compaction above this free fraction, 0 for always */
+#endif
+} dbPool;
 
-static const char *dbHome = NULL;
-static NS_DB_ENV *dbEnv = NULL;
-static const char *dbDelimiter = "\n";
 static bool dbDebug = NS_FALSE;
+static int  ttlInterval = 1;    /* seconds between runs of the expiry reaper */
+static int  ttlBatch = 1000;    /* max number of expired keys deleted per transaction */
+#ifndef LMDB
+static int  compactInterval = 0; /* seconds between compaction slices, 0 for none */
+static int  compactPages = 100;  /* max number of pages freed per slice */
+static int  compactTimeout = 0;  /* lock timeout of a slice in milliseconds */
+static int  compactCheck = 3600; /* seconds between starts or checks of a pass */
+#endif
 #ifdef LMDB
 static const char *dbName = "LMDB";
-static unsigned int dbEnvFlags = 0;
 #else
 static const char *dbName = "BerkeleyDB";
-static unsigned int dbDbFlags = DB_READ_UNCOMMITTED;
-static unsigned int dbEnvFlags = DB_CREATE | DB_THREAD | DB_INIT_MPOOL | DB_READ_UNCOMMITTED;
-static unsigned int dbHFactor = 0;
-static unsigned int dbBtMinKey = 0;
-static unsigned int dbPageSize = 0;
-static unsigned int dbCacheSize = 0;
-static bool dbSync = NS_TRUE;
-#endif
-static Tcl_HashTable dbTable;
+#endif
+static Tcl_HashTable dbTable;     /* opened databases, keyed by home, flags and datasource */
+static Tcl_HashTable poolTable;   /* configured pools, keyed by pool name */
+static Tcl_HashTable envTable;    /* opened environments, keyed by home directory */
 static Ns_Mutex dbLock = NULL;
 
+/*
+ * Latency statistics. Every thread counts the operations it performs in a
+ * block of its own, so the hot path takes no locks. The blocks are linked
+ * in latencyList and summed up by "ns_berkeleydb latency". Blocks of
+ * terminated threads are added to latencyRetired. A reset stores the
+ * current sums in latencyBase, which is subtracted afterwards.
+ */
+typedef enum {
+    OpGet, OpMget, OpCheck, OpPut, OpDel, OpMput, OpMdel, OpCursor, OpGetrow,
+    OpBegin, OpCommit, OpAbort, OpCompact, OpTruncate, OpIncr, OpCas, OpGetall, OpNone
+} dbOp;
+
+static const char *const opNames[] = {
+    "GET", "MGET", "CHECK", "PUT", "DEL", "MPUT", "MDEL", "CURSOR", "GETROW",
+    "BEGIN", "COMMIT", "ABORT", "COMPACT", "TRUNCATE", "INCR", "CAS", "GETALL"
+};
+
+/*
+ * Phases of an operation: the total time, waiting for the transaction,
+ * the engine call (the total without the other phases), and copying the
+ * row into the Ns_Set.
+ */
+typedef enum {
+    PhaseTotal, PhaseTxn, PhaseEngine, PhaseRow, PhaseNone
+} dbPhase;
+
+static const char *const phaseNames[] = {
+    "total", "txn", "engine", "row"
+};
+
+#define LATENCY_BUCKETS 32    /* bucket i counts latencies < 2^i microseconds */
+
+typedef struct _dbLatency {
+    struct _dbLatency *nextPtr;
+    Tcl_WideInt count[OpNone];
+    Tcl_WideInt errors[OpNone];
+    Tcl_WideInt usec[OpNone][PhaseNone];
+    Tcl_WideInt hist[OpNone][PhaseNone][LATENCY_BUCKETS];
+    Tcl_WideInt txnUsec;      /* time waited for transactions in the current operation */
+    Tcl_WideInt rowUsec;      /* time spent copying rows in the current operation */
+} dbLatency;
+
+static bool           dbLatencyEnabled = NS_FALSE; /* driver-global, see Ns_DbDriverInit() */
+static Ns_Tls         latencyTls;
+static dbLatency     *latencyList = NULL;
+static dbLatency      latencyRetired;
+static dbLatency      latencyBase;
+static Ns_Mutex       latencyLock = NULL;
+
+static Tcl_WideInt LatencyNow(void)
+{
+    Ns_Time now;
+
+    if (!dbLatencyEnabled) {
+        return 0;
+    }
+    Ns_GetTime(&now);
+    return (Tcl_WideInt)now.sec * 1000000 + (Tcl_WideInt)now.usec;
+}
+
+static void LatencyThreadCleanup(void *arg)
+{
+    dbLatency  *latPtr = arg, **prevPtrPtr;
+    int         op, phase, i;
+
+    Ns_MutexLock(&latencyLock);
+    for (prevPtrPtr = &latencyList; *prevPtrPtr != NULL; prevPtrPtr = &(*prevPtrPtr)->nextPtr) {
+        if (*prevPtrPtr == latPtr) {
+            *prevPtrPtr = latPtr->nextPtr;
+            break;
+        }
+    }
+    for (op = 0; op < OpNone; op++) {
+        latencyRetired.count[op] += latPtr->count[op];
+        latencyRetired.errors[op] += latPtr->errors[op];
+        for (phase = 0; phase < PhaseNone; phase++) {
+            latencyRetired.usec[op][phase] += latPtr->usec[op][phase];
+            for (i = 0; i < LATENCY_BUCKETS; i++) {
+                latencyRetired.hist[op][phase][i] += latPtr->hist[op][phase][i];
+            }
+        }
+    }
+    Ns_MutexUnlock(&latencyLock);
+    ns_free(latPtr);
+}
+
+static dbLatency *LatencyGet(void)
+{
+    dbLatency *latPtr = Ns_TlsGet(&latencyTls);
+
+    if (unlikely(latPtr == NULL)) {
+        latPtr = ns_calloc(1u, sizeof(dbLatency));
+        Ns_TlsSet(&latencyTls, latPtr);
+        Ns_MutexLock(&latencyLock);
+        latPtr->nextPtr = latencyList;
+        latencyList = latPtr;
+        Ns_MutexUnlock(&latencyLock);
+    }
+    return latPtr;
+}
+
+static void LatencyRecord(dbLatency *latPtr, dbOp op, dbPhase phase, Tcl_WideInt usec)
+{
+    int bucket = 0;
+
+    while (bucket < LATENCY_BUCKETS - 1 && usec >= ((Tcl_WideInt)1 << bucket)) {
+        bucket++;
+    }
+    latPtr->usec[op][phase] += usec;
+    latPtr->hist[op][phase][bucket]++;
+}
+
+/*
+ * Account the time since start to the transaction or row phase of the
+ * current operation.
+ */
+static void LatencyPhase(dbPhase phase, Tcl_WideInt start)
+{
+    if (dbLatencyEnabled) {
+        dbLatency  *latPtr = LatencyGet();
+        Tcl_WideInt usec = LatencyNow() - start;
+
+        if (phase == PhaseTxn) {
+            latPtr->txnUsec += usec;
+        } else {
+            latPtr->rowUsec += usec;
+        }
+    }
+}
+
+static void LatencyBegin(void)
+{
+    if (dbLatencyEnabled) {
+        dbLatency *latPtr = LatencyGet();
+
+        latPtr->txnUsec = latPtr->rowUsec = 0;
+    }
+}
+
+static void LatencyEnd(dbOp op, Tcl_WideInt start, bool failed)
+{
+    if (dbLatencyEnabled && op != OpNone) {
+        dbLatency  *latPtr = LatencyGet();
+        Tcl_WideInt total = LatencyNow() - start;
+        Tcl_WideInt engine = total - latPtr->txnUsec - latPtr->rowUsec;
+
+        latPtr->count[op]++;
+        if (failed) {
+            latPtr->errors[op]++;
+        }
+        LatencyRecord(latPtr, op, PhaseTotal, total);
+        LatencyRecord(latPtr, op, PhaseTxn, latPtr->txnUsec);
+        LatencyRecord(latPtr, op, PhaseEngine, engine > 0 ? engine : 0);
+        LatencyRecord(latPtr, op, PhaseRow, latPtr->rowUsec);
+    }
+}
+
+/*
+ * Sum up the counters of all threads minus the base. Must be called with
+ * latencyLock held.
+ */
+static void LatencySum(dbLatency *sumPtr)
+{
+    const dbLatency *latPtr;
+    int              op, phase, i;
+
+    *sumPtr = latencyRetired;
+    for (latPtr = latencyList; latPtr != NULL; latPtr = latPtr->nextPtr) {
+        for (op = 0; op < OpNone; op++) {
+            sumPtr->count[op] += latPtr->count[op];
+            sumPtr->errors[op] += latPtr->errors[op];
+            for (phase = 0; phase < PhaseNone; phase++) {
+                sumPtr->usec[op][phase] += latPtr->usec[op][phase];
+                for (i = 0; i < LATENCY_BUCKETS; i++) {
+                    sumPtr->hist[op][phase][i] += latPtr->hist[op][phase][i];
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Return the latency statistics as a dict, keyed by operation, and
+ * optionally reset them.
+ */
+static Tcl_Obj *LatencyObj(bool reset)
+{
+    dbLatency *sumPtr = ns_malloc(sizeof(dbLatency));
+    Tcl_Obj   *resultObj = Tcl_NewDictObj();
+    int        op, phase, i;
+
+    Ns_MutexLock(&latencyLock);
+    LatencySum(sumPtr);
+    for (op = 0; op < OpNone; op++) {
+        Tcl_Obj *opObj;
+
+        sumPtr->count[op] -= latencyBase.count[op];
+        if (sumPtr->count[op] <= 0) {
+            continue;
+        }
+        opObj = Tcl_NewDictObj();
+        Tcl_DictObjPut(NULL, opObj, Tcl_NewStringObj("count", 5), Tcl_NewWideIntObj(sumPtr->count[op]));
+        Tcl_DictObjPut(NULL, opObj, Tcl_NewStringObj("errors", 6),
+                       Tcl_NewWideIntObj(sumPtr->errors[op] - latencyBase.errors[op]));
+        for (phase = 0; phase < PhaseNone; phase++) {
+            Tcl_Obj *phaseObj = Tcl_NewDictObj(), *histObj = Tcl_NewDictObj();
+
+            Tcl_DictObjPut(NULL, phaseObj, Tcl_NewStringObj("usec", 4),
+                           Tcl_NewWideIntObj(sumPtr->usec[op][phase] - latencyBase.usec[op][phase]));
+            for (i = 0; i < LATENCY_BUCKETS; i++) {
+                Tcl_WideInt n = sumPtr->hist[op][phase][i] - latencyBase.hist[op][phase][i];
+
+                if (n > 0) {
+                    Tcl_DictObjPut(NULL, histObj, Tcl_NewWideIntObj((Tcl_WideInt)1 << i), Tcl_NewWideIntObj(n));
+                }
+            }
+            Tcl_DictObjPut(NULL, phaseObj, Tcl_NewStringObj("hist", 4), histObj);
+            Tcl_DictObjPut(NULL, opObj, Tcl_NewStringObj(phaseNames[phase], TCL_INDEX_NONE), phaseObj);
+        }
+        Tcl_DictObjPut(NULL, resultObj, Tcl_NewStringObj(opNames[op], TCL_INDEX_NONE), opObj);
+    }
+    if (reset) {
+        LatencySum(&latencyBase);
+    }
+    Ns_MutexUnlock(&latencyLock);
+    ns_free(sumPtr);
+    return resultObj;
+}
+
+/*
+ * Map a query to the operation it performs.
+ */
+static dbOp QueryOp(const char *query)
+{
+    static const struct {
+        const char *prefix;
+        size_t      length;
+        dbOp        op;
+    } ops[] = {
+        {"GET ", 4, OpGet}, {"MGET ", 5, OpMget}, {"CHECK ", 6, OpCheck},
+        {"PUT", 3, OpPut}, {"DEL ", 4, OpDel}, {"MPUT", 4, OpMput},
+        {"MDEL ", 5, OpMdel}, {"CURSOR", 6, OpCursor}, {"BEGIN", 5, OpBegin},
+        {"COMMIT", 6, OpCommit}, {"ABORT", 5, OpAbort}, {"COMPACT", 7, OpCompact},
+        {"TRUNCATE", 8, OpTruncate}, {"INCR ", 5, OpIncr}, {"DECR ", 5, OpIncr},
+        {"CAS", 3, OpCas}, {"GETALL ", 7, OpGetall}
+    };
+    size_t i;
+
+    for (i = 0u; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        if (strncasecmp(query, ops[i].prefix, ops[i].length) == 0) {
+            return ops[i].op;
+        }
+    }
+    return OpNone;
+}
+
 NS_EXPORT int Ns_ModuleVersion = 1;
 NS_EXPORT NsDb_DriverInitProc Ns_DbDriverInit;
 
+/*
+ * The driver might be loaded several times under different names. The
+ * environments are opened on demand by the first handle of a pool, see
+ * GetPool().
+ */
 NS_EXPORT int Ns_DbDriverInit(const char *hModule, const char *configPath)
 {
-    int         rc;
-    const char *str;
-    Tcl_DString ds;
-
-    if (dbEnv != NULL) {
-        Ns_Log(Error, "nsdbbdb: db_env has already been initialized");
-        return NS_ERROR;
-    }
+    static bool initialized = NS_FALSE, sampling = NS_FALSE, reaping = NS_FALSE;
+#ifndef LMDB
+    static bool compacting = NS_FALSE;
+#endif
+    int         interval = 0;
 
     Ns_Log(Notice, "loading module %s version %s using %s",
            hModule, MODULE_VERSION,
@@ -220,161 +681,523 @@ NS_EXPORT int Ns_DbDriverInit(const char *hModule, const char *configPath)
 #endif
            );
 
-    Tcl_InitHashTable(&dbTable, TCL_ONE_WORD_KEYS);
-    Ns_MutexInit(&dbLock);
-    BdbDebug = Ns_CreateLogSeverity("Debug(bdb)");
+    if (!initialized) {
+        Tcl_InitHashTable(&dbTable, TCL_STRING_KEYS);
+        Tcl_InitHashTable(&poolTable, TCL_STRING_KEYS);
+        Tcl_InitHashTable(&envTable, TCL_STRING_KEYS);
+        Ns_MutexInit(&dbLock);
+        Ns_MutexInit(&latencyLock);
+        Ns_TlsAlloc(&latencyTls, LatencyThreadCleanup);
+        BdbDebug = Ns_CreateLogSeverity("Debug(bdb)");
+        Ns_RegisterAtExit(DbShutdown, 0);
+        initialized = NS_TRUE;
+    }
 
     if (Ns_DbRegisterDriver(hModule, dbProcs) != NS_OK) {
         Ns_Log(Error, "nsdbbdb: could not register the %s/%s driver", dbName, hModule);
         return NS_ERROR;
     }
 
-    rc = NS_DB_ENV_CREATE(&dbEnv);
-    if (rc != 0) {
-        Ns_Log(Error, "nsdbbdb: db_env_create: %s", NS_DB_STRERR(rc));
-        return NS_ERROR;
+    configPath = Ns_ConfigGetPath(0, 0, "db", "pool", hModule, (char *)0L);
+    Ns_ConfigGetBool(configPath, "debug", (bool *)&dbDebug);
+    if (dbDebug) {
+        Ns_LogSeveritySetEnabled(BdbDebug, NS_TRUE);
     }
 
-    Tcl_DStringInit(&ds);
-    configPath = Ns_ConfigGetPath(0, 0, "db", "pool", hModule, (char *)0L);
-    dbDelimiter = Ns_ConfigGetValue(configPath, "delimiter");
-    if (dbDelimiter == NULL) {
-        dbDelimiter = "\n";
+    /*
+     * The latency statistics are collected per thread for all handles of
+     * all drivers, so they are enabled when the section of any driver
+     * asks for them.
+     */
+    {
+        bool latency = NS_FALSE;
+
+        Ns_ConfigGetBool(configPath, "latency", &latency);
+        if (latency) {
+            dbLatencyEnabled = NS_TRUE;
+        }
     }
-    if ((dbHome = Ns_ConfigGetValue(configPath, "home"))) {
-        Tcl_DStringAppend(&ds, dbHome, TCL_INDEX_NONE);
+
+    /*
+     * Write the statistics of all opened databases periodically to the
+     * log.
+     */
+    Ns_ConfigGetInt(configPath, "statsinterval", &interval);
+    if (interval > 0 && !sampling) {
+        Ns_Time t;
+
+        t.sec = interval;
+        t.usec = 0;
+        Ns_ScheduleProcEx(DbSampleStats, NULL, NS_SCHED_THREAD, &t, NULL);
+        sampling = NS_TRUE;
     }
-    if (ds.length == 0) {
-        Ns_DStringPrintf(&ds, "%s/db", Ns_InfoHomePath());
+
+    /*
+     * Delete expired keys of pools with the parameter ttl periodically.
+     */
+    Ns_ConfigGetInt(configPath, "ttlinterval", &ttlInterval);
+    Ns_ConfigGetInt(configPath, "ttlbatch", &ttlBatch);
+    if (ttlBatch < 1) {
+        ttlBatch = 1;
     }
-    dbHome = ns_strdup(ds.string);
+    if (ttlInterval > 0 && !reaping) {
+        Ns_Time t;
+
+        t.sec = ttlInterval;
+        t.usec = 0;
+        Ns_ScheduleProcEx(DbReapExpired, NULL, NS_SCHED_THREAD, &t, NULL);
+        reaping = NS_TRUE;
+    }
+
 #ifndef LMDB
-    Ns_ConfigGetInt(configPath, "pagesize", (int *)&dbPageSize);
-    Ns_ConfigGetInt(configPath, "cachesize", (int *)&dbCacheSize);
-    Ns_ConfigGetInt(configPath, "hfactor", (int *)&dbHFactor);
-    Ns_ConfigGetInt(configPath, "btminkey", (int *)&dbBtMinKey);
-    Ns_ConfigGetBool(configPath, "dbsync", (bool *)&dbSync);
+    /*
+     * Compact the opened databases in small slices in the background.
+     */
+    Ns_ConfigGetInt(configPath, "compactinterval", &compactInterval);
+    Ns_ConfigGetInt(configPath, "compactpages", &compactPages);
+    Ns_ConfigGetInt(configPath, "compacttimeout", &compactTimeout);
+    Ns_ConfigGetInt(configPath, "compactcheck", &compactCheck);
+    if (compactPages < 1) {
+        compactPages = 1;
+    }
+    if (compactInterval > 0 && !compacting) {
+        Ns_Time t;
+
+        t.sec = compactInterval;
+        t.usec = 0;
+        Ns_ScheduleProcEx(DbCompactSlices, NULL, NS_SCHED_THREAD, &t, NULL);
+        compacting = NS_TRUE;
+    }
 #endif
-    Ns_ConfigGetBool(configPath, "debug", (bool *)&dbDebug);
+    return NS_OK;
+}
 
-    if (dbDebug) {
-        Ns_LogSeveritySetEnabled(BdbDebug, NS_TRUE);
+/*
+ * Read the parameters of a pool from the given config section. Only
+ * parameters set in this section are changed.
+ */
+static void ConfigurePool(dbPool *poolPtr, dbEnvironment *envPtr, const char *configPath)
+{
+    const char *str;
+
+    if ((str = Ns_ConfigGetValue(configPath, "delimiter")) != NULL) {
+        poolPtr->delimiter = str;
+        poolPtr->delimiterLength = strlen(str);
+    }
+    if ((str = Ns_ConfigGetValue(configPath, "home")) != NULL && *str != '\0') {
+        envPtr->home = str;
+    }
+#ifndef LMDB
+    Ns_ConfigGetInt(configPath, "pagesize", (int *)&poolPtr->pageSize);
+    Ns_ConfigGetInt(configPath, "cachesize", (int *)&envPtr->cacheSize);
+    Ns_ConfigGetInt(configPath, "bulksize", (int *)&poolPtr->bulkSize);
+    /*
+     * Bulk buffers must be a multiple of 1024 bytes.
+     */
+    poolPtr->bulkSize = (poolPtr->bulkSize + 1023u) & ~1023u;
+    Ns_ConfigGetInt(configPath, "hfactor", (int *)&poolPtr->hFactor);
+    Ns_ConfigGetInt(configPath, "btminkey", (int *)&poolPtr->btMinKey);
+    Ns_ConfigGetBool(configPath, "dbsync", (bool *)&poolPtr->sync);
+#else
+    Ns_ConfigGetInt(configPath, "maxreaders", (int *)&envPtr->maxReaders);
+#endif
+    Ns_ConfigGetBool(configPath, "binary", (bool *)&poolPtr->binary);
+    if ((str = Ns_ConfigGetValue(configPath, "keytype")) != NULL) {
+        if (strcmp(str, "int32") == 0) {
+            poolPtr->keyType = KeyInt32;
+        } else if (strcmp(str, "int64") == 0) {
+            poolPtr->keyType = KeyInt64;
+        } else if (strcmp(str, "uint64-be") == 0) {
+            poolPtr->keyType = KeyUint64Be;
+        } else if (strcmp(str, "string") == 0) {
+            poolPtr->keyType = KeyString;
+        } else {
+            Ns_Log(Warning, "nsdbbdb: ignoring invalid keytype '%s', expected int32, int64,"
+                   " uint64-be or string", str);
+        }
+    }
+    Ns_ConfigGetInt(configPath, "keycache", (int *)&poolPtr->keyCacheSize);
+    Ns_ConfigGetBool(configPath, "ttl", &poolPtr->ttl);
+    if ((str = Ns_ConfigGetValue(configPath, "bloomfpr")) != NULL) {
+        double fpr = strtod(str, NULL);
+
+        if (fpr < 0.0 || fpr >= 0.5) {
+            Ns_Log(Warning, "nsdbbdb: ignoring invalid bloomfpr '%s', expected a value"
+                   " between 0 and 0.5", str);
+        } else {
+            poolPtr->bloomFpr = fpr;
+        }
+    }
+    if ((str = Ns_ConfigGetValue(configPath, "compactfree")) != NULL) {
+        double ratio = strtod(str, NULL);
+
+        if (ratio < 0.0 || ratio >= 1.0) {
+            Ns_Log(Warning, "nsdbbdb: ignoring invalid compactfree '%s', expected a value"
+                   " between 0 and 1", str);
+        } else {
+#ifdef LMDB
+            envPtr->compactFree = ratio;
+#else
+            poolPtr->compactFree = ratio;
+#endif
+        }
     }
 
     /*
      * DB flags
      */
     str = Ns_ConfigGetValue(configPath, "dbflags");
-    if (str == NULL) {
-        str = "";
-    }
-    if (strstr(str, "dup")) {
+    if (str != NULL) {
+        if (strstr(str, "dup")) {
 #ifdef LMDB
-        Ns_Log(Warning, "nsdbbdb: ignoring DB flag 'dup'");
+            poolPtr->dbFlags |= MDB_DUPSORT;
 #else
-        dbDbFlags |= DB_DUP;
+            poolPtr->dbFlags |= DB_DUP;
 #endif
-    }
-    if (strstr(str, "onlycommitted") != NULL) {
+        }
+        if (strstr(str, "dupfixed")) {
+            /*
+             * Berkeley DB has no fixed size duplicates, but stores sorted
+             * duplicates in a tree of their own as well.
+             */
+#ifdef LMDB
+            poolPtr->dbFlags |= MDB_DUPFIXED;
+#else
+            poolPtr->dbFlags |= DB_DUPSORT;
+#endif
+        }
+        if (strstr(str, "onlycommitted") != NULL) {
 #ifdef LMDB
-        Ns_Log(Warning, "nsdbbdb: ignoring DB flag 'onlycommitted'");
+            Ns_Log(Warning, "nsdbbdb: ignoring DB flag 'onlycommitted'");
 #else
-        dbDbFlags &= ~(unsigned int)DB_READ_UNCOMMITTED;
+            poolPtr->dbFlags &= ~(unsigned int)DB_READ_UNCOMMITTED;
 #endif
+        }
     }
 
     /*
      *  Environment flags
      */
     str = Ns_ConfigGetValue(configPath, "envflags");
-    if (str == NULL) {
-        str = "";
-    }
-    if (!strstr(str, "nolock")) {
+    if (str != NULL) {
 #ifdef LMDB
-        dbEnvFlags |= MDB_NOLOCK;
+        if (strstr(str, "nolock") != NULL) {
+            envPtr->envFlags |= MDB_NOLOCK;
+        }
 #else
-        dbEnvFlags |= DB_INIT_LOCK;
+        if (strstr(str, "nolock") != NULL) {
+            envPtr->envFlags &= ~(unsigned int)DB_INIT_LOCK;
+        }
 #endif
-    }
-    if (strstr(str, "nolog") != NULL) {
+        if (strstr(str, "nolog") != NULL) {
 #ifdef LMDB
-        Ns_Log(Warning, "nsdbbdb: ignoring environment flag 'nolog'");
+            Ns_Log(Warning, "nsdbbdb: ignoring environment flag 'nolog'");
 #else
-        dbEnvFlags |= DB_INIT_LOG;
+            envPtr->envFlags |= DB_INIT_LOG;
 #endif
-    }
-    if (strstr(str, "notxn") != NULL) {
+        }
+        if (strstr(str, "notxn") != NULL) {
 #ifdef LMDB
-        Ns_Log(Warning, "nsdbbdb: ignoring environment flag 'notxn'");
+            Ns_Log(Warning, "nsdbbdb: ignoring environment flag 'notxn'");
 #else
-        dbEnvFlags |= DB_INIT_TXN | DB_RECOVER;
+            envPtr->envFlags |= DB_INIT_TXN | DB_RECOVER;
 #endif
-    }
-    if (strstr(str, "noprivate") != NULL) {
+        }
+        if (strstr(str, "noprivate") != NULL) {
 #ifdef LMDB
-        Ns_Log(Warning, "nsdbbdb: ignoring environment flag 'noprivate'");
+            Ns_Log(Warning, "nsdbbdb: ignoring environment flag 'noprivate'");
 #else
-        dbEnvFlags |= DB_PRIVATE;
+            envPtr->envFlags |= DB_PRIVATE;
 #endif
-    }
-    if (strstr(str, "onlycommitted") != NULL) {
+        }
+        if (strstr(str, "onlycommitted") != NULL) {
 #ifdef LMDB
-        Ns_Log(Warning, "nsdbbdb: ignoring environment flag 'onlycommitted'");
+            Ns_Log(Warning, "nsdbbdb: ignoring environment flag 'onlycommitted'");
 #else
-        dbEnvFlags &= ~(unsigned int)DB_READ_UNCOMMITTED;
+            envPtr->envFlags &= ~(unsigned int)DB_READ_UNCOMMITTED;
 #endif
+        }
     }
+}
 
 #ifdef LMDB
-#else
-    if (dbCacheSize) {
-        dbEnv->set_cachesize(dbEnv, 0, dbCacheSize, 0);
-    }
-    dbEnv->set_lk_detect(dbEnv, DB_LOCK_DEFAULT);
-    dbEnv->set_errpfx(dbEnv, "nsdbbdb");
-    dbEnv->set_errcall(dbEnv, DbError);
-    dbEnv->set_alloc(dbEnv, ns_malloc, ns_realloc, ns_free);
-#endif
-
-    mkdir(dbHome, 0777);
+/*
+ * Number of pages on the free list of an environment, which are reused by
+ * later writes, but never returned to the filesystem.
+ */
+static int FreePages(NS_DB_ENV *env, Tcl_WideInt *pagesPtr)
+{
+    NS_DB_TXN    *txn;
+    NS_DB_CURSOR *cursor;
+    NS_DB_VAL     key, data;
+    int           rc;
 
-    if ((rc = NS_DB_ENV_OPEN(dbEnv, dbHome, dbEnvFlags)) != 0) {
-        NS_DB_ENV_ERR(dbEnv, rc, "environment open");
-        NS_DB_ENV_CLOSE(dbEnv);
-        Tcl_DStringFree(&ds);
-        dbEnv = NULL;
-        return NS_ERROR;
+    *pagesPtr = 0;
+    rc = mdb_txn_begin(env, NULL, MDB_RDONLY, &txn);
+    if (rc != 0) {
+        return rc;
     }
+    /*
+     * The free list is database 0, every record is a list of page numbers
+     * prefixed by their count.
+     */
+    rc = mdb_cursor_open(txn, 0, &cursor);
+    if (rc == 0) {
+        while ((rc = mdb_cursor_get(cursor, &key, &data, MDB_NEXT)) == 0) {
+            size_t count;
 
-    Ns_RegisterAtExit(DbShutdown, 0);
-    //Ns_Log(Notice, "%s/%s: Home=%s, Cache=%ud, Flags=%x", dbName, hModule, dbHome, dbCacheSize, dbEnvFlags);
-    Tcl_DStringFree(&ds);
-    return NS_OK;
+            memcpy(&count, data.mv_data, sizeof(count));
+            *pagesPtr += (Tcl_WideInt)count;
+        }
+        mdb_cursor_close(cursor);
+        if (rc == MDB_NOTFOUND) {
+            rc = 0;
+        }
+    }
+    mdb_txn_abort(txn);
+    return rc;
 }
 
-
-static void DbShutdown(void *UNUSED(arg))
+/*
+ * Replace the data file of a freshly opened environment by a compacted
+ * copy, when the free fraction of its pages exceeds compactfree. The
+ * environment must not be used by other processes. Returns true, when the
+ * environment was closed and has to be opened again.
+ */
+static bool CompactEnv(dbEnvironment *envPtr)
 {
-    Tcl_HashEntry *hPtr;
-    Tcl_HashSearch search;
+    MDB_envinfo  info;
+    Tcl_WideInt  freePages;
+    Tcl_DString  copy, file;
+    double       ratio;
+    int          dead, rc;
 
-    hPtr = Tcl_FirstHashEntry(&dbTable, &search);
-    while (hPtr != NULL) {
-        dbConn *conn;
+    (void) mdb_reader_check(envPtr->env, &dead);
+    rc = mdb_env_info(envPtr->env, &info);
+    if (rc == 0) {
+        rc = FreePages(envPtr->env, &freePages);
+    }
+    if (rc != 0) {
+        Ns_Log(Warning, "nsdbbdb: free pages of %s: %s", envPtr->home, NS_DB_STRERR(rc));
+        return NS_FALSE;
+    }
+    ratio = (double)freePages / (double)(info.me_last_pgno + 1u);
+    if (ratio < envPtr->compactFree) {
+        return NS_FALSE;
+    }
+
+    Tcl_DStringInit(&copy);
+    Tcl_DStringInit(&file);
+    Ns_DStringPrintf(&copy, "%s/compact", envPtr->home);
+    Ns_DStringPrintf(&file, "%s/data.mdb", copy.string);
+    (void) unlink(file.string);
+    if (mkdir(copy.string, 0777) != 0 && errno != EEXIST) {
+        rc = errno;
+    } else {
+        rc = mdb_env_copy2(envPtr->env, copy.string, MDB_CP_COMPACT);
+    }
+    if (rc == 0) {
+        Tcl_DString data;
+
+        NS_DB_ENV_CLOSE(envPtr->env);
+        envPtr->env = NULL;
+        Tcl_DStringInit(&data);
+        Ns_DStringPrintf(&data, "%s/data.mdb", envPtr->home);
+        if (rename(file.string, data.string) != 0) {
+            Ns_Log(Error, "nsdbbdb: rename %s to %s: %s", file.string, data.string, strerror(errno));
+        } else {
+            Ns_Log(Notice, "nsdbbdb: compacted environment %s, %" TCL_LL_MODIFIER "d of %lu pages were free",
+                   envPtr->home, freePages, (unsigned long)info.me_last_pgno + 1u);
+        }
+        Tcl_DStringFree(&data);
+    } else {
+        Ns_Log(Warning, "nsdbbdb: compacting environment %s: %s", envPtr->home, NS_DB_STRERR(rc));
+        (void) unlink(file.string);
+    }
+    (void) rmdir(copy.string);
+    Tcl_DStringFree(&file);
+    Tcl_DStringFree(&copy);
+    return (rc == 0);
+}
+#endif
+
+/*
+ * Create and open the environment in the given home directory.
+ */
+static int OpenEnv(dbEnvironment *envPtr)
+{
+    int rc;
+
+    rc = NS_DB_ENV_CREATE(&envPtr->env);
+    if (rc != 0) {
+        Ns_Log(Error, "nsdbbdb: db_env_create: %s", NS_DB_STRERR(rc));
+        return NS_ERROR;
+    }
+#ifdef LMDB
+    /*
+     * Every handle keeps its own read-only transaction, which occupies a
+     * reader slot even when it is reset. Pools larger than the LMDB default
+     * of 126 readers have to raise the limit.
+     */
+    if (envPtr->maxReaders) {
+        mdb_env_set_maxreaders(envPtr->env, envPtr->maxReaders);
+    }
+#else
+    if (envPtr->cacheSize) {
+        envPtr->env->set_cachesize(envPtr->env, 0, envPtr->cacheSize, 0);
+    }
+    envPtr->env->set_lk_detect(envPtr->env, DB_LOCK_DEFAULT);
+    envPtr->env->set_errpfx(envPtr->env, "nsdbbdb");
+    envPtr->env->set_errcall(envPtr->env, DbError);
+    envPtr->env->set_alloc(envPtr->env, ns_malloc, ns_realloc, ns_free);
+#endif
 
-        conn = (dbConn *)Tcl_GetHashKey(&dbTable, hPtr);
-        if (conn->dbi != 0) {
-            Ns_Log(Notice, "DbShutdown: %p: closing %s", (void*)conn, dbHome);
-            NS_DB_DBI_CLOSE(dbEnv, conn->dbi);
+    mkdir(envPtr->home, 0777);
+
+    if ((rc = NS_DB_ENV_OPEN(envPtr->env, envPtr->home, envPtr->envFlags)) != 0) {
+        NS_DB_ENV_ERR(envPtr->env, rc, "environment open");
+        NS_DB_ENV_CLOSE(envPtr->env);
+        envPtr->env = NULL;
+        return NS_ERROR;
+    }
+    Ns_Log(Notice, "nsdbbdb: opened environment %s, flags %x", envPtr->home, envPtr->envFlags);
+#ifdef LMDB
+    if (envPtr->compactFree > 0.0 && CompactEnv(envPtr)) {
+        double compactFree = envPtr->compactFree;
+
+        envPtr->compactFree = 0.0;
+        rc = OpenEnv(envPtr);
+        envPtr->compactFree = compactFree;
+        return rc;
+    }
+#endif
+    return NS_OK;
+}
+
+/*
+ * Return the environment in the given home directory, opening it with the
+ * configuration of envPtr on first use. Must be called with dbLock held.
+ */
+static dbEnvironment *GetEnv(const char *home, const dbEnvironment *configPtr)
+{
+    Tcl_HashEntry *hPtr;
+    dbEnvironment *envPtr;
+    int            isNew;
+
+    hPtr = Tcl_CreateHashEntry(&envTable, home, &isNew);
+    if (isNew == 0) {
+        envPtr = Tcl_GetHashValue(hPtr);
+        if (envPtr->envFlags != configPtr->envFlags) {
+            Ns_Log(Warning, "nsdbbdb: environment %s is already opened with flags %x",
+                   home, envPtr->envFlags);
         }
+        return envPtr;
+    }
+    envPtr = ns_malloc(sizeof(dbEnvironment));
+    *envPtr = *configPtr;
+    envPtr->home = Tcl_GetHashKey(&envTable, hPtr);
+    if (OpenEnv(envPtr) != NS_OK) {
+        Tcl_DeleteHashEntry(hPtr);
+        ns_free(envPtr);
+        return NULL;
+    }
+    Tcl_SetHashValue(hPtr, envPtr);
+    return envPtr;
+}
+
+/*
+ * Return the configuration of the pool of the handle, opening its
+ * environment on first use. Pools with the same home directory share the
+ * environment, which is configured by the first of them. Must be called
+ * with dbLock held.
+ */
+static dbPool *GetPool(const Ns_DbHandle *handle)
+{
+    Tcl_HashEntry *poolEntry;
+    dbPool        *poolPtr;
+    dbEnvironment  env;
+    Tcl_DString    ds;
+    int            isNew;
+
+    poolEntry = Tcl_CreateHashEntry(&poolTable, handle->poolname, &isNew);
+    if (isNew == 0) {
+        return Tcl_GetHashValue(poolEntry);
+    }
+
+    poolPtr = ns_calloc(1u, sizeof(dbPool));
+    poolPtr->name = Tcl_GetHashKey(&poolTable, poolEntry);
+    poolPtr->delimiter = "\n";
+    poolPtr->delimiterLength = 1u;
+    memset(&env, 0, sizeof(env));
+#ifdef LMDB
+    env.envFlags = MDB_NOTLS;
+#else
+    poolPtr->dbFlags = DB_READ_UNCOMMITTED;
+    poolPtr->sync = NS_TRUE;
+    env.envFlags = DB_CREATE | DB_THREAD | DB_INIT_MPOOL | DB_READ_UNCOMMITTED | DB_INIT_LOCK;
+#endif
+    ConfigurePool(poolPtr, &env, Ns_ConfigGetPath(0, 0, "db", "pool", handle->driver, (char *)0L));
+    if (strcmp(handle->driver, handle->poolname) != 0) {
+        ConfigurePool(poolPtr, &env, Ns_ConfigGetPath(0, 0, "db", "pool", handle->poolname, (char *)0L));
+    }
+
+    Tcl_DStringInit(&ds);
+    if (env.home != NULL) {
+        Tcl_DStringAppend(&ds, env.home, TCL_INDEX_NONE);
+    } else {
+        Ns_DStringPrintf(&ds, "%s/db", Ns_InfoHomePath());
+    }
+
+    poolPtr->envPtr = GetEnv(ds.string, &env);
+    if (poolPtr->envPtr == NULL) {
+        Tcl_DeleteHashEntry(poolEntry);
+        ns_free(poolPtr);
+        Tcl_DStringFree(&ds);
+        return NULL;
+    }
+    poolPtr->env = poolPtr->envPtr->env;
+    Tcl_SetHashValue(poolEntry, poolPtr);
+    Ns_Log(Notice, "nsdbbdb: pool %s uses environment %s", handle->poolname, ds.string);
+    Tcl_DStringFree(&ds);
+    return poolPtr;
+}
+
+
+static void DbShutdown(void *UNUSED(arg))
+{
+    Tcl_HashEntry *hPtr;
+    Tcl_HashSearch search;
+
+    Ns_MutexLock(&dbLock);
+    hPtr = Tcl_FirstHashEntry(&dbTable, &search);
+    while (hPtr != NULL) {
+        dbShared *sharedPtr = Tcl_GetHashValue(hPtr);
+
+        Ns_Log(Notice, "DbShutdown: closing %s (%d handles)",
+               (char *)Tcl_GetHashKey(&dbTable, hPtr), sharedPtr->refCount);
+        CloseShared(sharedPtr);
         hPtr = Tcl_NextHashEntry(&search);
     }
     Tcl_DeleteHashTable(&dbTable);
-    if (dbEnv != NULL) {
-        NS_DB_ENV_CLOSE(dbEnv);
+
+    hPtr = Tcl_FirstHashEntry(&envTable, &search);
+    while (hPtr != NULL) {
+        dbEnvironment *envPtr = Tcl_GetHashValue(hPtr);
+
+        Ns_Log(Notice, "DbShutdown: closing environment %s", envPtr->home);
+        NS_DB_ENV_CLOSE(envPtr->env);
+        ns_free(envPtr);
+        hPtr = Tcl_NextHashEntry(&search);
+    }
+    Tcl_DeleteHashTable(&envTable);
+
+    hPtr = Tcl_FirstHashEntry(&poolTable, &search);
+    while (hPtr != NULL) {
+        ns_free(Tcl_GetHashValue(hPtr));
+        hPtr = Tcl_NextHashEntry(&search);
     }
-    dbEnv = 0;
+    Tcl_DeleteHashTable(&poolTable);
+    Ns_MutexUnlock(&dbLock);
 }
 
 static const char *DbName(void)
@@ -389,13 +1212,121 @@ static const char *DbDbType(void)
 }
 
 /*
- * Does both the SQLAllocConnect AND the SQLConnect
- *
+ * Typed keys (keytype) are given and returned as decimal text. They are
+ * stored with a fixed width in big endian byte order, signed types with
+ * the sign bit flipped, so the default bytewise order of both engines is
+ * the numeric order and the databases stay readable by the standard
+ * tools.
  */
+static size_t KeyWidth(dbKeyType keyType)
+{
+    return (keyType == KeyString) ? 0u : (keyType == KeyInt32) ? 4u : 8u;
+}
 
-static int DbOpenDb(Ns_DbHandle *handle)
+static int CompareBytes(const NS_DB_VAL *a, const NS_DB_VAL *b)
+{
+    size_t length = NS_DB_VAL_SIZE(*a) < NS_DB_VAL_SIZE(*b) ? NS_DB_VAL_SIZE(*a) : NS_DB_VAL_SIZE(*b);
+    int    rc = memcmp(NS_DB_VAL_DATA(*a), NS_DB_VAL_DATA(*b), length);
+
+    if (rc == 0) {
+        rc = (NS_DB_VAL_SIZE(*a) > NS_DB_VAL_SIZE(*b)) - (NS_DB_VAL_SIZE(*a) < NS_DB_VAL_SIZE(*b));
+    }
+    return rc;
+}
+
+static uint64_t KeyNumber(const unsigned char *bytes, size_t width)
+{
+    uint64_t value = 0u;
+    size_t   i;
+
+    for (i = 0u; i < width; i++) {
+        value = (value << 8) | bytes[i];
+    }
+    return value;
+}
+
+/*
+ * Convert a key given as text into its stored form in buf, which has room
+ * for 8 bytes. String keys are left unchanged.
+ */
+static int EncodeKey(const dbPool *poolPtr, NS_DB_VAL *keyPtr, unsigned char *buf)
+{
+    char     text[TCL_INTEGER_SPACE], *end;
+    size_t   i, width = KeyWidth(poolPtr->keyType), length = NS_DB_VAL_SIZE(*keyPtr);
+    uint64_t value;
+
+    if (width == 0u) {
+        return NS_OK;
+    }
+    if (length > 0u && ((const char *)NS_DB_VAL_DATA(*keyPtr))[length - 1u] == '\0') {
+        length--;
+    }
+    if (length == 0u || length >= sizeof(text)) {
+        return NS_ERROR;
+    }
+    memcpy(text, NS_DB_VAL_DATA(*keyPtr), length);
+    text[length] = '\0';
+    if ((text[0] < '0' || text[0] > '9') && (text[0] != '-' || poolPtr->keyType == KeyUint64Be)) {
+        return NS_ERROR;
+    }
+    errno = 0;
+    if (poolPtr->keyType == KeyUint64Be) {
+        value = strtoull(text, &end, 10);
+    } else {
+        long long number = strtoll(text, &end, 10);
+
+        if (poolPtr->keyType == KeyInt32) {
+            if (number < INT32_MIN || number > INT32_MAX) {
+                return NS_ERROR;
+            }
+            value = (uint64_t)(number - INT32_MIN);
+        } else {
+            value = (uint64_t)number ^ (UINT64_C(1) << 63);
+        }
+    }
+    if (*end != '\0' || errno != 0) {
+        return NS_ERROR;
+    }
+    for (i = width; i > 0u; i--) {
+        buf[i - 1u] = (unsigned char)value;
+        value >>= 8;
+    }
+    NS_DB_VAL_DATA(*keyPtr) = buf;
+    NS_DB_VAL_SIZE(*keyPtr) = (NS_DB_SIZE_T)width;
+    return NS_OK;
+}
+
+/*
+ * Text of a stored key for rows and dumps. Typed keys are formatted into
+ * buf, which has room for TCL_INTEGER_SPACE bytes.
+ */
+static void DecodeKey(const dbPool *poolPtr, const NS_DB_VAL *keyPtr, char *buf, NS_DB_VAL *textPtr)
+{
+    size_t width = KeyWidth(poolPtr->keyType);
+
+    *textPtr = *keyPtr;
+    if (width > 0u && NS_DB_VAL_SIZE(*keyPtr) == width) {
+        uint64_t value = KeyNumber(NS_DB_VAL_DATA(*keyPtr), width);
+        int      length;
+
+        if (poolPtr->keyType == KeyInt32) {
+            length = snprintf(buf, TCL_INTEGER_SPACE, "%lld", (long long)value + INT32_MIN);
+        } else if (poolPtr->keyType == KeyInt64) {
+            length = snprintf(buf, TCL_INTEGER_SPACE, "%lld", (long long)(value ^ (UINT64_C(1) << 63)));
+        } else {
+            length = snprintf(buf, TCL_INTEGER_SPACE, "%llu", (unsigned long long)value);
+        }
+        NS_DB_VAL_DATA(*textPtr) = buf;
+        NS_DB_VAL_SIZE(*textPtr) = (NS_DB_SIZE_T)length;
+    }
+}
+
+/*
+ * Open the database of a datasource.
+ */
+static int OpenDbi(const dbPool *poolPtr, NS_DB_ENV *env, const char *datasource,
+                   unsigned int dbFlags, NS_DBI *dbiPtr)
 {
-    dbConn     *conn;
     const char *dbpath;
     int         rc;
     NS_DBI      dbi;
@@ -403,18 +1334,38 @@ static int DbOpenDb(Ns_DbHandle *handle)
     NS_DB_TXN  *txn;
 #else
     DBTYPE      dbtype = DB_BTREE;
+    u_int32_t   openFlags = DB_CREATE | DB_THREAD;
 #endif
 
-    Ns_Log(BdbDebug, "DbOpenDb '%s'", dbName);
-
 #ifdef LMDB
     /*
      * We need for everything in LMDB a transaction.
      * On failure, abort it.
      */
-    rc = mdb_txn_begin(dbEnv, NULL, 0, &txn);
+    rc = mdb_txn_begin(env, NULL, 0, &txn);
     if (rc == 0) {
         rc = mdb_dbi_open(txn, NULL, 0, &dbi);
+        if (rc == 0 && dbFlags != 0u) {
+            unsigned int flags;
+
+            /*
+             * The flags are stored in the database. Adding duplicates to
+             * a database with records would corrupt it.
+             */
+            rc = mdb_dbi_flags(txn, dbi, &flags);
+            if (rc == 0 && (flags & dbFlags) != dbFlags) {
+                MDB_stat st;
+
+                rc = mdb_stat(txn, dbi, &st);
+                if (rc == 0 && st.ms_entries > 0u) {
+                    Ns_Log(Error, "nsdbbdb: %s: dbflags cannot be changed for a database with records",
+                           datasource);
+                    rc = MDB_INCOMPATIBLE;
+                } else if (rc == 0) {
+                    rc = mdb_dbi_open(txn, NULL, dbFlags, &dbi);
+                }
+            }
+        }
         if (rc != 0) {
             mdb_txn_abort(txn);
         } else {
@@ -422,613 +1373,6212 @@ static int DbOpenDb(Ns_DbHandle *handle)
         }
     }
 #else
-    rc = db_create(&dbi, dbEnv, 0);
+    rc = db_create(&dbi, env, 0);
 #endif
     if (rc != 0) {
-        NS_DB_ENV_ERR(dbEnv, rc, "db_create");
+        NS_DB_ENV_ERR(env, rc, "db_create");
         return NS_ERROR;
     }
 
-    dbpath = handle->datasource;
+    dbpath = datasource;
 #ifdef LMDB
+    (void)poolPtr;
     Ns_Log(Warning, "nsdbbdb: ignoring '%s'", dbpath);
 #else
     if (strncmp(dbpath, "btree:", 6) == 0) {
         dbpath += 6;
         dbtype = DB_BTREE;
-        if (dbBtMinKey) {
-            dbi->set_bt_minkey(dbi, dbBtMinKey);
+        if (poolPtr->btMinKey) {
+            dbi->set_bt_minkey(dbi, poolPtr->btMinKey);
         }
 
     } else if (strncmp(dbpath, "hash:", 5) == 0) {
         dbpath += 5;
         dbtype = DB_HASH;
-        if (dbHFactor) {
-            dbi->set_h_ffactor(dbi, dbHFactor);
+        if (poolPtr->hFactor) {
+            dbi->set_h_ffactor(dbi, poolPtr->hFactor);
         }
     }
-    if (dbDbFlags) {
-        dbi->set_flags(dbi, dbDbFlags);
+    if (dbFlags) {
+        dbi->set_flags(dbi, dbFlags);
     }
-    if (dbPageSize) {
-        dbi->set_pagesize(dbi, dbPageSize);
+    if (poolPtr->pageSize) {
+        dbi->set_pagesize(dbi, poolPtr->pageSize);
     }
-    if ((rc = dbi->open(dbi, 0, dbpath, 0, dbtype, DB_CREATE | DB_THREAD, 0664)) != 0) {
-        NS_DB_ERR1(dbi, rc, "%s: open", handle->datasource);
+    /*
+     * Statements pass the handle's transaction, which requires the
+     * database to be opened transactionally in a txn environment.
+     */
+    if ((poolPtr->envPtr->envFlags & DB_INIT_TXN) != 0u) {
+        openFlags |= DB_AUTO_COMMIT;
+    }
+    if ((rc = dbi->open(dbi, 0, dbpath, 0, dbtype, openFlags, 0664)) != 0) {
+        NS_DB_ERR1(dbi, rc, "%s: open", datasource);
         dbi->close(dbi, 0);
         return NS_ERROR;
     }
 #endif
-    /*
-     * Finally, allocating the connection data.
-     */
-    conn = ns_calloc(1, sizeof(dbConn));
-    conn->dbi = dbi;
-    handle->connection = conn;
-    Ns_MutexLock(&dbLock);
-    Tcl_CreateHashEntry(&dbTable, (void *) conn, &rc);
-    Ns_Log(BdbDebug, "DbOpen: %p, open handles=%d", (void*)conn, dbTable.numEntries);
-    Ns_MutexUnlock(&dbLock);
+    *dbiPtr = dbi;
     return NS_OK;
 }
 
-static int DbCloseDb(Ns_DbHandle *handle)
+static void CloseShared(dbShared *sharedPtr)
 {
-    dbConn        *conn = handle->connection;
-    Tcl_HashEntry *hPtr;
+    int i;
 
-    DbCancel(handle);
-    NS_DB_DBI_CLOSE(dbEnv, conn->dbi);
-    ns_free(conn);
-    handle->connection = 0;
-    Ns_MutexLock(&dbLock);
-    hPtr = Tcl_FindHashEntry(&dbTable, (void *) conn);
-    if (hPtr != NULL) {
-        Tcl_DeleteHashEntry(hPtr);
+    if (sharedPtr->backup != NULL) {
+        BackupDestroy(sharedPtr->backup);
     }
-    Ns_Log(BdbDebug, "DbClose: %p, open handles=%d", (void*)conn, dbTable.numEntries);
-    Ns_MutexUnlock(&dbLock);
-    return NS_OK;
+    if (sharedPtr->load != NULL) {
+        LoadDestroy(sharedPtr->load);
+    }
+    if (sharedPtr->bloom != NULL) {
+        BloomDestroy(sharedPtr->bloom);
+    }
+    for (i = 0; i < sharedPtr->nShards; i++) {
+        NS_DB_DBI_CLOSE(sharedPtr->envs[i], sharedPtr->dbis[i]);
+    }
+    if (sharedPtr->ttlEnv != NULL) {
+        NS_DB_DBI_CLOSE(sharedPtr->ttlEnv, sharedPtr->ttlDbi);
+    }
+    if (sharedPtr->cache != NULL) {
+        CacheDestroy(sharedPtr->cache);
+    }
+#ifndef LMDB
+    Ns_MutexDestroy(&sharedPtr->rmwLock);
+    Ns_MutexDestroy(&sharedPtr->compact.lock);
+    Tcl_DStringFree(&sharedPtr->compact.start);
+#endif
+    ns_free(sharedPtr);
 }
 
-static int DbDML(Ns_DbHandle *UNUSED(handle), char *UNUSED(query))
+/*
+ * Drop a reference of a background thread to the datasource, which is
+ * closed when it was the last one.
+ */
+static void ReleaseShared(dbShared *sharedPtr)
 {
-    return NS_OK;
+    Ns_MutexLock(&dbLock);
+    if (--sharedPtr->refCount == 0) {
+        Tcl_DeleteHashEntry(sharedPtr->hPtr);
+        CloseShared(sharedPtr);
+    }
+    Ns_MutexUnlock(&dbLock);
 }
 
-#ifdef LMDB
 /*
- * LMDB needs for most operations a txn value. If we have no ongoing
- * transaction in conn, create a temporary one, which will be
- * committed/aborted after the operation.
+ * Path of a file or LMDB environment kept next to the database of a
+ * datasource: the datasource without access method plus suffix, relative
+ * to the home directory of the pool, unless absolute.
  */
-static int GetTempTxn(dbConn *conn, NS_DB_TXN **txnPtr)
+static void DatasourcePath(const dbPool *poolPtr, const char *datasource, const char *suffix, Tcl_DString *dsPtr)
 {
-    int rc = 0;
-    if (likely(conn->txn != NULL)) {
-        *txnPtr = conn->txn;
-    } else {
-        rc = mdb_txn_begin(dbEnv, NULL, 0, txnPtr);
+    if (strncmp(datasource, "btree:", 6) == 0) {
+        datasource += 6;
+    } else if (strncmp(datasource, "hash:", 5) == 0) {
+        datasource += 5;
     }
-    return rc;
+    if (*datasource != '/') {
+        Ns_DStringPrintf(dsPtr, "%s/", poolPtr->envPtr->home);
+    }
+    Ns_DStringPrintf(dsPtr, "%s%s", datasource, suffix);
 }
 
-static void CleanTempTxn(dbConn *conn, NS_DB_TXN *txn)
+/*
+ * Open the expiry index of a datasource, "<datasource>.ttl". In Berkeley
+ * DB, it is a database in the environment of the pool, so it is updated
+ * in the transactions of the writes. In LMDB, it is an environment of its
+ * own, since the database of a datasource is the main database of its
+ * environment.
+ */
+static int OpenTtl(dbShared *sharedPtr, const char *datasource)
 {
-    if (likely(conn->txn == NULL)) {
-        if (likely(conn->status == 0)) {
-            mdb_txn_commit(txn);
-        } else {
-            mdb_txn_abort(txn);
+    const dbPool *poolPtr = sharedPtr->pool;
+    Tcl_DString   ds;
+    int           result = NS_ERROR;
+
+    Tcl_DStringInit(&ds);
+    DatasourcePath(poolPtr, datasource, ".ttl", &ds);
+#ifdef LMDB
+    {
+        const dbEnvironment *envPtr = GetEnv(ds.string, poolPtr->envPtr);
+
+        if (envPtr != NULL && OpenDbi(poolPtr, envPtr->env, ds.string, 0u, &sharedPtr->ttlDbi) == NS_OK) {
+            sharedPtr->ttlEnv = envPtr->env;
+            result = NS_OK;
         }
-        Ns_Log(BdbDebug, "... CleanTempTxn closes cursor %p", (void*)conn->cursor);
-        conn->cursor = NULL;
     }
-}
 #else
-static int GetTempTxn(dbConn *UNUSED(conn), NS_DB_TXN **UNUSED(txnPtr))
-{
-    return 0;
+    {
+        NS_DBI    dbi;
+        u_int32_t openFlags = DB_CREATE | DB_THREAD;
+        int       rc = db_create(&dbi, poolPtr->env, 0);
+
+        /*
+         * The index is updated in the transaction of the data write.
+         */
+        if ((poolPtr->envPtr->envFlags & DB_INIT_TXN) != 0u) {
+            openFlags |= DB_AUTO_COMMIT;
+        }
+        if (rc != 0) {
+            NS_DB_ENV_ERR(poolPtr->env, rc, "db_create");
+        } else if ((rc = dbi->open(dbi, 0, ds.string, 0, DB_BTREE, openFlags, 0664)) != 0) {
+            NS_DB_ERR1(dbi, rc, "%s: open", ds.string);
+            dbi->close(dbi, 0);
+        } else {
+            sharedPtr->ttlDbi = dbi;
+            sharedPtr->ttlEnv = poolPtr->env;
+            result = NS_OK;
+        }
+    }
+#endif
+    Tcl_DStringFree(&ds);
+    return result;
 }
-static void CleanTempTxn(dbConn *UNUSED(conn), NS_DB_TXN *UNUSED(txn))
+
+/*
+ * Open the expiry index and create the bloom filter of a datasource,
+ * after its database(s) were opened.
+ */
+static dbShared *FinishShared(dbShared *sharedPtr, const char *datasource)
 {
+    const dbPool *poolPtr = sharedPtr->pool;
+
+    if (poolPtr->ttl && OpenTtl(sharedPtr, datasource) != NS_OK) {
+        CloseShared(sharedPtr);
+        return NULL;
+    }
+    if (poolPtr->bloomFpr > 0.0) {
+        sharedPtr->bloom = BloomCreate(sharedPtr, datasource);
+    }
+    return sharedPtr;
 }
-#endif
 
-static int DbExec(Ns_DbHandle *handle, char *query)
+/*
+ * Open the database(s) of a datasource. For "sharded:N:<datasource>", the
+ * shards are the databases "<datasource>.0" to "<datasource>.N-1". In
+ * LMDB, the datasource names the shard environments instead, which are
+ * placed relative to the home directory of the pool, unless absolute.
+ * Must be called with dbLock held.
+ */
+static dbShared *OpenShared(const dbPool *poolPtr, const char *datasource)
 {
-    dbConn    *conn = handle->connection;
-    NS_DB_TXN *tempTxn;
+    dbShared *sharedPtr;
+    int       i, nShards = 1;
 
-    DbCancel(handle);
+    if (strncmp(datasource, "sharded:", 8) == 0) {
+        char *end;
+        long  n = strtol(datasource + 8, &end, 10);
 
-    /*
-     * Retrieve one matching record
-     */
-    if (strncasecmp(query, "GET ", 4) == 0) {
-        conn->cmd = DB_GET;
-        NS_DB_VAL_DATA(conn->key) = query + 4;
-        NS_DB_VAL_SIZE(conn->key) = ((NS_DB_SIZE_T)strlen(NS_DB_VAL_DATA(conn->key))) + 1;
+        if (*end != ':' || n < 1 || n > DB_MAX_SHARDS) {
+            Ns_Log(Error, "nsdbbdb: invalid datasource '%s', expected sharded:N:<datasource>"
+                   " with N between 1 and %d", datasource, DB_MAX_SHARDS);
+            return NULL;
+        }
+        nShards = (int)n;
+        datasource = end + 1;
+    }
+    sharedPtr = ns_calloc(1u, sizeof(dbShared));
+    sharedPtr->pool = poolPtr;
 #ifndef LMDB
-        /*
-         * LMDB: The memory pointed to by the returned values is owned by the
-         * database, no need to free.
-         */
-        NS_DB_VAL_FLAGS(conn->data) = NS_DB_DBT_MALLOC;
+    Ns_MutexInit(&sharedPtr->rmwLock);
+    Ns_MutexSetName2(&sharedPtr->rmwLock, "nsdbbdb:rmw", datasource);
+    Ns_MutexInit(&sharedPtr->compact.lock);
+    Ns_MutexSetName2(&sharedPtr->compact.lock, "nsdbbdb:compact", datasource);
+    Tcl_DStringInit(&sharedPtr->compact.start);
 #endif
-        conn->status = GetTempTxn(conn, &tempTxn);
-        conn->status = NS_DB_DBI_GET(tempTxn, conn->dbi, &conn->key, &conn->data);
-        switch (conn->status) {
-        case 0:
-        case NS_DB_NOTFOUND:
-            handle->fetchingRows = NS_TRUE;
-            CleanTempTxn(conn, tempTxn);
-            return NS_ROWS;
-        default:
-            NS_DB_ERR0(conn->dbi, conn->status, "DB->get");
-            Ns_DbSetException(handle, "ERROR", NS_DB_STRERR(conn->status));
-            CleanTempTxn(conn, tempTxn);
-            return NS_ERROR;
+    if (poolPtr->keyCacheSize > 0u) {
+        sharedPtr->cache = CacheCreate(poolPtr->keyCacheSize);
+    }
+    if (nShards == 1) {
+        sharedPtr->envs[0] = poolPtr->env;
+        if (OpenDbi(poolPtr, poolPtr->env, datasource, poolPtr->dbFlags, &sharedPtr->dbis[0]) != NS_OK) {
+            CloseShared(sharedPtr);
+            return NULL;
         }
+        sharedPtr->nShards = 1;
+        return FinishShared(sharedPtr, datasource);
     }
 
-    /*
-     * Returns 1 if entry exists
-     */
-    if (strncasecmp(query, "CHECK ", 6) == 0) {
-        Ns_Log(BdbDebug, "... CHECK");
-        conn->cmd = DB_CHECK;
-        NS_DB_VAL_DATA(conn->key) = query + 6;
-        NS_DB_VAL_SIZE(conn->key) = ((NS_DB_SIZE_T)strlen(NS_DB_VAL_DATA(conn->key))) + 1;
-        conn->status = GetTempTxn(conn, &tempTxn);
-        conn->status = NS_DB_DBI_CURSOR_OPEN(tempTxn, conn->dbi, &conn->cursor);
+    for (i = 0; i < nShards; i++) {
+        Tcl_DString ds;
+        int         rc;
 
-        if (conn->status != 0) {
-            NS_DB_ERR0(conn->dbi, conn->status, "DB->cursor");
-            Ns_DbSetException(handle, "ERROR", NS_DB_STRERR(conn->status));
-            CleanTempTxn(conn, tempTxn);
-            return NS_ERROR;
+        Tcl_DStringInit(&ds);
+#ifdef LMDB
+        {
+            const dbEnvironment *envPtr;
+            const char          *path = datasource;
+
+            if (strncmp(path, "btree:", 6) == 0) {
+                path += 6;
+            }
+            if (*path != '/') {
+                Ns_DStringPrintf(&ds, "%s/", poolPtr->envPtr->home);
+            }
+            Ns_DStringPrintf(&ds, "%s.%d", path, i);
+            envPtr = GetEnv(ds.string, poolPtr->envPtr);
+            sharedPtr->envs[i] = (envPtr != NULL) ? envPtr->env : NULL;
+            rc = (envPtr != NULL) ? OpenDbi(poolPtr, envPtr->env, ds.string, poolPtr->dbFlags, &sharedPtr->dbis[i]) : NS_ERROR;
         }
-        Ns_Log(BdbDebug, "... cursor get key '%s' len %ld",
-               (char*)NS_DB_VAL_DATA(conn->key),
-               (long)NS_DB_VAL_SIZE(conn->key));
+#else
+        Ns_DStringPrintf(&ds, "%s.%d", datasource, i);
+        sharedPtr->envs[i] = poolPtr->env;
+        rc = OpenDbi(poolPtr, poolPtr->env, ds.string, poolPtr->dbFlags, &sharedPtr->dbis[i]);
+#endif
+        Tcl_DStringFree(&ds);
+        if (rc != NS_OK) {
+            CloseShared(sharedPtr);
+            return NULL;
+        }
+        sharedPtr->nShards = i + 1;
+    }
+    return FinishShared(sharedPtr, datasource);
+}
 
-        conn->status = NS_DB_CURSOR_GET(conn->cursor, &conn->key, &conn->data, NS_DB_SET_RANGE);
-        Ns_Log(BdbDebug, "... cursor get %p rc %d", (void*)conn->cursor, conn->status);
+/*
+ * Does both the SQLAllocConnect AND the SQLConnect. The database is
+ * opened only by the first handle of a datasource, further handles share
+ * it (Berkeley DB handles are opened with DB_THREAD).
+ */
 
-        switch (conn->status) {
-        case 0:
-        case NS_DB_NOTFOUND:
-            Ns_Log(BdbDebug, "... cursor get %p rc %d return ROWS", (void*)conn->cursor, conn->status);
-            handle->fetchingRows = NS_TRUE;
-            CleanTempTxn(conn, tempTxn);
-            return NS_ROWS;
-        default:
-            NS_DB_ERR0(conn->dbi, conn->status, "DB->get");
-            Ns_DbSetException(handle, "ERROR", NS_DB_STRERR(conn->status));
-            CleanTempTxn(conn, tempTxn);
+static int DbOpenDb(Ns_DbHandle *handle)
+{
+    dbConn        *conn;
+    dbPool        *poolPtr;
+    dbShared      *sharedPtr;
+    Tcl_HashEntry *hPtr;
+    Tcl_DString    ds;
+    int            isNew;
+
+    Ns_Log(BdbDebug, "DbOpenDb '%s'", dbName);
+
+    Ns_MutexLock(&dbLock);
+    poolPtr = GetPool(handle);
+    if (poolPtr == NULL) {
+        Ns_MutexUnlock(&dbLock);
+        return NS_ERROR;
+    }
+    Tcl_DStringInit(&ds);
+    Ns_DStringPrintf(&ds, "%s:%x:%d:%s", poolPtr->envPtr->home, poolPtr->dbFlags, (int)poolPtr->keyType,
+                     handle->datasource);
+    hPtr = Tcl_CreateHashEntry(&dbTable, ds.string, &isNew);
+    if (isNew != 0) {
+        sharedPtr = OpenShared(poolPtr, handle->datasource);
+        if (sharedPtr == NULL) {
+            Tcl_DeleteHashEntry(hPtr);
+            Ns_MutexUnlock(&dbLock);
+            Tcl_DStringFree(&ds);
             return NS_ERROR;
         }
+        sharedPtr->hPtr = hPtr;
+        Tcl_SetHashValue(hPtr, sharedPtr);
+    } else {
+        sharedPtr = Tcl_GetHashValue(hPtr);
+    }
+    sharedPtr->refCount++;
+    Ns_Log(BdbDebug, "DbOpen: %s, open handles=%d", ds.string, sharedPtr->refCount);
+    Ns_MutexUnlock(&dbLock);
+    Tcl_DStringFree(&ds);
+
+    /*
+     * Finally, allocating the connection data.
+     */
+    conn = ns_calloc(1, sizeof(dbConn));
+    conn->pool = poolPtr;
+    conn->shared = sharedPtr;
+    conn->dbi = sharedPtr->dbis[0];
+    conn->env = sharedPtr->envs[0];
+    Tcl_DStringInit(&conn->cacheKeys);
+#ifdef LMDB
+    Tcl_DStringInit(&conn->ttlKeys);
+#endif
+    handle->connection = conn;
+    return NS_OK;
+}
+
+static int DbCloseDb(Ns_DbHandle *handle)
+{
+    dbConn   *conn = handle->connection;
+    dbShared *sharedPtr = conn->shared;
+
+    DbCancel(handle);
+    AbortTxn(conn);
+#ifdef LMDB
+    {
+        int i;
+
+        for (i = 0; i < sharedPtr->nShards; i++) {
+            if (conn->rtxn[i] != NULL) {
+                mdb_txn_abort(conn->rtxn[i]);
+            }
+        }
+        if (conn->ttlRtxn != NULL) {
+            mdb_txn_abort(conn->ttlRtxn);
+        }
+        Tcl_DStringFree(&conn->ttlKeys);
+    }
+#else
+    if (conn->bulk.data != NULL) {
+        ns_free(conn->bulk.data);
+    }
+    ns_free(conn->keyBuf);
+    ns_free(conn->dataBuf);
+#endif
+    ns_free(conn->cacheBuf);
+    Tcl_DStringFree(&conn->cacheKeys);
+    ns_free(conn);
+    handle->connection = 0;
+
+    /*
+     * The database is closed together with its last handle.
+     */
+    Ns_MutexLock(&dbLock);
+    Ns_Log(BdbDebug, "DbClose: %s, open handles=%d",
+           (char *)Tcl_GetHashKey(&dbTable, sharedPtr->hPtr), sharedPtr->refCount - 1);
+    if (--sharedPtr->refCount == 0) {
+        Tcl_DeleteHashEntry(sharedPtr->hPtr);
+        CloseShared(sharedPtr);
+    }
+    Ns_MutexUnlock(&dbLock);
+    return NS_OK;
+}
+
+static int DbDML(Ns_DbHandle *UNUSED(handle), char *UNUSED(query))
+{
+    return NS_OK;
+}
+
+#ifdef LMDB
+/*
+ * LMDB needs for most operations a txn value. If we have no ongoing
+ * transaction in conn, create a temporary one, which will be
+ * committed/aborted after the operation. Only writing operations use
+ * this function, since write transactions are serialized by LMDB.
+ */
+static int GetTempTxn(dbConn *conn, NS_DB_TXN **txnPtr)
+{
+    int rc = 0;
+    if (likely(conn->txn != NULL)) {
+        *txnPtr = conn->txn;
+    } else {
+        Tcl_WideInt start = LatencyNow();
+
+        rc = mdb_txn_begin(conn->env, NULL, 0, txnPtr);
+        LatencyPhase(PhaseTxn, start);
+    }
+    return rc;
+}
+
+static int CleanTempTxn(dbConn *conn, NS_DB_TXN *txn)
+{
+    int rc = conn->status;
+
+    if (likely(conn->txn == NULL)) {
+        if (likely(rc == 0)) {
+            Tcl_WideInt start = LatencyNow();
+
+            rc = TtlCommit(conn, txn);
+            LatencyPhase(PhaseTxn, start);
+        } else {
+            mdb_txn_abort(txn);
+            TtlDiscard(conn);
+        }
+    }
+    return rc;
+}
+
+/*
+ * Reading operations use a read-only transaction, which is kept in the
+ * connection data and recycled via mdb_txn_reset()/mdb_txn_renew(). Since
+ * a handle might be used by different threads over its lifetime, the
+ * environment is opened with MDB_NOTLS. When an explicit transaction is
+ * active, reads are performed in this transaction to see its changes.
+ * Every shard has its own environment and therefore its own read-only
+ * transaction.
+ */
+static int GetReadTxn(dbConn *conn, NS_DB_TXN **txnPtr)
+{
+    int         rc = 0;
+    int         shard = conn->shard;
+    Tcl_WideInt start;
+
+    if (conn->txn != NULL) {
+        *txnPtr = conn->txn;
+        return 0;
+    }
+    start = LatencyNow();
+    if (conn->rtxn[shard] == NULL) {
+        rc = mdb_txn_begin(conn->env, NULL, MDB_RDONLY, &conn->rtxn[shard]);
+    } else if (!conn->rtxnActive[shard]) {
+        rc = mdb_txn_renew(conn->rtxn[shard]);
+    }
+    LatencyPhase(PhaseTxn, start);
+    if (likely(rc == 0)) {
+        conn->rtxnActive[shard] = NS_TRUE;
+        *txnPtr = conn->rtxn[shard];
+    }
+    return rc;
+}
+
+/*
+ * Release the snapshots of the read-only transactions, but keep the
+ * transaction handles for reuse. Values returned from LMDB point into the
+ * snapshot, so this must not be called before the row was consumed.
+ */
+static void ReleaseReadTxn(dbConn *conn)
+{
+    int i;
+
+    for (i = 0; i < conn->shared->nShards; i++) {
+        if (conn->rtxnActive[i]) {
+            mdb_txn_reset(conn->rtxn[i]);
+            conn->rtxnActive[i] = NS_FALSE;
+        }
+    }
+}
+
+static int GetBatchTxn(dbConn *conn, NS_DB_TXN **txnPtr)
+{
+    return GetTempTxn(conn, txnPtr);
+}
+#else
+/*
+ * Berkeley DB operations accept a NULL txn and auto-commit in this case,
+ * so just pass the explicit transaction (if any).
+ */
+static int GetTempTxn(dbConn *conn, NS_DB_TXN **txnPtr)
+{
+    *txnPtr = conn->txn;
+    return 0;
+}
+
+/*
+ * Batches are applied in a transaction of their own, when the environment
+ * supports transactions.
+ */
+static int GetBatchTxn(dbConn *conn, NS_DB_TXN **txnPtr)
+{
+    Tcl_WideInt start;
+    int         rc;
+
+    if (conn->txn != NULL || (conn->pool->envPtr->envFlags & DB_INIT_TXN) == 0u) {
+        *txnPtr = conn->txn;
+        return 0;
+    }
+    start = LatencyNow();
+    rc = NS_DB_ENV_TXN_BEGIN(conn->env, txnPtr);
+    LatencyPhase(PhaseTxn, start);
+    return rc;
+}
+
+static int CleanTempTxn(dbConn *conn, NS_DB_TXN *txn)
+{
+    int rc = conn->status;
+
+    if (txn != NULL && txn != conn->txn) {
+        if (likely(rc == 0)) {
+            Tcl_WideInt start = LatencyNow();
+
+            rc = NS_DB_ENV_TXN_COMMIT(txn);
+            LatencyPhase(PhaseTxn, start);
+        } else {
+            NS_DB_ENV_TXN_ABORT(txn);
+        }
+    }
+    return rc;
+}
+static int GetReadTxn(dbConn *conn, NS_DB_TXN **txnPtr)
+{
+    *txnPtr = conn->txn;
+    return 0;
+}
+static void ReleaseReadTxn(dbConn *UNUSED(conn))
+{
+}
+#endif
+
+/*
+ * Abort the explicit transaction started via BEGIN (if any).
+ */
+static void AbortTxn(dbConn *conn)
+{
+    if (conn->txn != NULL) {
+        Ns_Log(BdbDebug, "... aborting transaction %p", (void*)conn->txn);
+        (void)NS_DB_ENV_TXN_ABORT(conn->txn);
+        conn->txn = NULL;
+#ifdef LMDB
+        TtlDiscard(conn);
+#endif
+        CacheFlush(conn);
+    }
+}
+
+/*
+ * Make the given shard the current one of the connection.
+ */
+static void UseShard(dbConn *conn, int shard)
+{
+    conn->shard = shard;
+    conn->dbi = conn->shared->dbis[shard];
+    conn->env = conn->shared->envs[shard];
+}
+
+/*
+ * FNV-1a hash of a key.
+ */
+static uint32_t HashKey(const NS_DB_VAL *keyPtr)
+{
+    const unsigned char *bytes = NS_DB_VAL_DATA(*keyPtr);
+    size_t               i;
+    uint32_t             hash = 2166136261u;
+
+    for (i = 0u; i < NS_DB_VAL_SIZE(*keyPtr); i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Select the shard of a key via its hash. A datasource which is not
+ * sharded has a single shard.
+ */
+static void RouteKey(dbConn *conn, const NS_DB_VAL *keyPtr)
+{
+    if (conn->shared->nShards > 1) {
+        UseShard(conn, (int)(HashKey(keyPtr) % (uint32_t)conn->shared->nShards));
+    }
+}
+
+#ifdef LMDB
+/*
+ * Item of a write spanning shards queued in a Tcl_DString, followed by
+ * the key and the data. Every shard is an environment with a writer lock
+ * of its own and LMDB does not detect deadlocks, so such writes group
+ * their items by shard first and take the shards in ascending order.
+ */
+typedef struct {
+    int    shard;
+    size_t keySize;
+    size_t dataSize;
+} dbShardItem;
+
+static void ShardQueue(Tcl_DString *dsPtr, int shard, const NS_DB_VAL *keyPtr, const NS_DB_VAL *dataPtr)
+{
+    dbShardItem item;
+
+    item.shard = shard;
+    item.keySize = keyPtr->mv_size;
+    item.dataSize = dataPtr->mv_size;
+    Tcl_DStringAppend(dsPtr, (const char *)&item, (TCL_SIZE_T)sizeof(item));
+    Tcl_DStringAppend(dsPtr, keyPtr->mv_data, (TCL_SIZE_T)item.keySize);
+    if (item.dataSize > 0u) {
+        Tcl_DStringAppend(dsPtr, dataPtr->mv_data, (TCL_SIZE_T)item.dataSize);
+    }
+}
+
+/*
+ * Return the next queued item of the shard, starting at *offsetPtr.
+ */
+static bool ShardNext(const Tcl_DString *dsPtr, int shard, TCL_SIZE_T *offsetPtr,
+                      NS_DB_VAL *keyPtr, NS_DB_VAL *dataPtr)
+{
+    while (*offsetPtr < dsPtr->length) {
+        const char  *ptr = dsPtr->string + *offsetPtr;
+        dbShardItem  item;
+
+        memcpy(&item, ptr, sizeof(item));
+        *offsetPtr += (TCL_SIZE_T)(sizeof(item) + item.keySize + item.dataSize);
+        if (item.shard == shard) {
+            keyPtr->mv_data = (char *)ptr + sizeof(item);
+            keyPtr->mv_size = item.keySize;
+            dataPtr->mv_data = (char *)ptr + sizeof(item) + item.keySize;
+            dataPtr->mv_size = item.dataSize;
+            return NS_TRUE;
+        }
+    }
+    return NS_FALSE;
+}
+#endif
+
+/*
+ * Read cache for GET and CHECK, shared by all handles of a datasource.
+ * The cache is split into stripes with a lock each, every stripe keeps
+ * its entries in LRU order and evicts from the tail when its share of the
+ * configured size is exceeded. Writes invalidate the cached key, writes
+ * of an explicit transaction at COMMIT or ABORT. Every invalidation
+ * increments the generation of the stripe, so a value read from the
+ * database before a concurrent write is not stored afterwards.
+ */
+#define CACHE_STRIPES 16
+
+typedef struct _dbCacheEntry {
+    struct _dbCacheEntry *nextPtr;  /* next entry in the hash bucket */
+    struct _dbCacheEntry *newerPtr; /* LRU list */
+    struct _dbCacheEntry *olderPtr;
+    uint32_t hash;
+    size_t keySize;
+    size_t dataSize;
+    char bytes[];                   /* key followed by data */
+} dbCacheEntry;
+
+typedef struct _dbCacheStripe {
+    Ns_Mutex lock;
+    dbCacheEntry **buckets;
+    size_t nBuckets;                /* power of 2 */
+    size_t nEntries;
+    dbCacheEntry *newestPtr;
+    dbCacheEntry *oldestPtr;
+    size_t bytes;
+    size_t maxBytes;
+    unsigned long generation;
+    Tcl_WideInt hits;
+    Tcl_WideInt misses;
+    Tcl_WideInt evictions;
+} dbCacheStripe;
+
+typedef struct _dbCache {
+    dbCacheStripe stripes[CACHE_STRIPES];
+} dbCache;
+
+static dbCache *CacheCreate(size_t size)
+{
+    dbCache *cachePtr = ns_calloc(1u, sizeof(dbCache));
+    int      i;
+
+    for (i = 0; i < CACHE_STRIPES; i++) {
+        dbCacheStripe *stripePtr = &cachePtr->stripes[i];
+
+        Ns_MutexInit(&stripePtr->lock);
+        Ns_MutexSetName2(&stripePtr->lock, "nsdbbdb:cache", NULL);
+        stripePtr->nBuckets = 64u;
+        stripePtr->buckets = ns_calloc(stripePtr->nBuckets, sizeof(dbCacheEntry *));
+        stripePtr->maxBytes = size / CACHE_STRIPES;
+    }
+    return cachePtr;
+}
+
+/*
+ * Remove all entries of a stripe. Must be called with the lock of the
+ * stripe held.
+ */
+static void CacheClearStripe(dbCacheStripe *stripePtr)
+{
+    dbCacheEntry *entryPtr, *nextPtr;
+
+    for (entryPtr = stripePtr->newestPtr; entryPtr != NULL; entryPtr = nextPtr) {
+        nextPtr = entryPtr->olderPtr;
+        ns_free(entryPtr);
+    }
+    memset(stripePtr->buckets, 0, stripePtr->nBuckets * sizeof(dbCacheEntry *));
+    stripePtr->newestPtr = stripePtr->oldestPtr = NULL;
+    stripePtr->nEntries = 0u;
+    stripePtr->bytes = 0u;
+    stripePtr->generation++;
+}
+
+static void CacheDestroy(dbCache *cachePtr)
+{
+    int i;
+
+    for (i = 0; i < CACHE_STRIPES; i++) {
+        dbCacheStripe *stripePtr = &cachePtr->stripes[i];
+
+        CacheClearStripe(stripePtr);
+        ns_free(stripePtr->buckets);
+        Ns_MutexDestroy(&stripePtr->lock);
+    }
+    ns_free(cachePtr);
+}
+
+/*
+ * Remove all entries, e.g. after TRUNCATE.
+ */
+static void CacheClear(dbCache *cachePtr)
+{
+    int i;
+
+    for (i = 0; i < CACHE_STRIPES; i++) {
+        dbCacheStripe *stripePtr = &cachePtr->stripes[i];
+
+        Ns_MutexLock(&stripePtr->lock);
+        CacheClearStripe(stripePtr);
+        Ns_MutexUnlock(&stripePtr->lock);
+    }
+}
+
+static dbCacheStripe *CacheStripe(dbCache *cachePtr, uint32_t hash)
+{
+    /*
+     * The low bits select the bucket and the shard, so take the stripe
+     * from the high bits.
+     */
+    return &cachePtr->stripes[(hash >> 24) % CACHE_STRIPES];
+}
+
+/*
+ * Find the entry of a key. Must be called with the lock of the stripe
+ * held.
+ */
+static dbCacheEntry **CacheFind(const dbCacheStripe *stripePtr, uint32_t hash, const NS_DB_VAL *keyPtr)
+{
+    dbCacheEntry **entryPtrPtr = &stripePtr->buckets[hash & (stripePtr->nBuckets - 1u)];
+
+    for (; *entryPtrPtr != NULL; entryPtrPtr = &(*entryPtrPtr)->nextPtr) {
+        const dbCacheEntry *entryPtr = *entryPtrPtr;
+
+        if (entryPtr->hash == hash
+            && entryPtr->keySize == NS_DB_VAL_SIZE(*keyPtr)
+            && memcmp(entryPtr->bytes, NS_DB_VAL_DATA(*keyPtr), entryPtr->keySize) == 0) {
+            break;
+        }
+    }
+    return entryPtrPtr;
+}
+
+static void CacheUnlinkLru(dbCacheStripe *stripePtr, dbCacheEntry *entryPtr)
+{
+    if (entryPtr->newerPtr != NULL) {
+        entryPtr->newerPtr->olderPtr = entryPtr->olderPtr;
+    } else {
+        stripePtr->newestPtr = entryPtr->olderPtr;
+    }
+    if (entryPtr->olderPtr != NULL) {
+        entryPtr->olderPtr->newerPtr = entryPtr->newerPtr;
+    } else {
+        stripePtr->oldestPtr = entryPtr->newerPtr;
+    }
+}
+
+static void CacheLinkLru(dbCacheStripe *stripePtr, dbCacheEntry *entryPtr)
+{
+    entryPtr->newerPtr = NULL;
+    entryPtr->olderPtr = stripePtr->newestPtr;
+    if (stripePtr->newestPtr != NULL) {
+        stripePtr->newestPtr->newerPtr = entryPtr;
+    } else {
+        stripePtr->oldestPtr = entryPtr;
+    }
+    stripePtr->newestPtr = entryPtr;
+}
+
+/*
+ * Remove the entry referenced by entryPtrPtr from the bucket and the LRU
+ * list.
+ */
+static void CacheRemove(dbCacheStripe *stripePtr, dbCacheEntry **entryPtrPtr)
+{
+    dbCacheEntry *entryPtr = *entryPtrPtr;
+
+    *entryPtrPtr = entryPtr->nextPtr;
+    CacheUnlinkLru(stripePtr, entryPtr);
+    stripePtr->bytes -= sizeof(dbCacheEntry) + entryPtr->keySize + entryPtr->dataSize;
+    stripePtr->nEntries--;
+    ns_free(entryPtr);
+}
+
+static void CacheGrow(dbCacheStripe *stripePtr)
+{
+    size_t         nBuckets = stripePtr->nBuckets * 2u, i;
+    dbCacheEntry **buckets = ns_calloc(nBuckets, sizeof(dbCacheEntry *));
+
+    for (i = 0u; i < stripePtr->nBuckets; i++) {
+        dbCacheEntry *entryPtr, *nextPtr;
+
+        for (entryPtr = stripePtr->buckets[i]; entryPtr != NULL; entryPtr = nextPtr) {
+            nextPtr = entryPtr->nextPtr;
+            entryPtr->nextPtr = buckets[entryPtr->hash & (nBuckets - 1u)];
+            buckets[entryPtr->hash & (nBuckets - 1u)] = entryPtr;
+        }
+    }
+    ns_free(stripePtr->buckets);
+    stripePtr->buckets = buckets;
+    stripePtr->nBuckets = nBuckets;
+}
+
+/*
+ * Look up a key. On a hit, the data is copied into the cache buffer of
+ * the connection and returned in dataPtr. On a miss, the generation of
+ * the stripe is returned, which has to be passed to CacheStore().
+ */
+static bool CacheLookup(dbConn *conn, const NS_DB_VAL *keyPtr, NS_DB_VAL *dataPtr, unsigned long *generationPtr)
+{
+    uint32_t             hash = HashKey(keyPtr);
+    dbCacheStripe       *stripePtr = CacheStripe(conn->shared->cache, hash);
+    dbCacheEntry *const *entryPtrPtr;
+    bool                 found;
+
+    Ns_MutexLock(&stripePtr->lock);
+    entryPtrPtr = CacheFind(stripePtr, hash, keyPtr);
+    found = (*entryPtrPtr != NULL);
+    if (found) {
+        dbCacheEntry *entryPtr = *entryPtrPtr;
+
+        if (entryPtr != stripePtr->newestPtr) {
+            CacheUnlinkLru(stripePtr, entryPtr);
+            CacheLinkLru(stripePtr, entryPtr);
+        }
+        if (dataPtr != NULL) {
+            if (conn->cacheBufSize < entryPtr->dataSize) {
+                conn->cacheBufSize = entryPtr->dataSize > conn->cacheBufSize * 2u
+                    ? entryPtr->dataSize : conn->cacheBufSize * 2u;
+                conn->cacheBuf = ns_realloc(conn->cacheBuf, conn->cacheBufSize);
+            }
+            memcpy(conn->cacheBuf, entryPtr->bytes + entryPtr->keySize, entryPtr->dataSize);
+            NS_DB_VAL_DATA(*dataPtr) = conn->cacheBuf;
+            NS_DB_VAL_SIZE(*dataPtr) = (NS_DB_SIZE_T)entryPtr->dataSize;
+        }
+        stripePtr->hits++;
+    } else {
+        *generationPtr = stripePtr->generation;
+        stripePtr->misses++;
+    }
+    Ns_MutexUnlock(&stripePtr->lock);
+    return found;
+}
+
+/*
+ * Store a value read from the database, unless the stripe was
+ * invalidated since the lookup. Values larger than a quarter of a stripe
+ * are not cached.
+ */
+static void CacheStore(const dbConn *conn, const NS_DB_VAL *keyPtr, const NS_DB_VAL *dataPtr, unsigned long generation)
+{
+    uint32_t       hash = HashKey(keyPtr);
+    dbCacheStripe *stripePtr = CacheStripe(conn->shared->cache, hash);
+    size_t         size = sizeof(dbCacheEntry) + NS_DB_VAL_SIZE(*keyPtr) + NS_DB_VAL_SIZE(*dataPtr);
+    dbCacheEntry **entryPtrPtr, *entryPtr;
+
+    if (size > stripePtr->maxBytes / 4u) {
+        return;
+    }
+    Ns_MutexLock(&stripePtr->lock);
+    if (stripePtr->generation == generation
+        && *(entryPtrPtr = CacheFind(stripePtr, hash, keyPtr)) == NULL) {
+        entryPtr = ns_malloc(size);
+        entryPtr->hash = hash;
+        entryPtr->keySize = NS_DB_VAL_SIZE(*keyPtr);
+        entryPtr->dataSize = NS_DB_VAL_SIZE(*dataPtr);
+        memcpy(entryPtr->bytes, NS_DB_VAL_DATA(*keyPtr), entryPtr->keySize);
+        memcpy(entryPtr->bytes + entryPtr->keySize, NS_DB_VAL_DATA(*dataPtr), entryPtr->dataSize);
+        entryPtr->nextPtr = NULL;
+        *entryPtrPtr = entryPtr;
+        CacheLinkLru(stripePtr, entryPtr);
+        stripePtr->bytes += size;
+        stripePtr->nEntries++;
+
+        while (stripePtr->bytes > stripePtr->maxBytes) {
+            dbCacheEntry *oldestPtr = stripePtr->oldestPtr;
+
+            entryPtrPtr = &stripePtr->buckets[oldestPtr->hash & (stripePtr->nBuckets - 1u)];
+            while (*entryPtrPtr != oldestPtr) {
+                entryPtrPtr = &(*entryPtrPtr)->nextPtr;
+            }
+            CacheRemove(stripePtr, entryPtrPtr);
+            stripePtr->evictions++;
+        }
+        if (stripePtr->nEntries > stripePtr->nBuckets) {
+            CacheGrow(stripePtr);
+        }
+    }
+    Ns_MutexUnlock(&stripePtr->lock);
+}
+
+static void CacheInvalidate(dbCache *cachePtr, const NS_DB_VAL *keyPtr)
+{
+    uint32_t       hash = HashKey(keyPtr);
+    dbCacheStripe *stripePtr = CacheStripe(cachePtr, hash);
+    dbCacheEntry **entryPtrPtr;
+
+    Ns_MutexLock(&stripePtr->lock);
+    entryPtrPtr = CacheFind(stripePtr, hash, keyPtr);
+    if (*entryPtrPtr != NULL) {
+        CacheRemove(stripePtr, entryPtrPtr);
+    }
+    stripePtr->generation++;
+    Ns_MutexUnlock(&stripePtr->lock);
+}
+
+/*
+ * A key was written. Outside of transactions, the key is invalidated at
+ * once, otherwise it is remembered until the end of the transaction, see
+ * CacheFlush().
+ */
+static void CacheNote(dbConn *conn, const NS_DB_VAL *keyPtr)
+{
+    size_t size = NS_DB_VAL_SIZE(*keyPtr);
+
+    Tcl_DStringAppend(&conn->cacheKeys, (const char *)&size, (TCL_SIZE_T)sizeof(size));
+    Tcl_DStringAppend(&conn->cacheKeys, NS_DB_VAL_DATA(*keyPtr), (TCL_SIZE_T)size);
+}
+
+static void CacheWrite(dbConn *conn, const NS_DB_VAL *keyPtr)
+{
+    if (conn->shared->cache == NULL) {
+        return;
+    }
+    if (conn->txn == NULL) {
+        CacheInvalidate(conn->shared->cache, keyPtr);
+    } else {
+        CacheNote(conn, keyPtr);
+    }
+}
+
+/*
+ * Invalidate the keys written in the transaction, which was committed or
+ * aborted.
+ */
+static void CacheFlush(dbConn *conn)
+{
+    const char *ptr = conn->cacheKeys.string;
+    const char *end = ptr + conn->cacheKeys.length;
+
+    if (conn->shared->cache == NULL) {
+        return;
+    }
+    if (conn->cacheClear) {
+        CacheClear(conn->shared->cache);
+        conn->cacheClear = NS_FALSE;
+        ptr = end;
+    }
+    while (ptr < end) {
+        NS_DB_VAL key;
+        size_t    size;
+
+        memcpy(&size, ptr, sizeof(size));
+        memset(&key, 0, sizeof(key));
+        NS_DB_VAL_DATA(key) = (char *)ptr + sizeof(size);
+        NS_DB_VAL_SIZE(key) = (NS_DB_SIZE_T)size;
+        CacheInvalidate(conn->shared->cache, &key);
+        ptr += sizeof(size) + size;
+    }
+    Tcl_DStringSetLength(&conn->cacheKeys, 0);
+}
+
+/*
+ * Bloom filter of the keys of a datasource, letting GET and MGET answer
+ * for missing keys without a database lookup. The filter is only used
+ * once it covers all keys: it is built by a background scan when the
+ * database is opened, unless a snapshot written when the database was
+ * closed is found. Keys are added before they are written, deleted keys
+ * stay in the filter until it is rebuilt, which happens in the background
+ * after many deletes or when more keys were added than the filter was
+ * sized for. Until the rebuilt filter replaces the old one, writes are
+ * added to both.
+ */
+#define BLOOM_MIN_KEYS 65536
+
+#ifndef M_LN2
+# define M_LN2 0.69314718055994530942
+#endif
+
+typedef struct _dbBloom {
+    Ns_Mutex lock;
+    uint64_t *bits;             /* active filter, NULL until built */
+    size_t nBits;
+    unsigned int nHashes;
+    Tcl_WideInt capacity;       /* number of keys the filter is sized for */
+    Tcl_WideInt adds;           /* keys added since the build */
+    Tcl_WideInt deletes;        /* keys deleted since the build */
+    uint64_t *buildBits;        /* filter under construction */
+    size_t buildNBits;
+    unsigned int buildNHashes;
+    Tcl_WideInt buildCapacity;
+    bool running;               /* a build is running */
+    bool stop;                  /* the database is closed, stop the build */
+    Ns_Thread thread;
+    bool joinable;              /* thread was started and not yet joined */
+    Tcl_WideInt negatives;      /* lookups answered by the filter */
+    double fpr;                 /* target false positive rate */
+    char *snapshot;             /* path of the snapshot file */
+    const struct _dbShared *shared;
+} dbBloom;
+
+static Ns_ThreadProc BloomBuild;
+static int DbStats(dbShared *sharedPtr, Tcl_Obj *dictObj, bool fast);
+
+/*
+ * 64-bit FNV-1a hash of a key, the two halves are combined to the
+ * probe positions (double hashing).
+ */
+static uint64_t BloomHash(const NS_DB_VAL *keyPtr)
+{
+    const unsigned char *bytes = NS_DB_VAL_DATA(*keyPtr);
+    size_t               i;
+    uint64_t             hash = 14695981039346656037u;
+
+    for (i = 0u; i < NS_DB_VAL_SIZE(*keyPtr); i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211u;
+    }
+    return hash;
+}
+
+static void BloomSet(uint64_t *bits, size_t nBits, unsigned int nHashes, uint64_t hash)
+{
+    uint64_t     h1 = hash & 0xffffffffu, h2 = (hash >> 32) | 1u;
+    unsigned int i;
+
+    for (i = 0u; i < nHashes; i++) {
+        size_t bit = (size_t)((h1 + i * h2) % nBits);
+
+        bits[bit / 64u] |= (uint64_t)1 << (bit % 64u);
+    }
+}
+
+static bool BloomTest(const uint64_t *bits, size_t nBits, unsigned int nHashes, uint64_t hash)
+{
+    uint64_t     h1 = hash & 0xffffffffu, h2 = (hash >> 32) | 1u;
+    unsigned int i;
+
+    for (i = 0u; i < nHashes; i++) {
+        size_t bit = (size_t)((h1 + i * h2) % nBits);
+
+        if ((bits[bit / 64u] & ((uint64_t)1 << (bit % 64u))) == 0u) {
+            return NS_FALSE;
+        }
+    }
+    return NS_TRUE;
+}
+
+/*
+ * Size a filter for the given number of keys: m = -n ln(p) / ln(2)^2 bits
+ * and k = m/n ln(2) hash functions.
+ */
+static void BloomSize(const dbBloom *bloomPtr, Tcl_WideInt keys, size_t *nBitsPtr, unsigned int *nHashesPtr)
+{
+    double n = (double)keys, m = -n * log(bloomPtr->fpr) / (M_LN2 * M_LN2);
+    double k = floor(m / n * M_LN2 + 0.5);
+
+    *nBitsPtr = ((size_t)m + 63u) & ~(size_t)63u;
+    *nHashesPtr = k < 1.0 ? 1u : k > 16.0 ? 16u : (unsigned int)k;
+}
+
+/*
+ * Start building a new filter in the background, unless a build is
+ * running. Must be called with the lock of the filter held.
+ */
+static void BloomStartBuild(dbBloom *bloomPtr, Tcl_WideInt keys)
+{
+    if (bloomPtr->running || bloomPtr->stop) {
+        return;
+    }
+    if (bloomPtr->joinable) {
+        /*
+         * The previous build has finished, reap its thread.
+         */
+        Ns_ThreadJoin(&bloomPtr->thread, NULL);
+        bloomPtr->joinable = NS_FALSE;
+    }
+    bloomPtr->buildCapacity = keys * 2 > BLOOM_MIN_KEYS ? keys * 2 : BLOOM_MIN_KEYS;
+    BloomSize(bloomPtr, bloomPtr->buildCapacity, &bloomPtr->buildNBits, &bloomPtr->buildNHashes);
+    bloomPtr->buildBits = ns_calloc(bloomPtr->buildNBits / 64u, sizeof(uint64_t));
+    bloomPtr->running = NS_TRUE;
+    bloomPtr->joinable = NS_TRUE;
+    Ns_Log(Notice, "nsdbbdb: building bloom filter %s: %lu bits, %u hashes",
+           bloomPtr->snapshot, (unsigned long)bloomPtr->buildNBits, bloomPtr->buildNHashes);
+    Ns_ThreadCreate(BloomBuild, bloomPtr, 0, &bloomPtr->thread);
+}
+
+/*
+ * Scan all keys of all shards into the filter under construction and
+ * make it the active filter.
+ */
+static void BloomBuild(void *arg)
+{
+    dbBloom         *bloomPtr = arg;
+    const dbShared  *sharedPtr = bloomPtr->shared;
+    Tcl_WideInt      count = 0;
+    int              i, rc = 0;
+
+    Ns_ThreadSetName("-bloom-");
+    for (i = 0; i < sharedPtr->nShards && rc == 0; i++) {
+        NS_DB_CURSOR *cursor;
+        NS_DB_TXN    *txn = NULL;
+        NS_DB_VAL     key, data;
+
+        memset(&key, 0, sizeof(key));
+        memset(&data, 0, sizeof(data));
+#ifdef LMDB
+        /*
+         * Wait for the write transaction in progress, its keys were added
+         * to the old filter only, then scan the shard in a single read-only
+         * transaction.
+         */
+        rc = mdb_txn_begin(sharedPtr->envs[i], NULL, 0u, &txn);
+        if (rc == 0) {
+            mdb_txn_abort(txn);
+        }
+        rc = mdb_txn_begin(sharedPtr->envs[i], NULL, MDB_RDONLY, &txn);
+        if (rc != 0) {
+            break;
+        }
+#else
+        key.flags = DB_DBT_REALLOC;
+        data.flags = DB_DBT_PARTIAL | DB_DBT_USERMEM;
+#endif
+        rc = NS_DB_DBI_CURSOR_OPEN(txn, sharedPtr->dbis[i], &cursor);
+        if (rc == 0) {
+            while ((rc = NS_DB_CURSOR_GET(cursor, &key, &data, NS_DB_NEXT)) == 0) {
+                uint64_t hash = BloomHash(&key);
+                bool     stop;
+
+                Ns_MutexLock(&bloomPtr->lock);
+                BloomSet(bloomPtr->buildBits, bloomPtr->buildNBits, bloomPtr->buildNHashes, hash);
+                stop = bloomPtr->stop;
+                Ns_MutexUnlock(&bloomPtr->lock);
+                count++;
+                if (stop) {
+                    rc = -1;
+                    break;
+                }
+            }
+            if (rc == NS_DB_NOTFOUND) {
+                rc = 0;
+            }
+            NS_DB_DBI_CURSOR_CLOSE(cursor);
+        }
+#ifdef LMDB
+        mdb_txn_abort(txn);
+#else
+        ns_free(key.data);
+#endif
+    }
+
+    Ns_MutexLock(&bloomPtr->lock);
+    if (rc == 0 && !bloomPtr->stop) {
+        ns_free(bloomPtr->bits);
+        bloomPtr->bits = bloomPtr->buildBits;
+        bloomPtr->nBits = bloomPtr->buildNBits;
+        bloomPtr->nHashes = bloomPtr->buildNHashes;
+        bloomPtr->capacity = bloomPtr->buildCapacity;
+        bloomPtr->adds = bloomPtr->deletes = 0;
+        Ns_Log(Notice, "nsdbbdb: bloom filter %s built with %" TCL_LL_MODIFIER "d keys",
+               bloomPtr->snapshot, count);
+    } else {
+        ns_free(bloomPtr->buildBits);
+        if (rc > 0) {
+            Ns_Log(Error, "nsdbbdb: could not build bloom filter %s: %s",
+                   bloomPtr->snapshot, NS_DB_STRERR(rc));
+        }
+    }
+    bloomPtr->buildBits = NULL;
+    bloomPtr->running = NS_FALSE;
+    Ns_MutexUnlock(&bloomPtr->lock);
+}
+
+/*
+ * Load the snapshot written when the database was closed the last time.
+ * The file is removed, so a crash leaves no outdated snapshot behind.
+ */
+static bool BloomLoad(dbBloom *bloomPtr)
+{
+    FILE     *f = fopen(bloomPtr->snapshot, "rb");
+    char      magic[8];
+    uint64_t  header[3];
+    bool      success = NS_FALSE;
+
+    if (f == NULL) {
+        return NS_FALSE;
+    }
+    if (fread(magic, sizeof(magic), 1u, f) == 1u && memcmp(magic, "NSBLOOM1", 8u) == 0
+        && fread(header, sizeof(header), 1u, f) == 1u
+        && header[0] > 0u && header[0] % 64u == 0u && header[1] > 0u && header[1] <= 16u) {
+        bloomPtr->nBits = (size_t)header[0];
+        bloomPtr->nHashes = (unsigned int)header[1];
+        bloomPtr->capacity = (Tcl_WideInt)header[2];
+        bloomPtr->bits = ns_malloc(bloomPtr->nBits / 8u);
+        success = (fread(bloomPtr->bits, bloomPtr->nBits / 8u, 1u, f) == 1u);
+        if (!success) {
+            ns_free(bloomPtr->bits);
+            bloomPtr->bits = NULL;
+        }
+    }
+    fclose(f);
+    unlink(bloomPtr->snapshot);
+    return success;
+}
+
+static void BloomSave(const dbBloom *bloomPtr)
+{
+    FILE     *f = fopen(bloomPtr->snapshot, "wb");
+    uint64_t  header[3];
+
+    if (f == NULL) {
+        Ns_Log(Warning, "nsdbbdb: could not write bloom filter %s: %s",
+               bloomPtr->snapshot, strerror(errno));
+        return;
+    }
+    header[0] = (uint64_t)bloomPtr->nBits;
+    header[1] = (uint64_t)bloomPtr->nHashes;
+    header[2] = (uint64_t)bloomPtr->capacity;
+    if (fwrite("NSBLOOM1", 8u, 1u, f) != 1u
+        || fwrite(header, sizeof(header), 1u, f) != 1u
+        || fwrite(bloomPtr->bits, bloomPtr->nBits / 8u, 1u, f) != 1u
+        || fclose(f) != 0) {
+        Ns_Log(Warning, "nsdbbdb: could not write bloom filter %s", bloomPtr->snapshot);
+        unlink(bloomPtr->snapshot);
+    }
+}
+
+/*
+ * Create the filter of a datasource, from the snapshot if available,
+ * otherwise by a background scan. The snapshot is kept next to the
+ * database file.
+ */
+static dbBloom *BloomCreate(dbShared *sharedPtr, const char *datasource)
+{
+    dbBloom     *bloomPtr = ns_calloc(1u, sizeof(dbBloom));
+    Tcl_DString  ds;
+
+    Tcl_DStringInit(&ds);
+    DatasourcePath(sharedPtr->pool, datasource, ".bloom", &ds);
+
+    Ns_MutexInit(&bloomPtr->lock);
+    Ns_MutexSetName2(&bloomPtr->lock, "nsdbbdb:bloom", NULL);
+    bloomPtr->fpr = sharedPtr->pool->bloomFpr;
+    bloomPtr->shared = sharedPtr;
+    bloomPtr->snapshot = ns_strdup(ds.string);
+    Tcl_DStringFree(&ds);
+
+    if (BloomLoad(bloomPtr)) {
+        Ns_Log(Notice, "nsdbbdb: loaded bloom filter %s", bloomPtr->snapshot);
+    } else {
+        Tcl_Obj     *dictObj = Tcl_NewDictObj(), *nameObj = Tcl_NewStringObj("keys", 4);
+        Tcl_Obj     *keysObj = NULL;
+        Tcl_WideInt  keys = 0;
+
+        /*
+         * Size the filter by the (approximate) number of keys.
+         */
+        Tcl_IncrRefCount(dictObj);
+        Tcl_IncrRefCount(nameObj);
+        if (DbStats(sharedPtr, dictObj, NS_TRUE) == 0
+            && Tcl_DictObjGet(NULL, dictObj, nameObj, &keysObj) == TCL_OK
+            && keysObj != NULL) {
+            (void) Tcl_GetWideIntFromObj(NULL, keysObj, &keys);
+        }
+        Tcl_DecrRefCount(nameObj);
+        Tcl_DecrRefCount(dictObj);
+        Ns_MutexLock(&bloomPtr->lock);
+        BloomStartBuild(bloomPtr, keys);
+        Ns_MutexUnlock(&bloomPtr->lock);
+    }
+    return bloomPtr;
+}
+
+/*
+ * Stop a running build and write the snapshot.
+ */
+static void BloomDestroy(dbBloom *bloomPtr)
+{
+    Ns_MutexLock(&bloomPtr->lock);
+    bloomPtr->stop = NS_TRUE;
+    Ns_MutexUnlock(&bloomPtr->lock);
+    if (bloomPtr->joinable) {
+        Ns_ThreadJoin(&bloomPtr->thread, NULL);
+    }
+    if (bloomPtr->bits != NULL) {
+        BloomSave(bloomPtr);
+    }
+    ns_free(bloomPtr->bits);
+    ns_free(bloomPtr->snapshot);
+    Ns_MutexDestroy(&bloomPtr->lock);
+    ns_free(bloomPtr);
+}
+
+/*
+ * Return true when the key is certainly not in the database.
+ */
+static bool BloomExcludes(const dbConn *conn, const NS_DB_VAL *keyPtr)
+{
+    dbBloom *bloomPtr = conn->shared->bloom;
+    bool     excluded = NS_FALSE;
+
+    if (bloomPtr != NULL) {
+        uint64_t hash = BloomHash(keyPtr);
+
+        Ns_MutexLock(&bloomPtr->lock);
+        if (bloomPtr->bits != NULL
+            && !BloomTest(bloomPtr->bits, bloomPtr->nBits, bloomPtr->nHashes, hash)) {
+            bloomPtr->negatives++;
+            excluded = NS_TRUE;
+        }
+        Ns_MutexUnlock(&bloomPtr->lock);
+    }
+    return excluded;
+}
+
+/*
+ * Add a key before it is written.
+ */
+static void BloomAdd(const dbConn *conn, const NS_DB_VAL *keyPtr)
+{
+    dbBloom *bloomPtr = conn->shared->bloom;
+
+    if (bloomPtr != NULL) {
+        uint64_t hash = BloomHash(keyPtr);
+
+        Ns_MutexLock(&bloomPtr->lock);
+        if (bloomPtr->bits != NULL) {
+            BloomSet(bloomPtr->bits, bloomPtr->nBits, bloomPtr->nHashes, hash);
+            if (++bloomPtr->adds > bloomPtr->capacity) {
+                BloomStartBuild(bloomPtr, bloomPtr->capacity / 2 + bloomPtr->adds);
+            }
+        }
+        if (bloomPtr->buildBits != NULL) {
+            BloomSet(bloomPtr->buildBits, bloomPtr->buildNBits, bloomPtr->buildNHashes, hash);
+        }
+        Ns_MutexUnlock(&bloomPtr->lock);
+    }
+}
+
+/*
+ * Count a deleted key, the filter is rebuilt when a quarter of its
+ * capacity was deleted.
+ */
+static void BloomDelete(const dbConn *conn)
+{
+    dbBloom *bloomPtr = conn->shared->bloom;
+
+    if (bloomPtr != NULL) {
+        Ns_MutexLock(&bloomPtr->lock);
+        if (bloomPtr->bits != NULL && ++bloomPtr->deletes > bloomPtr->capacity / 4) {
+            BloomStartBuild(bloomPtr, bloomPtr->capacity / 2 + bloomPtr->adds - bloomPtr->deletes);
+        }
+        Ns_MutexUnlock(&bloomPtr->lock);
+    }
+}
+
+/*
+ * The database was truncated, all keys are gone. Keys written meanwhile
+ * might already be in the filter, so the old bits stay in use until a
+ * filter sized for an empty database was built in the background.
+ */
+static void BloomClear(const dbConn *conn)
+{
+    dbBloom *bloomPtr = conn->shared->bloom;
+
+    if (bloomPtr != NULL) {
+        Ns_MutexLock(&bloomPtr->lock);
+        if (bloomPtr->bits != NULL) {
+            BloomStartBuild(bloomPtr, 0);
+        }
+        Ns_MutexUnlock(&bloomPtr->lock);
+    }
+}
+
+/*
+ * Expiry of keys (PUT/t<seconds>). The expiry times are kept in an index
+ * of their own per datasource with two kinds of records:
+ *
+ *     "k" <key>           -> <expiry>   expiry of a key
+ *     "e" <expiry> <key>  -> ""         keys ordered by expiry
+ *
+ * The expiry is stored as 8 byte big endian number of seconds, so the "e"
+ * records sort oldest first. In Berkeley DB, the index is a database in
+ * the environment of the pool and updated in the transaction of the
+ * write. In LMDB, it is an environment of its own: the changes are queued
+ * in the connection and applied in a transaction of the index, which is
+ * committed right after the data, see TtlCommit(). Expired keys are
+ * treated as missing by GET, MGET, get and exists and are deleted by
+ * DbReapExpired().
+ */
+#define TTL_SIZE 8
+
+static void TtlEncode(unsigned char *bytes, Tcl_WideInt expiry)
+{
+    int i;
+
+    for (i = TTL_SIZE - 1; i >= 0; i--) {
+        bytes[i] = (unsigned char)(expiry & 0xff);
+        expiry >>= 8;
+    }
+}
+
+static Tcl_WideInt TtlDecode(const unsigned char *bytes)
+{
+    Tcl_WideInt expiry = 0;
+    int         i;
+
+    for (i = 0; i < TTL_SIZE; i++) {
+        expiry = (expiry << 8) | bytes[i];
+    }
+    return expiry;
+}
+
+/*
+ * Build the "k" record (expiry 0) or "e" record of a key in dsPtr and
+ * point valPtr to it.
+ */
+static void TtlRecord(Tcl_DString *dsPtr, const NS_DB_VAL *keyPtr, Tcl_WideInt expiry, NS_DB_VAL *valPtr)
+{
+    Tcl_DStringSetLength(dsPtr, 0);
+    if (expiry == 0) {
+        Tcl_DStringAppend(dsPtr, "k", 1);
+    } else {
+        unsigned char bytes[TTL_SIZE];
+
+        TtlEncode(bytes, expiry);
+        Tcl_DStringAppend(dsPtr, "e", 1);
+        Tcl_DStringAppend(dsPtr, (const char *)bytes, TTL_SIZE);
+    }
+    Tcl_DStringAppend(dsPtr, NS_DB_VAL_DATA(*keyPtr), (TCL_SIZE_T)NS_DB_VAL_SIZE(*keyPtr));
+    memset(valPtr, 0, sizeof(*valPtr));
+    NS_DB_VAL_DATA(*valPtr) = dsPtr->string;
+    NS_DB_VAL_SIZE(*valPtr) = (NS_DB_SIZE_T)dsPtr->length;
+}
+
+/*
+ * Get the expiry of a key from the index.
+ */
+static int TtlGet(const dbShared *sharedPtr, NS_DB_TXN *txn, const NS_DB_VAL *keyPtr, Tcl_WideInt *expiryPtr)
+{
+    Tcl_DString   ds;
+    NS_DB_VAL     key, data;
+    unsigned char bytes[TTL_SIZE];
+    int           rc;
+
+    Tcl_DStringInit(&ds);
+    TtlRecord(&ds, keyPtr, 0, &key);
+    memset(&data, 0, sizeof(data));
+#ifdef LMDB
+    rc = mdb_get(txn, sharedPtr->ttlDbi, &key, &data);
+    if (rc == 0 && data.mv_size == TTL_SIZE) {
+        memcpy(bytes, data.mv_data, TTL_SIZE);
+    }
+#else
+    data.data = bytes;
+    data.ulen = TTL_SIZE;
+    data.flags = DB_DBT_USERMEM;
+    rc = sharedPtr->ttlDbi->get(sharedPtr->ttlDbi, txn, &key, &data, 0u);
+#endif
+    if (rc == 0) {
+        if (NS_DB_VAL_SIZE(data) == TTL_SIZE) {
+            *expiryPtr = TtlDecode(bytes);
+        } else {
+            rc = NS_DB_NOTFOUND;
+        }
+    }
+    Tcl_DStringFree(&ds);
+    return rc;
+}
+
+/*
+ * Delete the "k" and "e" records of a key with the given expiry.
+ */
+static int TtlDelete(const dbShared *sharedPtr, NS_DB_TXN *txn, const NS_DB_VAL *keyPtr, Tcl_WideInt expiry)
+{
+    Tcl_DString ds;
+    NS_DB_VAL   key;
+    int         rc;
+
+    Tcl_DStringInit(&ds);
+    TtlRecord(&ds, keyPtr, expiry, &key);
+    rc = NS_DB_DBI_DEL(txn, sharedPtr->ttlDbi, &key);
+    if (rc == 0 || rc == NS_DB_NOTFOUND) {
+        TtlRecord(&ds, keyPtr, 0, &key);
+        rc = NS_DB_DBI_DEL(txn, sharedPtr->ttlDbi, &key);
+    }
+    Tcl_DStringFree(&ds);
+    return (rc == NS_DB_NOTFOUND) ? 0 : rc;
+}
+
+/*
+ * Return true when the key has expired, but was not yet deleted.
+ */
+static bool TtlExpired(dbConn *conn, NS_DB_TXN *txn, const NS_DB_VAL *keyPtr)
+{
+    const dbShared *sharedPtr = conn->shared;
+    Tcl_WideInt     expiry = 0;
+    int             rc;
+
+    if (sharedPtr->ttlEnv == NULL) {
+        return NS_FALSE;
+    }
+#ifdef LMDB
+    /*
+     * The index has its own read-only transaction, released right away.
+     */
+    (void)txn;
+    if (conn->ttlRtxn == NULL) {
+        rc = mdb_txn_begin(sharedPtr->ttlEnv, NULL, MDB_RDONLY, &conn->ttlRtxn);
+    } else {
+        rc = mdb_txn_renew(conn->ttlRtxn);
+    }
+    if (rc == 0) {
+        rc = TtlGet(sharedPtr, conn->ttlRtxn, keyPtr, &expiry);
+        mdb_txn_reset(conn->ttlRtxn);
+    }
+#else
+    rc = TtlGet(sharedPtr, txn, keyPtr, &expiry);
+#endif
+    return (rc == 0 && expiry <= (Tcl_WideInt)time(NULL));
+}
+
+/*
+ * Set the expiry of a key in the index, or remove it when expiry is 0.
+ */
+static int TtlSet(const dbShared *sharedPtr, NS_DB_TXN *txn, const NS_DB_VAL *keyPtr, Tcl_WideInt expiry)
+{
+    Tcl_WideInt old = 0;
+    bool        unchanged = NS_FALSE;
+    int         rc;
+
+    rc = TtlGet(sharedPtr, txn, keyPtr, &old);
+    if (rc == 0) {
+        unchanged = (old == expiry);
+        if (!unchanged) {
+            rc = TtlDelete(sharedPtr, txn, keyPtr, old);
+        }
+    } else if (rc == NS_DB_NOTFOUND) {
+        rc = 0;
+    }
+    if (rc == 0 && expiry != 0 && !unchanged) {
+        Tcl_DString   ds;
+        NS_DB_VAL     key, data;
+        unsigned char bytes[TTL_SIZE];
+
+        Tcl_DStringInit(&ds);
+        TtlEncode(bytes, expiry);
+        memset(&data, 0, sizeof(data));
+        NS_DB_VAL_DATA(data) = bytes;
+        NS_DB_VAL_SIZE(data) = TTL_SIZE;
+        TtlRecord(&ds, keyPtr, 0, &key);
+        rc = NS_DB_DBI_PUT(txn, sharedPtr->ttlDbi, &key, &data, 0u);
+        if (rc == 0) {
+            NS_DB_VAL_SIZE(data) = 0u;
+            TtlRecord(&ds, keyPtr, expiry, &key);
+            rc = NS_DB_DBI_PUT(txn, sharedPtr->ttlDbi, &key, &data, 0u);
+        }
+        Tcl_DStringFree(&ds);
+    }
+    return rc;
+}
+
+#ifdef LMDB
+/*
+ * Expiry change queued in conn->ttlKeys, followed by the key. A change
+ * with the expiry TTL_DROP and no key empties the index, see
+ * TtlTruncate().
+ */
+typedef struct {
+    int         shard;
+    Tcl_WideInt expiry;
+    size_t      size;
+} dbTtlChange;
+
+#define TTL_DROP ((Tcl_WideInt)-1)
+
+/*
+ * Commit a write transaction of the current shard together with the
+ * queued expiry changes of its keys. The index is changed in a write
+ * transaction begun before and committed after the data, so a write
+ * which fails or is aborted leaves the expiry alone, and the reaper,
+ * which holds the write lock of the shard when it opens a write
+ * transaction of the index, sees the new expiry.
+ */
+static int TtlCommit(dbConn *conn, NS_DB_TXN *txn)
+{
+    const dbShared *sharedPtr = conn->shared;
+    NS_DB_TXN      *ttlTxn = NULL;
+    const char     *ptr = conn->ttlKeys.string;
+    const char     *end = ptr + conn->ttlKeys.length;
+    int             rc = 0;
+
+    while (ptr < end && rc == 0) {
+        dbTtlChange change;
+
+        memcpy(&change, ptr, sizeof(change));
+        if (change.shard == conn->shard) {
+            NS_DB_VAL key;
+
+            memset(&key, 0, sizeof(key));
+            key.mv_data = (char *)ptr + sizeof(change);
+            key.mv_size = change.size;
+            if (ttlTxn == NULL) {
+                rc = mdb_txn_begin(sharedPtr->ttlEnv, NULL, 0u, &ttlTxn);
+            }
+            if (rc == 0) {
+                rc = (change.expiry == TTL_DROP)
+                    ? mdb_drop(ttlTxn, sharedPtr->ttlDbi, 0)
+                    : TtlSet(sharedPtr, ttlTxn, &key, change.expiry);
+            }
+        }
+        ptr += sizeof(change) + change.size;
+    }
+    if (rc != 0) {
+        if (ttlTxn != NULL) {
+            mdb_txn_abort(ttlTxn);
+        }
+        mdb_txn_abort(txn);
+    } else {
+        rc = mdb_txn_commit(txn);
+        if (ttlTxn != NULL) {
+            if (rc != 0) {
+                mdb_txn_abort(ttlTxn);
+            } else if ((rc = mdb_txn_commit(ttlTxn)) != 0) {
+                Ns_Log(Error, "nsdbbdb: expiry index of %s not updated: %s",
+                       (char *)Tcl_GetHashKey(&dbTable, sharedPtr->hPtr), NS_DB_STRERR(rc));
+            }
+        }
+    }
+    TtlDiscard(conn);
+    return rc;
+}
+
+/*
+ * Drop the queued expiry changes of the current shard.
+ */
+static void TtlDiscard(dbConn *conn)
+{
+    char *ptr = conn->ttlKeys.string;
+    char *end = ptr + conn->ttlKeys.length;
+    char *keep = ptr;
+
+    while (ptr < end) {
+        dbTtlChange change;
+        size_t      length;
+
+        memcpy(&change, ptr, sizeof(change));
+        length = sizeof(change) + change.size;
+        if (change.shard != conn->shard) {
+            memmove(keep, ptr, length);
+            keep += length;
+        }
+        ptr += length;
+    }
+    Tcl_DStringSetLength(&conn->ttlKeys, (TCL_SIZE_T)(keep - conn->ttlKeys.string));
+}
+#endif
+
+/*
+ * Set the expiry of a key, or remove it when expiry is 0, in the
+ * transaction of the write. In LMDB, the change is queued until the
+ * commit, see TtlCommit().
+ */
+static int TtlUpdate(dbConn *conn, NS_DB_TXN *txn, const NS_DB_VAL *keyPtr, Tcl_WideInt expiry)
+{
+    if (conn->shared->ttlEnv == NULL) {
+        return 0;
+    }
+#ifdef LMDB
+    {
+        dbTtlChange change;
+
+        (void)txn;
+        change.shard = conn->shard;
+        change.expiry = expiry;
+        change.size = keyPtr->mv_size;
+        Tcl_DStringAppend(&conn->ttlKeys, (const char *)&change, (TCL_SIZE_T)sizeof(change));
+        Tcl_DStringAppend(&conn->ttlKeys, keyPtr->mv_data, (TCL_SIZE_T)keyPtr->mv_size);
+    }
+    return 0;
+#else
+    return TtlSet(conn->shared, txn, keyPtr, expiry);
+#endif
+}
+
+/*
+ * Write a key with the given expiry (0 for none). A key which has expired
+ * but was not yet deleted does not block PUT/o.
+ */
+static int DbPut(dbConn *conn, NS_DB_TXN *txn, NS_DB_VAL *keyPtr, NS_DB_VAL *dataPtr,
+                 unsigned int flags, Tcl_WideInt expiry)
+{
+    int rc;
+
+    if ((flags & NS_DB_NOOVERWRITE) != 0u && conn->shared->ttlEnv != NULL) {
+        /*
+         * The old expiry stays, unless the key is written.
+         */
+        rc = NS_DB_DBI_PUT(txn, conn->dbi, keyPtr, dataPtr, flags);
+        if (rc == NS_DB_KEYEXIST && TtlExpired(conn, txn, keyPtr)) {
+            rc = NS_DB_DBI_PUT(txn, conn->dbi, keyPtr, dataPtr, flags & ~(unsigned int)NS_DB_NOOVERWRITE);
+        }
+        if (rc == 0) {
+            rc = TtlUpdate(conn, txn, keyPtr, expiry);
+        }
+    } else {
+#ifdef LMDB
+        /*
+         * The expiry change is queued once the key was written, so a failed
+         * write within BEGIN/COMMIT does not change it.
+         */
+        rc = NS_DB_DBI_PUT(txn, conn->dbi, keyPtr, dataPtr, flags);
+        if (rc == 0) {
+            rc = TtlUpdate(conn, txn, keyPtr, expiry);
+        }
+#else
+        rc = TtlUpdate(conn, txn, keyPtr, expiry);
+        if (rc == 0) {
+            rc = NS_DB_DBI_PUT(txn, conn->dbi, keyPtr, dataPtr, flags);
+        }
+#endif
+    }
+    return rc;
+}
+
+/*
+ * Remove all expiry records on TRUNCATE. In LMDB, the index has its own
+ * environment. It is emptied right away after the data was truncated, or
+ * at the COMMIT of an explicit transaction, so an ABORT keeps it.
+ */
+static int TtlTruncate(dbConn *conn)
+{
+    const dbShared *sharedPtr = conn->shared;
+    NS_DB_TXN      *txn;
+    int             rc;
+
+#ifdef LMDB
+    if (conn->txn != NULL) {
+        dbTtlChange change;
+
+        change.shard = conn->shard;
+        change.expiry = TTL_DROP;
+        change.size = 0u;
+        Tcl_DStringAppend(&conn->ttlKeys, (const char *)&change, (TCL_SIZE_T)sizeof(change));
+        return 0;
+    }
+    rc = mdb_txn_begin(sharedPtr->ttlEnv, NULL, 0u, &txn);
+    if (rc == 0) {
+        rc = mdb_drop(txn, sharedPtr->ttlDbi, 0);
+        rc = (rc == 0) ? mdb_txn_commit(txn) : (mdb_txn_abort(txn), rc);
+    }
+#else
+    u_int32_t count;
+
+    rc = GetTempTxn(conn, &txn);
+    if (rc == 0) {
+        conn->status = sharedPtr->ttlDbi->truncate(sharedPtr->ttlDbi, txn, &count, 0);
+        rc = CleanTempTxn(conn, txn);
+    }
+#endif
+    return rc;
+}
+
+/*
+ * Transaction of a single write. In Berkeley DB, writes auto-commit,
+ * unless the expiry index is updated as well.
+ */
+static int GetWriteTxn(dbConn *conn, NS_DB_TXN **txnPtr)
+{
+    return (conn->shared->ttlEnv != NULL) ? GetBatchTxn(conn, txnPtr) : GetTempTxn(conn, txnPtr);
+}
+
+/*
+ * Expiry time of a time to live in seconds, 0 for none.
+ */
+static Tcl_WideInt TtlExpiry(Tcl_WideInt ttl)
+{
+    return (ttl > 0) ? (Tcl_WideInt)time(NULL) + ttl : 0;
+}
+
+static int CheckTtl(Ns_DbHandle *handle, Tcl_WideInt ttl)
+{
+    const dbConn *conn = handle->connection;
+
+    if (conn->shared->ttlEnv == NULL) {
+        Ns_DbSetException(handle, "ERROR", "ttl is not enabled for this pool");
+        return NS_ERROR;
+    }
+    if (ttl < 0) {
+        Ns_DbSetException(handle, "ERROR", "invalid ttl");
+        return NS_ERROR;
+    }
+    return NS_OK;
+}
+
+/*
+ * Delete up to ttlBatch expired keys of a datasource, oldest first, and
+ * return the number of processed index entries or -1 on errors. The
+ * entries are collected first, then the keys are deleted, when their
+ * expiry was not changed in the meantime.
+ */
+static int TtlReap(dbShared *sharedPtr, Tcl_WideInt now)
+{
+    dbConn        conn;
+    Tcl_DString   entries, ds;
+    NS_DB_CURSOR *cursor;
+    NS_DB_TXN    *txn = NULL;
+    NS_DB_VAL     key, data;
+    char         *ptr;
+    int           rc, count = 0, deleted = 0;
+
+    memset(&conn, 0, sizeof(conn));
+    conn.pool = (struct _dbPool *)sharedPtr->pool;
+    conn.shared = sharedPtr;
+    UseShard(&conn, 0);
+    Tcl_DStringInit(&entries);
+    Tcl_DStringInit(&ds);
+
+    /*
+     * Collect the expired entries as <deleted flag><expiry><key length><key>.
+     */
+#ifdef LMDB
+    rc = mdb_txn_begin(sharedPtr->ttlEnv, NULL, MDB_RDONLY, &txn);
+    if (rc == 0)
+#endif
+    {
+        memset(&key, 0, sizeof(key));
+        memset(&data, 0, sizeof(data));
+#ifdef LMDB
+        key.mv_data = (char *)"e";
+#else
+        key.data = ns_strdup("e");
+        key.flags = DB_DBT_REALLOC;
+        data.flags = DB_DBT_PARTIAL | DB_DBT_USERMEM;
+#endif
+        NS_DB_VAL_SIZE(key) = 1u;
+        rc = NS_DB_DBI_CURSOR_OPEN(txn, sharedPtr->ttlDbi, &cursor);
+        if (rc == 0) {
+            rc = NS_DB_CURSOR_GET(cursor, &key, &data, NS_DB_SET_RANGE);
+            while (rc == 0 && count < ttlBatch) {
+                const unsigned char *bytes = NS_DB_VAL_DATA(key);
+                size_t               size = NS_DB_VAL_SIZE(key);
+                uint32_t             length = (uint32_t)(size - 1u - TTL_SIZE);
+
+                if (size <= 1u + TTL_SIZE || bytes[0] != 'e' || TtlDecode(bytes + 1) > now) {
+                    break;
+                }
+                Tcl_DStringAppend(&entries, "\0", 1);
+                Tcl_DStringAppend(&entries, (const char *)bytes + 1, TTL_SIZE);
+                Tcl_DStringAppend(&entries, (const char *)&length, (TCL_SIZE_T)sizeof(length));
+                Tcl_DStringAppend(&entries, (const char *)bytes + 1 + TTL_SIZE, (TCL_SIZE_T)length);
+                count++;
+                rc = NS_DB_CURSOR_GET(cursor, &key, &data, NS_DB_NEXT);
+            }
+            if (rc == NS_DB_NOTFOUND) {
+                rc = 0;
+            }
+            NS_DB_DBI_CURSOR_CLOSE(cursor);
+        }
+#ifdef LMDB
+        mdb_txn_abort(txn);
+#else
+        ns_free(key.data);
+#endif
+    }
+
+    /*
+     * Delete the keys. In Berkeley DB, the keys and the index entries are
+     * deleted in a single transaction. In LMDB, the keys are deleted shard
+     * by shard, checking their expiry while the write lock of the shard is
+     * held, then the index entries.
+     */
+#ifdef LMDB
+    {
+        int shard;
+
+        for (shard = 0; shard < sharedPtr->nShards && rc == 0 && count > 0; shard++) {
+            NS_DB_TXN *ttlTxn = NULL;
+
+            txn = NULL;
+            for (ptr = entries.string; ptr < entries.string + entries.length; ) {
+                uint32_t    length;
+                Tcl_WideInt expiry = TtlDecode((unsigned char *)ptr + 1), current;
+
+                memcpy(&length, ptr + 1 + TTL_SIZE, sizeof(length));
+                memset(&key, 0, sizeof(key));
+                key.mv_data = ptr + 1 + TTL_SIZE + sizeof(length);
+                key.mv_size = length;
+                RouteKey(&conn, &key);
+                if (conn.shard == shard) {
+                    if (txn == NULL) {
+                        rc = mdb_txn_begin(conn.env, NULL, 0u, &txn);
+                        /*
+                         * A write transaction of the index waits for
+                         * writers which committed the data of the shard,
+                         * but not yet the index, see TtlCommit().
+                         */
+                        if (rc == 0) {
+                            rc = mdb_txn_begin(sharedPtr->ttlEnv, NULL, 0u, &ttlTxn);
+                        }
+                        if (rc != 0) {
+                            break;
+                        }
+                    }
+                    if (TtlGet(sharedPtr, ttlTxn, &key, &current) == 0 && current == expiry) {
+                        rc = mdb_del(txn, conn.dbi, &key, NULL);
+                        if (rc == 0) {
+                            *ptr = '\1';
+                        } else if (rc == NS_DB_NOTFOUND) {
+                            rc = 0;
+                        } else {
+                            break;
+                        }
+                    }
+                }
+                ptr += 1 + TTL_SIZE + sizeof(length) + length;
+            }
+            if (ttlTxn != NULL) {
+                mdb_txn_abort(ttlTxn);
+            }
+            if (txn != NULL) {
+                if (rc == 0) {
+                    rc = mdb_txn_commit(txn);
+                } else {
+                    mdb_txn_abort(txn);
+                }
+            }
+        }
+        txn = NULL;
+        if (rc == 0 && count > 0) {
+            rc = mdb_txn_begin(sharedPtr->ttlEnv, NULL, 0u, &txn);
+        }
+    }
+#else
+    if (rc == 0 && count > 0) {
+        rc = GetBatchTxn(&conn, &txn);
+    }
+#endif
+    for (ptr = entries.string; rc == 0 && ptr < entries.string + entries.length; ) {
+        uint32_t    length;
+        Tcl_WideInt expiry = TtlDecode((unsigned char *)ptr + 1), current;
+
+        memcpy(&length, ptr + 1 + TTL_SIZE, sizeof(length));
+        memset(&key, 0, sizeof(key));
+        NS_DB_VAL_DATA(key) = ptr + 1 + TTL_SIZE + sizeof(length);
+        NS_DB_VAL_SIZE(key) = (NS_DB_SIZE_T)length;
+        rc = TtlGet(sharedPtr, txn, &key, &current);
+        if (rc == 0 && current == expiry) {
+#ifndef LMDB
+            RouteKey(&conn, &key);
+            rc = conn.dbi->del(conn.dbi, txn, &key, 0);
+            if (rc == 0) {
+                *ptr = '\1';
+            }
+            if (rc == 0 || rc == NS_DB_NOTFOUND) {
+                rc = TtlDelete(sharedPtr, txn, &key, expiry);
+            }
+#else
+            rc = TtlDelete(sharedPtr, txn, &key, expiry);
+#endif
+        } else if (rc == 0 || rc == NS_DB_NOTFOUND) {
+            /*
+             * The expiry was changed, remove the outdated "e" record.
+             */
+            TtlRecord(&ds, &key, expiry, &data);
+            rc = NS_DB_DBI_DEL(txn, sharedPtr->ttlDbi, &data);
+            if (rc == NS_DB_NOTFOUND) {
+                rc = 0;
+            }
+        }
+        ptr += 1 + TTL_SIZE + sizeof(length) + length;
+    }
+    if (count > 0) {
+        conn.status = rc;
+#ifdef LMDB
+        if (txn != NULL) {
+            if (rc == 0) {
+                rc = mdb_txn_commit(txn);
+            } else {
+                mdb_txn_abort(txn);
+            }
+        }
+#else
+        rc = CleanTempTxn(&conn, txn);
+#endif
+    }
+
+    /*
+     * Invalidate the deleted keys in the cache after the commit.
+     */
+    for (ptr = entries.string; ptr < entries.string + entries.length; ) {
+        uint32_t length;
+
+        memcpy(&length, ptr + 1 + TTL_SIZE, sizeof(length));
+        if (*ptr == '\1') {
+            memset(&key, 0, sizeof(key));
+            NS_DB_VAL_DATA(key) = ptr + 1 + TTL_SIZE + sizeof(length);
+            NS_DB_VAL_SIZE(key) = (NS_DB_SIZE_T)length;
+            if (sharedPtr->cache != NULL) {
+                CacheInvalidate(sharedPtr->cache, &key);
+            }
+            BloomDelete(&conn);
+            deleted++;
+        }
+        ptr += 1 + TTL_SIZE + sizeof(length) + length;
+    }
+    sharedPtr->ttlReaped += deleted;
+    Tcl_DStringFree(&entries);
+    Tcl_DStringFree(&ds);
+    if (rc != 0) {
+        Ns_Log(Warning, "nsdbbdb: deleting expired keys of %s: %s",
+               (char *)Tcl_GetHashKey(&dbTable, sharedPtr->hPtr), NS_DB_STRERR(rc));
+        return -1;
+    }
+    Ns_Log(BdbDebug, "nsdbbdb: deleted %d expired keys of %s", deleted,
+           (char *)Tcl_GetHashKey(&dbTable, sharedPtr->hPtr));
+    return count;
+}
+
+/*
+ * Scheduled procedure deleting the expired keys of all opened datasources
+ * in batches. The datasources are kept open during the run.
+ */
+static void DbReapExpired(void *UNUSED(arg), int UNUSED(id))
+{
+    Tcl_HashEntry *hPtr;
+    Tcl_HashSearch search;
+    dbShared     **shareds;
+    int            i, n = 0;
+    Tcl_WideInt    now = (Tcl_WideInt)time(NULL);
+
+    Ns_MutexLock(&dbLock);
+    shareds = ns_malloc(sizeof(dbShared *) * ((size_t)dbTable.numEntries + 1u));
+    for (hPtr = Tcl_FirstHashEntry(&dbTable, &search); hPtr != NULL; hPtr = Tcl_NextHashEntry(&search)) {
+        dbShared *sharedPtr = Tcl_GetHashValue(hPtr);
+
+        if (sharedPtr->ttlEnv != NULL) {
+            sharedPtr->refCount++;
+            shareds[n++] = sharedPtr;
+        }
+    }
+    Ns_MutexUnlock(&dbLock);
+
+    for (i = 0; i < n; i++) {
+        while (TtlReap(shareds[i], now) == ttlBatch) {
+            ;
+        }
+    }
+
+    Ns_MutexLock(&dbLock);
+    for (i = 0; i < n; i++) {
+        if (--shareds[i]->refCount == 0) {
+            Tcl_DeleteHashEntry(shareds[i]->hPtr);
+            CloseShared(shareds[i]);
+        }
+    }
+    Ns_MutexUnlock(&dbLock);
+    ns_free(shareds);
+}
+
+/*
+ * Parse the flags of "PUT/flags" and "MPUT/flags" starting at the slash and
+ * return the position after the flags, or NULL when the flags are invalid.
+ * The flag t<seconds> sets the time to live of the keys, the seconds must
+ * follow the 't' immediately.
+ */
+static char *ParsePutFlags(char *ptr, unsigned int *flagsPtr, Tcl_WideInt *ttlPtr)
+{
+    unsigned int flags = 0;
+
+    *ttlPtr = 0;
+    for (; *ptr != '\0' && *ptr != ' '; ptr++) {
+        if (*ptr == 'a') {
+            flags |= NS_DB_APPEND;
+        } else
+        if (*ptr == 'd') {
+            flags |= NS_DB_NODUPDATA;
+        } else
+        if (*ptr == 'o') {
+            flags |= NS_DB_NOOVERWRITE;
+        } else
+        if (*ptr == 't') {
+            const char *digits = (ptr[1] == '-') ? ptr + 2 : ptr + 1;
+            char       *end;
+
+            if (*digits < '0' || *digits > '9') {
+                return NULL;
+            }
+            *ttlPtr = strtoll(ptr + 1, &end, 10);
+            ptr = end - 1;
+        }
+    }
+    *flagsPtr = flags;
+    return ptr;
+}
+
+/*
+ * Extract the next field of a key or key/data list starting at *nextPtr
+ * and ending at end. On success, *nextPtr points to the following field
+ * or is NULL, when this was the last field. Fields are separated by the
+ * delimiter. In binary mode, fields are prefixed by their length in bytes
+ * as "<length>:" and there is no separator, so fields might contain the
+ * delimiter.
+ */
+static int NextField(const dbPool *poolPtr, char **nextPtr, const char *end, NS_DB_VAL *valPtr)
+{
+    char *ptr = *nextPtr;
+
+    if (poolPtr->binary) {
+        char          *data;
+        unsigned long  length = strtoul(ptr, &data, 10);
+
+        if (data == ptr || *data != ':' || length > (unsigned long)(end - data - 1)) {
+            return NS_ERROR;
+        }
+        data++;
+        NS_DB_VAL_DATA(*valPtr) = data;
+        NS_DB_VAL_SIZE(*valPtr) = (NS_DB_SIZE_T)length;
+        *nextPtr = (data + length < end) ? data + length : NULL;
+
+    } else {
+        char *delim = strstr(ptr, poolPtr->delimiter);
+
+        NS_DB_VAL_DATA(*valPtr) = ptr;
+        if (delim != NULL) {
+            *delim = '\0';
+            *nextPtr = delim + poolPtr->delimiterLength;
+        } else {
+            *nextPtr = NULL;
+            delim = (char *)end;
+        }
+        NS_DB_VAL_SIZE(*valPtr) = (NS_DB_SIZE_T)(delim - ptr) + 1;
+    }
+    return NS_OK;
+}
+
+/*
+ * Parse the next field as a key, typed keys are converted into buf, see
+ * EncodeKey().
+ */
+static int NextKey(const dbPool *poolPtr, char **nextPtr, const char *end, NS_DB_VAL *keyPtr, unsigned char *buf)
+{
+    if (NextField(poolPtr, nextPtr, end, keyPtr) != NS_OK) {
+        return NS_ERROR;
+    }
+    return EncodeKey(poolPtr, keyPtr, buf);
+}
+
+/*
+ * Write or delete a single item of MPUT or MDEL.
+ */
+static int BatchItem(dbConn *conn, NS_DB_TXN *txn, NS_DB_VAL *keyPtr, NS_DB_VAL *dataPtr,
+                     unsigned int flags, Tcl_WideInt expiry, bool isPut)
+{
+    int rc;
+
+    if (isPut) {
+        BloomAdd(conn, keyPtr);
+        rc = DbPut(conn, txn, keyPtr, dataPtr, flags, expiry);
+    } else {
+        rc = TtlUpdate(conn, txn, keyPtr, 0);
+        if (rc == 0) {
+            rc = NS_DB_DBI_DEL(txn, conn->dbi, keyPtr);
+        }
+        if (rc == 0) {
+            BloomDelete(conn);
+        }
+        /*
+         * Deleting a batch is idempotent, missing keys are ignored.
+         */
+        if (rc == NS_DB_NOTFOUND) {
+            rc = 0;
+        }
+    }
+    /*
+     * Cached keys are invalidated after the batch was committed.
+     */
+    if (conn->shared->cache != NULL && rc == 0) {
+        CacheNote(conn, keyPtr);
+    }
+    return rc;
+}
+
+/*
+ * Perform MPUT or MDEL on a delimiter separated list of keys (or key/data
+ * pairs) in a single transaction. On failure of a single item, the whole
+ * batch is aborted, unless it is part of an explicit transaction. In LMDB,
+ * every shard of a sharded datasource is an environment of its own, so the
+ * items are grouped by shard first and the batch takes one transaction per
+ * shard in ascending order, see ShardQueue(). The transactions are
+ * committed one after the other.
+ */
+static int DbExecBatch(Ns_DbHandle *handle, const char *list, unsigned int flags, Tcl_WideInt expiry, bool isPut)
+{
+    dbConn       *conn = handle->connection;
+    NS_DB_TXN    *txn = NULL;
+    NS_DB_VAL     key, data;
+    char         *copy, *end, *next;
+    int           rc, count = 0;
+#ifdef LMDB
+    NS_DB_TXN    *txns[DB_MAX_SHARDS];
+    Tcl_DString   queue;
+    int           i;
+
+    memset(txns, 0, sizeof(txns));
+    Tcl_DStringInit(&queue);
+#endif
+
+    conn->cmd = isPut ? DB_UPDATE : DB_DELETE;
+#ifndef LMDB
+    conn->status = GetBatchTxn(conn, &txn);
+    if (conn->status != 0) {
+        NS_DB_ENV_ERR(conn->env, conn->status, "txn_begin");
+        Ns_DbSetException(handle, "ERROR", NS_DB_STRERR(conn->status));
+        return NS_ERROR;
+    }
+#endif
+    memset(&key, 0, sizeof(key));
+    memset(&data, 0, sizeof(data));
+    copy = ns_strdup(list);
+    end = copy + strlen(copy);
+
+    for (next = copy; next != NULL && conn->status == 0; ) {
+        if (NextKey(conn->pool, &next, end, &key, conn->keyEnc) != NS_OK) {
+            Ns_DbSetException(handle, "ERROR", "invalid key");
+            conn->status = EINVAL;
+            break;
+        }
+        if (isPut) {
+            if (next == NULL) {
+                Ns_DbSetException(handle, "ERROR", "MPUT: missing data for last key");
+                conn->status = EINVAL;
+                break;
+            }
+            if (NextField(conn->pool, &next, end, &data) != NS_OK) {
+                Ns_DbSetException(handle, "ERROR", "invalid length prefix of data");
+                conn->status = EINVAL;
+                break;
+            }
+        }
+        RouteKey(conn, &key);
+        count ++;
+#ifdef LMDB
+        if (conn->shared->nShards > 1) {
+            ShardQueue(&queue, conn->shard, &key, &data);
+            continue;
+        }
+        if (txns[0] == NULL) {
+            conn->status = GetBatchTxn(conn, &txns[0]);
+            if (conn->status != 0) {
+                txns[0] = NULL;
+                break;
+            }
+        }
+        txn = txns[0];
+#endif
+        conn->status = BatchItem(conn, txn, &key, &data, flags, expiry, isPut);
+    }
+#ifdef LMDB
+    for (i = 0; i < conn->shared->nShards && conn->status == 0 && queue.length > 0; i++) {
+        TCL_SIZE_T offset = 0;
+
+        UseShard(conn, i);
+        while (conn->status == 0 && ShardNext(&queue, i, &offset, &key, &data)) {
+            if (txns[i] == NULL) {
+                conn->status = GetBatchTxn(conn, &txns[i]);
+                if (conn->status != 0) {
+                    txns[i] = NULL;
+                    break;
+                }
+            }
+            conn->status = BatchItem(conn, txns[i], &key, &data, flags, expiry, isPut);
+        }
+    }
+#endif
+    Ns_Log(BdbDebug, "... %s: %d items, status %d", isPut ? "MPUT" : "MDEL", count, conn->status);
+
+    if (conn->status != 0 && conn->status != EINVAL) {
+        NS_DB_ERR0(conn->dbi, conn->status, isPut ? "DB->put" : "DB->del");
+        Ns_DbSetException(handle, "ERROR", NS_DB_STRERR(conn->status));
+    }
+    ns_free(copy);
+
+#ifdef LMDB
+    Tcl_DStringFree(&queue);
+    rc = 0;
+    for (i = 0; i < conn->shared->nShards; i++) {
+        if (txns[i] != NULL) {
+            UseShard(conn, i);
+            if (CleanTempTxn(conn, txns[i]) != 0) {
+                rc = -1;
+            }
+        }
+    }
+#else
+    rc = CleanTempTxn(conn, txn);
+#endif
+    if (conn->txn == NULL) {
+        CacheFlush(conn);
+    }
+    if (rc == 0) {
+        return NS_DML;
+    }
+    if (conn->status == 0) {
+        Ns_DbSetException(handle, "ERROR", "commit failed");
+    }
+    return NS_ERROR;
+}
+
+/*
+ * Parse the options of "CURSOR/options" starting at the slash and return
+ * the position after the options. The options are
+ *
+ *   p      - prefix scan, return only keys starting with the given key
+ *   r      - reverse order
+ *   i      - the end key is inclusive
+ *   l<n>   - return at most n rows
+ *   o<n>   - skip the first n rows
+ *   u      - sharded datasources: return the shards one after the other
+ *            instead of merging them in key order
+ */
+static char *ParseScanFlags(char *ptr, dbConn *conn)
+{
+    for (ptr++; *ptr != '\0' && *ptr != ' '; ptr++) {
+        switch (*ptr) {
+        case 'p':
+            conn->scanFlags |= DB_SCAN_PREFIX;
+            break;
+        case 'r':
+            conn->scanFlags |= DB_SCAN_REVERSE;
+            break;
+        case 'i':
+            conn->scanFlags |= DB_SCAN_INCLUSIVE;
+            break;
+        case 'u':
+            conn->scanFlags |= DB_SCAN_UNORDERED;
+            break;
+        case 'l':
+            conn->limit = (int)strtol(ptr + 1, &ptr, 10);
+            ptr--;
+            break;
+        case 'o':
+            conn->skip = (int)strtol(ptr + 1, &ptr, 10);
+            ptr--;
+            break;
+        default:
+            break;
+        }
+    }
+    return ptr;
+}
+
+/*
+ * Compare two keys in the order of the database.
+ */
+#ifndef LMDB
+/*
+ * Let a DBT receive its value in a buffer owned by the connection
+ * (DB_DBT_USERMEM), growing the buffer geometrically to at least minSize.
+ * The content of the buffer is preserved.
+ */
+static void UseBuffer(DBT *dbt, void **bufPtr, u_int32_t *sizePtr, u_int32_t minSize)
+{
+    if (*sizePtr < minSize || *bufPtr == NULL) {
+        u_int32_t size = *sizePtr > 0u ? *sizePtr : 256u;
+
+        while (size < minSize) {
+            size *= 2u;
+        }
+        *bufPtr = ns_realloc(*bufPtr, size);
+        *sizePtr = size;
+    }
+    dbt->data = *bufPtr;
+    dbt->ulen = *sizePtr;
+    dbt->flags = DB_DBT_USERMEM;
+}
+
+/*
+ * Copy a key into the key buffer of the connection, such that a cursor
+ * operation may return a different key in place.
+ */
+static void DbSetKey(dbConn *conn, const void *data, size_t size)
+{
+    UseBuffer(&conn->key, &conn->keyBuf, &conn->keyBufSize, (u_int32_t)size + 1u);
+    memcpy(conn->key.data, data, size);
+    conn->key.size = (u_int32_t)size;
+}
+
+/*
+ * Lookup a key, the data is returned in the data buffer of the
+ * connection and valid until the next retrieval.
+ */
+static int DbGetValue(dbConn *conn, NS_DB_TXN *txn, NS_DB_VAL *key, NS_DB_VAL *data)
+{
+    int rc;
+
+    UseBuffer(data, &conn->dataBuf, &conn->dataBufSize, 0u);
+    rc = NS_DB_DBI_GET(txn, conn->dbi, key, data);
+    if (rc == DB_BUFFER_SMALL) {
+        UseBuffer(data, &conn->dataBuf, &conn->dataBufSize, data->size);
+        rc = NS_DB_DBI_GET(txn, conn->dbi, key, data);
+    }
+    return rc;
+}
+
+/*
+ * Cursor operation on the key and data of the connection. Berkeley DB
+ * leaves the cursor unchanged on DB_BUFFER_SMALL, so the operation is
+ * repeated with larger buffers and the original input key.
+ */
+static int DbCursorGet(dbConn *conn, u_int32_t flags)
+{
+    u_int32_t keySize = conn->key.size;
+    int       rc;
+
+    UseBuffer(&conn->key, &conn->keyBuf, &conn->keyBufSize, 0u);
+    UseBuffer(&conn->data, &conn->dataBuf, &conn->dataBufSize, 0u);
+    rc = NS_DB_CURSOR_GET(conn->cursor, &conn->key, &conn->data, flags);
+    if (rc == DB_BUFFER_SMALL) {
+        UseBuffer(&conn->key, &conn->keyBuf, &conn->keyBufSize, conn->key.size);
+        UseBuffer(&conn->data, &conn->dataBuf, &conn->dataBufSize, conn->data.size);
+        conn->key.size = keySize;
+        rc = NS_DB_CURSOR_GET(conn->cursor, &conn->key, &conn->data, flags);
+    }
+    return rc;
+}
+
+/*
+ * Lookup a key which is about to be updated. In a transaction, the write
+ * lock is taken already when reading, so concurrent updates of the key
+ * wait for each other instead of deadlocking.
+ */
+static int DbGetValueRmw(dbConn *conn, NS_DB_TXN *txn, NS_DB_VAL *key, NS_DB_VAL *data)
+{
+    u_int32_t flags = (txn != NULL) ? DB_RMW : 0u;
+    int       rc;
+
+    UseBuffer(data, &conn->dataBuf, &conn->dataBufSize, 0u);
+    rc = conn->dbi->get(conn->dbi, txn, key, data, flags);
+    if (rc == DB_BUFFER_SMALL) {
+        UseBuffer(data, &conn->dataBuf, &conn->dataBufSize, data->size);
+        rc = conn->dbi->get(conn->dbi, txn, key, data, flags);
+    }
+    return rc;
+}
+#else
+/*
+ * LMDB returns pointers into the memory map, values are copied directly
+ * from there into the result.
+ */
+static void DbSetKey(dbConn *conn, const void *data, size_t size)
+{
+    conn->key.mv_data = (void *)data;
+    conn->key.mv_size = size;
+}
+# define DbGetValue(conn,txn,key,data) NS_DB_DBI_GET((txn), (conn)->dbi, (key), (data))
+# define DbGetValueRmw                 DbGetValue
+# define DbCursorGet(conn,op)          NS_DB_CURSOR_GET((conn)->cursor, &(conn)->key, &(conn)->data, (op))
+#endif
+
+/*
+ * Begin the write transaction of a read-modify-write operation (INCR,
+ * CAS). Berkeley DB environments without transactions serialize these
+ * operations of the datasource by a mutex instead.
+ */
+static int BeginUpdate(dbConn *conn, NS_DB_TXN **txnPtr)
+{
+#ifdef LMDB
+    return GetTempTxn(conn, txnPtr);
+#else
+    int rc = GetBatchTxn(conn, txnPtr);
+
+    if (rc == 0 && *txnPtr == NULL) {
+        Ns_MutexLock(&conn->shared->rmwLock);
+    }
+    return rc;
+#endif
+}
+
+static int EndUpdate(dbConn *conn, NS_DB_TXN *txn)
+{
+    int rc = CleanTempTxn(conn, txn);
+
+#ifndef LMDB
+    if (txn == NULL) {
+        Ns_MutexUnlock(&conn->shared->rmwLock);
+    }
+#endif
+    return rc;
+}
+
+/*
+ * Parse a stored value or the delta of INCR as a decimal integer. A
+ * terminating NUL character (non-binary mode) is accepted.
+ */
+static bool ValToWide(const NS_DB_VAL *valPtr, Tcl_WideInt *valuePtr)
+{
+    char   buffer[TCL_INTEGER_SPACE], *end;
+    size_t size = NS_DB_VAL_SIZE(*valPtr);
+
+    if (size > 0u && ((const char *)NS_DB_VAL_DATA(*valPtr))[size - 1u] == '\0') {
+        size--;
+    }
+    if (size == 0u || size >= sizeof(buffer)) {
+        return NS_FALSE;
+    }
+    memcpy(buffer, NS_DB_VAL_DATA(*valPtr), size);
+    buffer[size] = '\0';
+    errno = 0;
+    *valuePtr = strtoll(buffer, &end, 10);
+    return (end == buffer + size && errno == 0);
+}
+
+/*
+ * Add the increment to the integer stored under the key of the connection
+ * in a single write transaction and leave the new value in conn->data. A
+ * missing key counts as 0.
+ */
+static int IncrKey(Ns_DbHandle *handle, Tcl_WideInt increment)
+{
+    dbConn      *conn = handle->connection;
+    NS_DB_TXN   *txn = NULL;
+    NS_DB_VAL    data;
+    Tcl_WideInt  value = 0;
+    const char  *errorMsg = NULL;
+
+    RouteKey(conn, &conn->key);
+    BloomAdd(conn, &conn->key);
+    conn->status = BeginUpdate(conn, &txn);
+    if (conn->status != 0) {
+        NS_DB_ENV_ERR(conn->env, conn->status, "txn_begin");
+        Ns_DbSetException(handle, "ERROR", NS_DB_STRERR(conn->status));
+        return NS_ERROR;
+    }
+
+    memset(&data, 0, sizeof(data));
+    conn->status = DbGetValueRmw(conn, txn, &conn->key, &data);
+    if (conn->status == 0 && TtlExpired(conn, txn, &conn->key)) {
+        /*
+         * An expired counter starts again without expiry.
+         */
+        conn->status = TtlUpdate(conn, txn, &conn->key, 0);
+    } else if (conn->status == 0 && !ValToWide(&data, &value)) {
+        errorMsg = "value is not an integer";
+    } else if (conn->status == NS_DB_NOTFOUND) {
+        conn->status = 0;
+    }
+    if (errorMsg == NULL && conn->status == 0
+        && ((increment > 0 && value > LLONG_MAX - increment)
+            || (increment < 0 && value < LLONG_MIN - increment))) {
+        errorMsg = "integer overflow";
+    }
+    if (errorMsg != NULL) {
+        conn->status = EINVAL;
+    } else if (conn->status == 0) {
+        int length = snprintf(conn->counterBuf, sizeof(conn->counterBuf), "%" TCL_LL_MODIFIER "d",
+                              value + increment);
+
+        NS_DB_VAL_DATA(conn->data) = conn->counterBuf;
+        NS_DB_VAL_SIZE(conn->data) = (NS_DB_SIZE_T)length + (conn->pool->binary ? 0u : 1u);
+#ifdef LMDB
+        conn->status = mdb_put(txn, conn->dbi, &conn->key, &conn->data, 0u);
+#else
+        conn->status = conn->dbi->put(conn->dbi, txn, &conn->key, &conn->data, 0u);
+#endif
+    }
+    conn->status = EndUpdate(conn, txn);
+
+    if (conn->status == 0) {
+        CacheWrite(conn, &conn->key);
+        handle->fetchingRows = NS_TRUE;
+        return NS_ROWS;
+    }
+    if (errorMsg != NULL) {
+        Ns_DbSetException(handle, "ERROR", errorMsg);
+    } else {
+        NS_DB_ERR0(conn->dbi, conn->status, "DB->put");
+        Ns_DbSetException(handle, "ERROR", NS_DB_STRERR(conn->status));
+    }
+    return NS_ERROR;
+}
+
+/*
+ * INCR and DECR: parse the key and the optional delta, separated by the
+ * delimiter (or length prefixed in binary mode), and return the new value
+ * as a row.
+ */
+static int DbExecIncr(Ns_DbHandle *handle, char *args, bool decrement)
+{
+    dbConn      *conn = handle->connection;
+    NS_DB_VAL    delta;
+    char        *next = args, *deltaPtr;
+    Tcl_WideInt  increment = 1;
+    int          result;
+
+    conn->cmd = DB_GET;
+    if (NextKey(conn->pool, &next, args + strlen(args), &conn->key, conn->keyEnc) != NS_OK) {
+        Ns_DbSetException(handle, "ERROR", "invalid key");
+        return NS_ERROR;
+    }
+    deltaPtr = next;
+    if (deltaPtr != NULL
+        && (NextField(conn->pool, &next, deltaPtr + strlen(deltaPtr), &delta) != NS_OK
+            || !ValToWide(&delta, &increment))) {
+        Ns_DbSetException(handle, "ERROR", "invalid delta");
+        result = NS_ERROR;
+    } else if (decrement && increment == LLONG_MIN) {
+        Ns_DbSetException(handle, "ERROR", "integer overflow");
+        result = NS_ERROR;
+    } else {
+        result = IncrKey(handle, decrement ? -increment : increment);
+    }
+    // Restore original delimiter
+    if (deltaPtr != NULL && !conn->pool->binary) {
+        *(deltaPtr - conn->pool->delimiterLength) = *conn->pool->delimiter;
+    }
+    return result;
+}
+
+/*
+ * CAS and CAS/m: replace the value of an existing key by the new value,
+ * when the current value equals the expected one. With the option "m",
+ * the expected value is the MD5 digest of the current value in hex, as
+ * returned by ns_md5, so large values need not be sent back. The compare
+ * and the write are performed in a single write transaction. Returns a
+ * row with 1 when the value was replaced and 0 otherwise.
+ */
+static int DbExecCas(Ns_DbHandle *handle, char *query)
+{
+    dbConn      *conn = handle->connection;
+    NS_DB_TXN   *txn = NULL;
+    NS_DB_VAL    expected, current, data;
+    char        *next, *expectedPtr = NULL, *dataPtr = NULL;
+    bool         digest = NS_FALSE, swapped = NS_FALSE;
+
+    if (query[3] == '/') {
+        for (next = query + 4; *next != '\0' && *next != ' '; next++) {
+            if (*next == 'm') {
+                digest = NS_TRUE;
+            }
+        }
+        if (*next != '\0') {
+            next++;
+        }
+    } else {
+        next = query + 4;
+    }
+    conn->cmd = DB_GET;
+    if (NextKey(conn->pool, &next, next + strlen(next), &conn->key, conn->keyEnc) != NS_OK) {
+        Ns_DbSetException(handle, "ERROR", "invalid key");
+        return NS_ERROR;
+    }
+    expectedPtr = next;
+    if (next != NULL && NextField(conn->pool, &next, next + strlen(next), &expected) != NS_OK) {
+        Ns_DbSetException(handle, "ERROR", "invalid length prefix of expected value");
+        conn->status = EINVAL;
+    } else if (next == NULL) {
+        Ns_DbSetException(handle, "ERROR", "CAS: missing new value");
+        conn->status = EINVAL;
+    } else {
+        /*
+         * The new value is the remainder of the query.
+         */
+        dataPtr = next;
+        NS_DB_VAL_DATA(data) = dataPtr;
+        NS_DB_VAL_SIZE(data) = NS_DB_STR_SIZE(conn, dataPtr);
+
+        RouteKey(conn, &conn->key);
+        conn->status = BeginUpdate(conn, &txn);
+        if (conn->status == 0) {
+            memset(&current, 0, sizeof(current));
+            conn->status = DbGetValueRmw(conn, txn, &conn->key, &current);
+            if (conn->status == 0 && !TtlExpired(conn, txn, &conn->key)) {
+                if (digest) {
+                    Ns_CtxMD5     ctx;
+                    unsigned char md5[16];
+                    char          hex[33];
+                    size_t        size = NS_DB_VAL_SIZE(current);
+
+                    if (!conn->pool->binary && size > 0u) {
+                        size--;
+                    }
+                    Ns_CtxMD5Init(&ctx);
+                    Ns_CtxMD5Update(&ctx, NS_DB_VAL_DATA(current), size);
+                    Ns_CtxMD5Final(&ctx, md5);
+                    Ns_HexString(md5, hex, 16, NS_TRUE);
+                    swapped = (NS_DB_VAL_SIZE(expected) >= 32u
+                               && strncasecmp(NS_DB_VAL_DATA(expected), hex, 32u) == 0);
+                } else {
+                    swapped = (NS_DB_VAL_SIZE(expected) == NS_DB_VAL_SIZE(current)
+                               && memcmp(NS_DB_VAL_DATA(expected), NS_DB_VAL_DATA(current),
+                                         NS_DB_VAL_SIZE(current)) == 0);
+                }
+                if (swapped) {
+#ifdef LMDB
+                    conn->status = mdb_put(txn, conn->dbi, &conn->key, &data, 0u);
+#else
+                    conn->status = conn->dbi->put(conn->dbi, txn, &conn->key, &data, 0u);
+#endif
+                }
+            } else if (conn->status == NS_DB_NOTFOUND) {
+                conn->status = 0;
+            }
+            conn->status = EndUpdate(conn, txn);
+        }
+        if (conn->status == 0) {
+            if (swapped) {
+                CacheWrite(conn, &conn->key);
+            }
+            NS_DB_VAL_DATA(conn->data) = (char *)(swapped ? "1" : "0");
+            NS_DB_VAL_SIZE(conn->data) = 1u;
+        } else {
+            NS_DB_ERR0(conn->dbi, conn->status, "DB->put");
+            Ns_DbSetException(handle, "ERROR", NS_DB_STRERR(conn->status));
+        }
+    }
+
+    // Restore original delimiters
+    if (!conn->pool->binary) {
+        if (expectedPtr != NULL) {
+            *(expectedPtr - conn->pool->delimiterLength) = *conn->pool->delimiter;
+        }
+        if (dataPtr != NULL) {
+            *(dataPtr - conn->pool->delimiterLength) = *conn->pool->delimiter;
+        }
+    }
+    if (conn->status == 0) {
+        handle->fetchingRows = NS_TRUE;
+        return NS_ROWS;
+    }
+    return NS_ERROR;
+}
+
+/*
+ * Default order of keys in both engines: bytewise, a prefix sorts first.
+ */
+static int CompareKeys(const dbConn *conn, const NS_DB_VAL *a, const NS_DB_VAL *b)
+{
+#ifdef LMDB
+    return mdb_cmp(mdb_cursor_txn(conn->cursor), conn->dbi, a, b);
+#else
+    (void)conn;
+    return CompareBytes(a, b);
+#endif
+}
+
+/*
+ * Check, whether the current key of the cursor is within the bounds
+ * (prefix or end key) of the scan.
+ */
+static bool InScanRange(const dbConn *conn)
+{
+    if ((conn->scanFlags & DB_SCAN_PREFIX) != 0u) {
+        return NS_DB_VAL_SIZE(conn->key) >= conn->prefixLength
+            && memcmp(NS_DB_VAL_DATA(conn->key), NS_DB_VAL_DATA(conn->bound), conn->prefixLength) == 0;
+    }
+    if ((conn->scanFlags & DB_SCAN_END) != 0u) {
+        int rc = CompareKeys(conn, &conn->key, &conn->bound);
+
+        if ((conn->scanFlags & DB_SCAN_REVERSE) != 0u) {
+            rc = -rc;
+        }
+        return rc < 0 || (rc == 0 && (conn->scanFlags & DB_SCAN_INCLUSIVE) != 0u);
+    }
+    return NS_TRUE;
+}
+
+/*
+ * Position the cursor on the first row of the scan. In reverse order, this
+ * is the last key less or equal to the start key, or for a prefix scan,
+ * the last key with this prefix.
+ */
+static int PositionScan(dbConn *conn, const NS_DB_VAL *startPtr)
+{
+    int rc;
+
+    if (startPtr == NULL) {
+        return DbCursorGet(conn,
+                           (conn->scanFlags & DB_SCAN_REVERSE) != 0u ? NS_DB_LAST : NS_DB_FIRST);
+    }
+    DbSetKey(conn, NS_DB_VAL_DATA(*startPtr), NS_DB_VAL_SIZE(*startPtr));
+    if ((conn->scanFlags & DB_SCAN_REVERSE) == 0u) {
+        return DbCursorGet(conn, NS_DB_SET_RANGE);
+    }
+
+    if ((conn->scanFlags & DB_SCAN_PREFIX) != 0u) {
+        unsigned char *bytes;
+        size_t         length = conn->prefixLength;
+#ifdef LMDB
+        Tcl_DString    ds;
+
+        /*
+         * The key points to the copy of the query, which is still needed
+         * as bound.
+         */
+        Tcl_DStringInit(&ds);
+        Tcl_DStringAppend(&ds, NS_DB_VAL_DATA(*startPtr), (TCL_SIZE_T)length);
+        NS_DB_VAL_DATA(conn->key) = ds.string;
+#endif
+        /*
+         * Position after the last key with the prefix by searching for
+         * the smallest key greater than all keys with this prefix.
+         */
+        bytes = NS_DB_VAL_DATA(conn->key);
+        while (length > 0u && bytes[length - 1u] == 0xffu) {
+            length--;
+        }
+        if (length == 0u) {
+            rc = DbCursorGet(conn, NS_DB_LAST);
+        } else {
+            bytes[length - 1u]++;
+            NS_DB_VAL_SIZE(conn->key) = (NS_DB_SIZE_T)length;
+            rc = DbCursorGet(conn, NS_DB_SET_RANGE);
+        }
+#ifdef LMDB
+        Tcl_DStringFree(&ds);
+#endif
+    } else {
+        rc = DbCursorGet(conn, NS_DB_SET_RANGE);
+    }
+    if (rc == NS_DB_NOTFOUND) {
+        rc = DbCursorGet(conn, NS_DB_LAST);
+    } else if (rc == 0
+               && ((conn->scanFlags & DB_SCAN_PREFIX) != 0u || CompareKeys(conn, &conn->key, startPtr) > 0)) {
+        rc = DbCursorGet(conn, NS_DB_PREV);
+    }
+    return rc;
+}
+
+#ifndef LMDB
+/*
+ * Retrieve the next row of a forward scan from the bulk buffer of the
+ * connection, which is refilled via DB_MULTIPLE_KEY when drained. Key and
+ * data point into the buffer, no memory is allocated per row.
+ */
+static int StepBulk(dbConn *conn)
+{
+    void      *keyPtr, *dataPtr;
+    u_int32_t  keySize, dataSize;
+
+    for (;;) {
+        if (conn->bulkPtr == NULL) {
+            DBT key;
+            int rc;
+
+            if (!conn->bulkActive) {
+                /*
+                 * From now on, key and data point into the bulk buffer.
+                 */
+                DbFreeVals(conn);
+                conn->bulkActive = NS_TRUE;
+            }
+            if (conn->bulk.data == NULL) {
+                conn->bulk.data = ns_malloc(conn->pool->bulkSize);
+                conn->bulk.ulen = conn->pool->bulkSize;
+                conn->bulk.flags = DB_DBT_USERMEM;
+            }
+            memset(&key, 0, sizeof(key));
+            UseBuffer(&key, &conn->keyBuf, &conn->keyBufSize, 0u);
+            rc = conn->cursor->c_get(conn->cursor, &key, &conn->bulk, DB_NEXT | DB_MULTIPLE_KEY);
+            if (rc == DB_BUFFER_SMALL) {
+                /*
+                 * A single record does not fit into the buffer, grow it.
+                 */
+                if (conn->bulk.size > conn->bulk.ulen) {
+                    conn->bulk.ulen = (conn->bulk.size + 1023u) & ~1023u;
+                    conn->bulk.data = ns_realloc(conn->bulk.data, conn->bulk.ulen);
+                }
+                UseBuffer(&key, &conn->keyBuf, &conn->keyBufSize, key.size);
+                rc = conn->cursor->c_get(conn->cursor, &key, &conn->bulk, DB_NEXT | DB_MULTIPLE_KEY);
+            }
+            if (rc != 0) {
+                return rc;
+            }
+            DB_MULTIPLE_INIT(conn->bulkPtr, &conn->bulk);
+        }
+        DB_MULTIPLE_KEY_NEXT(conn->bulkPtr, &conn->bulk, keyPtr, keySize, dataPtr, dataSize);
+        if (keyPtr != NULL) {
+            break;
+        }
+    }
+    NS_DB_VAL_DATA(conn->key) = keyPtr;
+    NS_DB_VAL_SIZE(conn->key) = keySize;
+    NS_DB_VAL_DATA(conn->data) = dataPtr;
+    NS_DB_VAL_SIZE(conn->data) = dataSize;
+    return 0;
+}
+#endif
+
+/*
+ * Move the cursor to the next row in scan direction. Forward scans in
+ * Berkeley DB use bulk retrieval when configured. LMDB returns pointers
+ * into the memory map and needs no buffering.
+ */
+static int StepScan(dbConn *conn)
+{
+#ifndef LMDB
+    if (conn->pool->bulkSize > 0u && (conn->scanFlags & DB_SCAN_REVERSE) == 0u && conn->scan == NULL) {
+        return StepBulk(conn);
+    }
+#endif
+    return DbCursorGet(conn, (conn->scanFlags & DB_SCAN_REVERSE) != 0u ? NS_DB_PREV : NS_DB_NEXT);
+}
+
+/*
+ * Move the cursor to the first (on the key of the connection) or the next
+ * duplicate of the key for GETALL. Berkeley DB reads the duplicates in
+ * bulk (DB_MULTIPLE) when bulksize is configured, LMDB a page at a time
+ * (MDB_GET_MULTIPLE) when they have a fixed size.
+ */
+static int NextDup(dbConn *conn, bool first)
+{
+#ifdef LMDB
+    int rc;
+
+    if ((conn->pool->dbFlags & MDB_DUPFIXED) == 0u) {
+        return DbCursorGet(conn, first ? MDB_SET : MDB_NEXT_DUP);
+    }
+    if (first) {
+        rc = DbCursorGet(conn, MDB_SET);
+        if (rc == 0) {
+            /*
+             * A single value is not stored on a page of duplicates, in
+             * this case MDB_GET_MULTIPLE leaves the data unchanged.
+             */
+            conn->dupSize = conn->data.mv_size;
+            conn->dups = conn->data;
+            rc = NS_DB_CURSOR_GET(conn->cursor, &conn->key, &conn->dups, MDB_GET_MULTIPLE);
+        }
+        conn->dupsOffset = 0u;
+    } else if (conn->dupsOffset >= conn->dups.mv_size) {
+        rc = NS_DB_CURSOR_GET(conn->cursor, &conn->key, &conn->dups, MDB_NEXT_MULTIPLE);
+        conn->dupsOffset = 0u;
+    } else {
+        rc = 0;
+    }
+    if (rc == 0) {
+        conn->data.mv_data = (char *)conn->dups.mv_data + conn->dupsOffset;
+        conn->data.mv_size = conn->dupSize;
+        conn->dupsOffset += conn->dupSize;
+    }
+    return rc;
+#else
+    void      *dataPtr;
+    u_int32_t  dataSize;
+
+    if (conn->pool->bulkSize == 0u) {
+        return DbCursorGet(conn, first ? DB_SET : DB_NEXT_DUP);
+    }
+    for (;;) {
+        if (conn->bulkPtr == NULL) {
+            u_int32_t flags = (first ? DB_SET : DB_NEXT_DUP) | DB_MULTIPLE;
+            int       rc;
+
+            if (conn->bulk.data == NULL) {
+                conn->bulk.data = ns_malloc(conn->pool->bulkSize);
+                conn->bulk.ulen = conn->pool->bulkSize;
+                conn->bulk.flags = DB_DBT_USERMEM;
+            }
+            rc = conn->cursor->c_get(conn->cursor, &conn->key, &conn->bulk, flags);
+            if (rc == DB_BUFFER_SMALL) {
+                if (conn->bulk.size > conn->bulk.ulen) {
+                    conn->bulk.ulen = (conn->bulk.size + 1023u) & ~1023u;
+                    conn->bulk.data = ns_realloc(conn->bulk.data, conn->bulk.ulen);
+                }
+                rc = conn->cursor->c_get(conn->cursor, &conn->key, &conn->bulk, flags);
+            }
+            if (rc != 0) {
+                return rc;
+            }
+            first = NS_FALSE;
+            DB_MULTIPLE_INIT(conn->bulkPtr, &conn->bulk);
+        }
+        DB_MULTIPLE_NEXT(conn->bulkPtr, &conn->bulk, dataPtr, dataSize);
+        if (dataPtr != NULL) {
+            break;
+        }
+    }
+    NS_DB_VAL_DATA(conn->data) = dataPtr;
+    NS_DB_VAL_SIZE(conn->data) = dataSize;
+    return 0;
+#endif
+}
+
+/*
+ * Take over the row the cursor of a shard is positioned on, when it is in
+ * the range of the scan.
+ */
+static int LoadShardRow(dbConn *conn, dbScanShard *shardPtr, int rc)
+{
+    if (rc == 0 && !InScanRange(conn)) {
+        rc = NS_DB_NOTFOUND;
+    }
+    shardPtr->status = rc;
+    if (rc == 0) {
+        Tcl_DStringSetLength(&shardPtr->key, 0);
+        Tcl_DStringAppend(&shardPtr->key, NS_DB_VAL_DATA(conn->key), (TCL_SIZE_T)NS_DB_VAL_SIZE(conn->key));
+        Tcl_DStringSetLength(&shardPtr->data, 0);
+        Tcl_DStringAppend(&shardPtr->data, NS_DB_VAL_DATA(conn->data), (TCL_SIZE_T)NS_DB_VAL_SIZE(conn->data));
+    }
+    return (rc == NS_DB_NOTFOUND) ? 0 : rc;
+}
+
+/*
+ * Make the next row of a sharded scan the current one. This is the
+ * smallest (in reverse order the largest) of the current rows of the
+ * shards, or for unordered scans the row of the first shard which is not
+ * exhausted.
+ */
+static int PickShardRow(dbConn *conn)
+{
+    int i, best = -1;
+
+    for (i = 0; i < conn->shared->nShards; i++) {
+        if (conn->scan[i].status != 0) {
+            continue;
+        }
+        if (best < 0) {
+            best = i;
+            if ((conn->scanFlags & DB_SCAN_UNORDERED) != 0u) {
+                break;
+            }
+        } else {
+            NS_DB_VAL a, b;
+            int       rc;
+
+            NS_DB_VAL_DATA(a) = conn->scan[i].key.string;
+            NS_DB_VAL_SIZE(a) = (NS_DB_SIZE_T)conn->scan[i].key.length;
+            NS_DB_VAL_DATA(b) = conn->scan[best].key.string;
+            NS_DB_VAL_SIZE(b) = (NS_DB_SIZE_T)conn->scan[best].key.length;
+            rc = CompareKeys(conn, &a, &b);
+            if ((conn->scanFlags & DB_SCAN_REVERSE) != 0u) {
+                rc = -rc;
+            }
+            if (rc < 0) {
+                best = i;
+            }
+        }
+    }
+    if (best < 0) {
+        return NS_DB_NOTFOUND;
+    }
+    conn->scanShard = best;
+    NS_DB_VAL_DATA(conn->key) = conn->scan[best].key.string;
+    NS_DB_VAL_SIZE(conn->key) = (NS_DB_SIZE_T)conn->scan[best].key.length;
+    NS_DB_VAL_DATA(conn->data) = conn->scan[best].data.string;
+    NS_DB_VAL_SIZE(conn->data) = (NS_DB_SIZE_T)conn->scan[best].data.length;
+    return 0;
+}
+
+/*
+ * Start a scan over all shards with one cursor per shard, each in the read
+ * transaction of its shard. The cursors are advanced lazily, when their
+ * row was returned.
+ */
+static int StartShardScan(dbConn *conn, const NS_DB_VAL *startPtr)
+{
+    int i, rc = 0;
+
+    conn->scan = ns_calloc((size_t)conn->shared->nShards, sizeof(dbScanShard));
+    for (i = 0; i < conn->shared->nShards; i++) {
+        Tcl_DStringInit(&conn->scan[i].key);
+        Tcl_DStringInit(&conn->scan[i].data);
+        conn->scan[i].status = NS_DB_NOTFOUND;
+    }
+    for (i = 0; i < conn->shared->nShards && rc == 0; i++) {
+        NS_DB_TXN *txn;
+
+        UseShard(conn, i);
+        rc = GetReadTxn(conn, &txn);
+        if (rc == 0) {
+            rc = NS_DB_DBI_CURSOR_OPEN(txn, conn->dbi, &conn->scan[i].cursor);
+        }
+        if (rc == 0) {
+            conn->cursor = conn->scan[i].cursor;
+            rc = LoadShardRow(conn, &conn->scan[i], PositionScan(conn, startPtr));
+        }
+    }
+    return (rc == 0) ? PickShardRow(conn) : rc;
+}
+
+/*
+ * Advance the scan to the next row.
+ */
+static int NextScanRow(dbConn *conn)
+{
+    int rc;
+
+    if (conn->scan == NULL) {
+        return StepScan(conn);
+    }
+    UseShard(conn, conn->scanShard);
+    conn->cursor = conn->scan[conn->scanShard].cursor;
+    rc = LoadShardRow(conn, &conn->scan[conn->scanShard], StepScan(conn));
+    return (rc == 0) ? PickShardRow(conn) : rc;
+}
+
+static void CloseCursors(dbConn *conn)
+{
+    if (conn->scan != NULL) {
+        int i;
+
+        for (i = 0; i < conn->shared->nShards; i++) {
+            if (conn->scan[i].cursor != NULL) {
+                NS_DB_DBI_CURSOR_CLOSE(conn->scan[i].cursor);
+            }
+            Tcl_DStringFree(&conn->scan[i].key);
+            Tcl_DStringFree(&conn->scan[i].data);
+        }
+        ns_free(conn->scan);
+        conn->scan = NULL;
+    } else if (conn->cursor != NULL) {
+        Ns_Log(BdbDebug, "... closing cursor %p", (void*)conn->cursor);
+        NS_DB_DBI_CURSOR_CLOSE(conn->cursor);
+    }
+    conn->cursor = NULL;
+}
+
+/*
+ * Terminate a scan as soon as it is complete, releasing the cursor and
+ * the read transaction without waiting for the next statement.
+ */
+static void EndScan(Ns_DbHandle *handle)
+{
+    dbConn *conn = handle->connection;
+
+    CloseCursors(conn);
+    ReleaseReadTxn(conn);
+    handle->fetchingRows = NS_FALSE;
+}
+
+/*
+ * Open the cursor of a scan (one per shard) and position it on the first
+ * row. The cursor lives in the read transaction of the connection (or in
+ * the explicit transaction), which is released on the usual cleanup via
+ * DbCancel().
+ */
+static int OpenScan(dbConn *conn, const NS_DB_VAL *startPtr)
+{
+    NS_DB_TXN *txn;
+    int        rc;
+
+    if (conn->shared->nShards > 1) {
+        return StartShardScan(conn, startPtr);
+    }
+    rc = GetReadTxn(conn, &txn);
+    if (likely(rc == 0)) {
+        rc = NS_DB_DBI_CURSOR_OPEN(txn, conn->dbi, &conn->cursor);
+    }
+    if (rc != 0) {
+        NS_DB_ERR0(conn->dbi, rc, "DB->cursor");
+        ReleaseReadTxn(conn);
+        return rc;
+    }
+
+    /*
+     * Range request, try to position cursor to the closest key, otherwise
+     * full table scan.
+     */
+    return PositionScan(conn, startPtr);
+}
+
+static int ExecQuery(Ns_DbHandle *handle, char *query)
+{
+    dbConn    *conn = handle->connection;
+    NS_DB_TXN *tempTxn;
+
+    DbCancel(handle);
+
+    /*
+     * Retrieve one matching record
+     */
+    if (strncasecmp(query, "GET ", 4) == 0) {
+        /*
+         * The read cache is not used in transactions, which have to see
+         * their own writes.
+         */
+        bool          cached = (conn->shared->cache != NULL && conn->txn == NULL);
+        unsigned long generation = 0u;
+
+        conn->cmd = DB_GET;
+        NS_DB_VAL_DATA(conn->key) = query + 4;
+        NS_DB_VAL_SIZE(conn->key) = NS_DB_STR_SIZE(conn, NS_DB_VAL_DATA(conn->key));
+        if (EncodeKey(conn->pool, &conn->key, conn->keyEnc) != NS_OK) {
+            Ns_DbSetException(handle, "ERROR", "invalid key");
+            return NS_ERROR;
+        }
+        RouteKey(conn, &conn->key);
+        if (BloomExcludes(conn, &conn->key) || TtlExpired(conn, conn->txn, &conn->key)) {
+            conn->status = NS_DB_NOTFOUND;
+            handle->fetchingRows = NS_TRUE;
+            return NS_ROWS;
+        }
+        if (cached && CacheLookup(conn, &conn->key, &conn->data, &generation)) {
+            conn->status = 0;
+            handle->fetchingRows = NS_TRUE;
+            return NS_ROWS;
+        }
+        conn->status = GetReadTxn(conn, &tempTxn);
+        if (likely(conn->status == 0)) {
+            conn->status = DbGetValue(conn, tempTxn, &conn->key, &conn->data);
+        }
+        switch (conn->status) {
+        case 0:
+            if (cached) {
+                CacheStore(conn, &conn->key, &conn->data, generation);
+            }
+            /* fall through */
+        case NS_DB_NOTFOUND:
+            handle->fetchingRows = NS_TRUE;
+            return NS_ROWS;
+        default:
+            NS_DB_ERR0(conn->dbi, conn->status, "DB->get");
+            Ns_DbSetException(handle, "ERROR", NS_DB_STRERR(conn->status));
+            ReleaseReadTxn(conn);
+            return NS_ERROR;
+        }
+    }
+
+    /*
+     * Retrieve multiple records, one row per key. All lookups are
+     * performed in DbGetRow() using the same (read) transaction.
+     */
+    if (strncasecmp(query, "MGET ", 5) == 0) {
+        conn->cmd = DB_MGET;
+        conn->keys = ns_strdup(query + 5);
+        conn->keysEnd = conn->keys + strlen(conn->keys);
+        conn->nextKey = conn->keys;
+        conn->status = GetReadTxn(conn, &tempTxn);
+        if (likely(conn->status == 0)) {
+            handle->fetchingRows = NS_TRUE;
+            return NS_ROWS;
+        }
+        NS_DB_ERR0(conn->dbi, conn->status, "txn_begin");
+        Ns_DbSetException(handle, "ERROR", NS_DB_STRERR(conn->status));
+        return NS_ERROR;
+    }
+
+    /*
+     * Retrieve all duplicates of a key, one row per value. The rows are
+     * fetched from the cursor in DbGetRow().
+     */
+    if (strncasecmp(query, "GETALL ", 7) == 0) {
+        NS_DB_VAL key;
+
+        Ns_Log(BdbDebug, "... GETALL");
+        conn->cmd = DB_GETALL;
+        conn->count = 0;
+        memset(&key, 0, sizeof(key));
+        NS_DB_VAL_DATA(key) = query + 7;
+        NS_DB_VAL_SIZE(key) = NS_DB_STR_SIZE(conn, query + 7);
+        if (EncodeKey(conn->pool, &key, conn->keyEnc) != NS_OK) {
+            Ns_DbSetException(handle, "ERROR", "invalid key");
+            return NS_ERROR;
+        }
+        DbSetKey(conn, NS_DB_VAL_DATA(key), NS_DB_VAL_SIZE(key));
+        RouteKey(conn, &conn->key);
+        if (BloomExcludes(conn, &conn->key) || TtlExpired(conn, conn->txn, &conn->key)) {
+            conn->status = NS_DB_NOTFOUND;
+            handle->fetchingRows = NS_TRUE;
+            return NS_ROWS;
+        }
+        conn->status = GetReadTxn(conn, &tempTxn);
+        if (likely(conn->status == 0)) {
+            conn->status = NS_DB_DBI_CURSOR_OPEN(tempTxn, conn->dbi, &conn->cursor);
+        }
+        if (conn->status != 0) {
+            NS_DB_ERR0(conn->dbi, conn->status, "DB->cursor");
+            Ns_DbSetException(handle, "ERROR", NS_DB_STRERR(conn->status));
+            ReleaseReadTxn(conn);
+            return NS_ERROR;
+        }
+        conn->status = NextDup(conn, NS_TRUE);
+        switch (conn->status) {
+        case 0:
+        case NS_DB_NOTFOUND:
+            handle->fetchingRows = NS_TRUE;
+            return NS_ROWS;
+        default:
+            NS_DB_ERR0(conn->dbi, conn->status, "DB->c_get");
+            Ns_DbSetException(handle, "ERROR", NS_DB_STRERR(conn->status));
+            return NS_ERROR;
+        }
+    }
+
+    /*
+     * Returns 1 if entry exists
+     */
+    if (strncasecmp(query, "CHECK ", 6) == 0) {
+        bool          cached = (conn->shared->cache != NULL && conn->txn == NULL);
+        unsigned long generation = 0u;
+        NS_DB_VAL     key;
+
+        Ns_Log(BdbDebug, "... CHECK");
+        conn->cmd = DB_CHECK;
+        memset(&key, 0, sizeof(key));
+        NS_DB_VAL_DATA(key) = query + 6;
+        NS_DB_VAL_SIZE(key) = NS_DB_STR_SIZE(conn, query + 6);
+        if (EncodeKey(conn->pool, &key, conn->keyEnc) != NS_OK) {
+            Ns_DbSetException(handle, "ERROR", "invalid key");
+            return NS_ERROR;
+        }
+        DbSetKey(conn, NS_DB_VAL_DATA(key), NS_DB_VAL_SIZE(key));
+        RouteKey(conn, &conn->key);
+        if (cached && CacheLookup(conn, &conn->key, NULL, &generation)) {
+            conn->status = 0;
+            handle->fetchingRows = NS_TRUE;
+            return NS_ROWS;
+        }
+        conn->status = GetReadTxn(conn, &tempTxn);
+        if (likely(conn->status == 0)) {
+            conn->status = NS_DB_DBI_CURSOR_OPEN(tempTxn, conn->dbi, &conn->cursor);
+        }
+        if (conn->status != 0) {
+            NS_DB_ERR0(conn->dbi, conn->status, "DB->cursor");
+            Ns_DbSetException(handle, "ERROR", NS_DB_STRERR(conn->status));
+            ReleaseReadTxn(conn);
+            return NS_ERROR;
+        }
+        Ns_Log(BdbDebug, "... cursor get key '%.*s' len %ld",
+               (int)NS_DB_VAL_SIZE(conn->key), (char*)NS_DB_VAL_DATA(conn->key),
+               (long)NS_DB_VAL_SIZE(conn->key));
+
+        conn->status = DbCursorGet(conn, NS_DB_SET_RANGE);
+        Ns_Log(BdbDebug, "... cursor get %p rc %d", (void*)conn->cursor, conn->status);
+
+        /*
+         * The cursor is positioned on the first key not smaller than the
+         * given one, cache only an exact match.
+         */
+        if (cached && conn->status == 0 && NS_DB_VAL_SIZE(conn->key) == NS_DB_VAL_SIZE(key)
+            && memcmp(NS_DB_VAL_DATA(conn->key), NS_DB_VAL_DATA(key), NS_DB_VAL_SIZE(key)) == 0) {
+            CacheStore(conn, &conn->key, &conn->data, generation);
+        }
+
+        switch (conn->status) {
+        case 0:
+        case NS_DB_NOTFOUND:
+            Ns_Log(BdbDebug, "... cursor get %p rc %d return ROWS", (void*)conn->cursor, conn->status);
+            handle->fetchingRows = NS_TRUE;
+            return NS_ROWS;
+        default:
+            NS_DB_ERR0(conn->dbi, conn->status, "DB->get");
+            Ns_DbSetException(handle, "ERROR", NS_DB_STRERR(conn->status));
+            return NS_ERROR;
+        }
+    }
+
+    if (strncasecmp(query, "TRUNCATE", 8) == 0) {
+        int i;
+
+        conn->status = 0;
+        for (i = 0; i < conn->shared->nShards && conn->status == 0; i++) {
+            UseShard(conn, i);
+            conn->status = GetTempTxn(conn, &tempTxn);
+            if (conn->status == 0) {
+#ifdef LMDB
+                conn->status = mdb_drop(tempTxn, conn->dbi, 0);
+#else
+                u_int32_t count;
+                conn->status = conn->dbi->truncate(conn->dbi, tempTxn, &count, 0);
+#endif
+                conn->status = CleanTempTxn(conn, tempTxn);
+            }
+        }
+        if (conn->status == 0 && conn->shared->ttlEnv != NULL) {
+            conn->status = TtlTruncate(conn);
+        }
+        if (conn->shared->cache != NULL) {
+            if (conn->txn == NULL) {
+                CacheClear(conn->shared->cache);
+            } else {
+                conn->cacheClear = NS_TRUE;
+            }
+        }
+        if (conn->status == 0) {
+            /*
+             * In a transaction, which might be aborted, the filter is kept.
+             */
+            if (conn->txn == NULL) {
+                BloomClear(conn);
+            }
+            return NS_DML;
+        }
+
+        NS_DB_ENV_ERR(conn->env, conn->status, "DB->truncate");
+        Ns_DbSetException(handle, "ERROR", NS_DB_STRERR(conn->status));
+        return NS_ERROR;
+    }
+
+    if (strncasecmp(query, "COMPACT", 7) == 0) {
+#ifdef LMDB
+        Ns_Log(Warning, "nsdbbdb: command COMPACT is not supported,"
+               " use 'ns_berkeleydb backup handle path -compact' for a compacted copy");
+        return NS_DML;
+#else
+        DB_COMPACT c_data;
+        int        i;
+
+        if (compactInterval > 0) {
+            /*
+             * Leave it to the background compaction.
+             */
+            Ns_MutexLock(&conn->shared->compact.lock);
+            conn->shared->compact.requested = NS_TRUE;
+            Ns_MutexUnlock(&conn->shared->compact.lock);
+            return NS_DML;
+        }
+        memset(&c_data, 0, sizeof(c_data));
+        conn->status = 0;
+        for (i = 0; i < conn->shared->nShards && conn->status == 0; i++) {
+            UseShard(conn, i);
+            conn->status = conn->dbi->compact(conn->dbi, NULL, NULL, NULL, NULL, 0, NULL);
+        }
+        if (conn->status == 0) {
+            return NS_DML;
+        }
+        NS_DB_ENV_ERR(conn->env, conn->status, "DB->compact");
+        Ns_DbSetException(handle, "ERROR", NS_DB_STRERR(conn->status));
+        return NS_ERROR;
+#endif
+    }
+
+    if (strncasecmp(query, "BEGIN", 5) == 0) {
+#ifdef LMDB
+        /*
+         * The shards are separate environments, there is no transaction
+         * spanning them.
+         */
+        if (conn->shared->nShards > 1) {
+            Ns_DbSetException(handle, "ERROR", "BEGIN is not supported on sharded datasources");
+            return NS_ERROR;
+        }
+#endif
+        conn->status = 0;
+        if (conn->txn == NULL) {
+            conn->status = NS_DB_ENV_TXN_BEGIN(conn->env, &conn->txn);
+        }
+        if (conn->status == 0) {
+            return NS_DML;
+        }
+        conn->txn = NULL;
+        NS_DB_ENV_ERR(conn->env, conn->status, "NS_DB_ENV->txn_begin");
+        Ns_DbSetException(handle, "ERROR", NS_DB_STRERR(conn->status));
+        return NS_ERROR;
+    }
+
+    if (strncasecmp(query, "COMMIT", 6) == 0) {
+        conn->status = 0;
+        if (conn->txn != NULL) {
+#ifdef LMDB
+            conn->status = TtlCommit(conn, conn->txn);
+#else
+            conn->status = NS_DB_ENV_TXN_COMMIT(conn->txn);
+#endif
+        }
+        conn->txn = NULL;
+        CacheFlush(conn);
+        if (conn->status == 0) {
+            return NS_DML;
+        }
+        NS_DB_ENV_ERR(conn->env, conn->status, "NS_DB_ENV->txn_commit");
+        Ns_DbSetException(handle, "ERROR", NS_DB_STRERR(conn->status));
+        return NS_ERROR;
+    }
+
+    if (strncasecmp(query, "ABORT", 5) == 0) {
+        conn->status = 0;
+        if (conn->txn != NULL) {
+            conn->status = NS_DB_ENV_TXN_ABORT(conn->txn);
+#ifdef LMDB
+            TtlDiscard(conn);
+#endif
+        }
+        conn->txn = NULL;
+        CacheFlush(conn);
+        if (conn->status == 0) {
+            return NS_DML;
+        }
+        NS_DB_ENV_ERR(conn->env, conn->status, "NS_DB_ENV->txn_abort");
+        Ns_DbSetException(handle, "ERROR", NS_DB_STRERR(conn->status));
+        return NS_ERROR;
+    }
+
+    if (strncasecmp(query, "PUT ", 4) == 0
+        || strncasecmp(query, "PUT/", 4) == 0) {
+        unsigned int  flags = 0;
+        Tcl_WideInt   ttl = 0;
+        char         *ptr, *next;
+
+        if (query[3] == '/') {
+            ptr = ParsePutFlags(query + 3, &flags, &ttl);
+            if (ptr == NULL) {
+                Ns_DbSetException(handle, "ERROR", "invalid flags");
+                return NS_ERROR;
+            }
+            next = (*ptr != '\0') ? ptr + 1 : ptr;
+        } else {
+            next = query + 4;
+        }
+        if (ttl != 0 && CheckTtl(handle, ttl) != NS_OK) {
+            return NS_ERROR;
+        }
+        conn->cmd = DB_UPDATE;
+        if (NextKey(conn->pool, &next, next + strlen(next), &conn->key, conn->keyEnc) != NS_OK) {
+            Ns_DbSetException(handle, "ERROR", "invalid key");
+            return NS_ERROR;
+        }
+        /*
+         * The data is the remainder of the query.
+         */
+        NS_DB_VAL_DATA(conn->data) = (next != NULL) ? next : (char *)"";
+        NS_DB_VAL_SIZE(conn->data) = (next != NULL) ? NS_DB_STR_SIZE(conn, next) : 0u;
+
+        RouteKey(conn, &conn->key);
+        BloomAdd(conn, &conn->key);
+        conn->status = GetWriteTxn(conn, &tempTxn);
+        if (conn->status == 0) {
+            conn->status = DbPut(conn, tempTxn, &conn->key, &conn->data, flags, TtlExpiry(ttl));
+            conn->status = CleanTempTxn(conn, tempTxn);
+        }
+        if (conn->status == 0) {
+            CacheWrite(conn, &conn->key);
+        }
+        // Restore original delimiter
+        if (next != NULL && !conn->pool->binary) {
+            *(next - conn->pool->delimiterLength) = *conn->pool->delimiter;
+        }
+        if (conn->status == 0) {
+            return NS_DML;
+        }
+        // Report error situation
+        NS_DB_ERR0(conn->dbi, conn->status, "DB->put");
+        Ns_DbSetException(handle, "ERROR", NS_DB_STRERR(conn->status));
+        return NS_ERROR;
+    }
+
+    /*
+     * Batch updates, applied in a single transaction
+     */
+    if (strncasecmp(query, "MPUT ", 5) == 0
+        || strncasecmp(query, "MPUT/", 5) == 0) {
+        unsigned int  flags = 0;
+        Tcl_WideInt   ttl = 0;
+        const char   *list = query + 5;
+
+        if (query[4] == '/') {
+            list = ParsePutFlags(query + 4, &flags, &ttl);
+            if (list == NULL) {
+                Ns_DbSetException(handle, "ERROR", "invalid flags");
+                return NS_ERROR;
+            }
+            if (*list != '\0') {
+                list++;
+            }
+        }
+        if (ttl != 0 && CheckTtl(handle, ttl) != NS_OK) {
+            return NS_ERROR;
+        }
+        return DbExecBatch(handle, list, flags, TtlExpiry(ttl), NS_TRUE);
+    }
+
+    if (strncasecmp(query, "INCR ", 5) == 0
+        || strncasecmp(query, "DECR ", 5) == 0) {
+        return DbExecIncr(handle, query + 5, (*query == 'D' || *query == 'd'));
+    }
+
+    if (strncasecmp(query, "CAS ", 4) == 0
+        || strncasecmp(query, "CAS/", 4) == 0) {
+        return DbExecCas(handle, query);
+    }
+
+    if (strncasecmp(query, "MDEL ", 5) == 0) {
+        return DbExecBatch(handle, query + 5, 0u, 0, NS_FALSE);
+    }
+
+    if (strncasecmp(query, "DEL ", 4) == 0) {
+        conn->cmd = DB_DELETE;
+        NS_DB_VAL_DATA(conn->key) = query + 4;
+        NS_DB_VAL_SIZE(conn->key) = NS_DB_STR_SIZE(conn, NS_DB_VAL_DATA(conn->key));
+        if (EncodeKey(conn->pool, &conn->key, conn->keyEnc) != NS_OK) {
+            Ns_DbSetException(handle, "ERROR", "invalid key");
+            return NS_ERROR;
+        }
+        RouteKey(conn, &conn->key);
+        conn->status = GetWriteTxn(conn, &tempTxn);
+        if (conn->status == 0) {
+            conn->status = TtlUpdate(conn, tempTxn, &conn->key, 0);
+            if (conn->status == 0) {
+                conn->status = NS_DB_DBI_DEL(tempTxn, conn->dbi, &conn->key);
+            }
+            conn->status = CleanTempTxn(conn, tempTxn);
+        }
+        if (conn->status == 0) {
+            CacheWrite(conn, &conn->key);
+            BloomDelete(conn);
+            return NS_DML;
+        }
+        // Report error situation
+        NS_DB_ERR0(conn->dbi, conn->status, "DB->del");
+        Ns_DbSetException(handle, "ERROR", NS_DB_STRERR(conn->status));
+        return NS_ERROR;
+    }
+
+    /*
+     * Open cursor and retrieve all matching records
+     */
+    if (strncasecmp(query, "CURSOR", 6) == 0) {
+        NS_DB_VAL  start;
+        bool       hasStart = NS_FALSE;
+        char      *next = query + 6;
+
+        Ns_Log(BdbDebug, "... CURSOR");
+
+        conn->cmd = DB_SELECT;
+        conn->count = 0;
+        conn->scanFlags = 0u;
+        conn->limit = conn->skip = 0;
+        memset(&conn->bound, 0, sizeof(conn->bound));
+        if (*next == '/') {
+            next = ParseScanFlags(next, conn);
+        }
+        if (*next != '\0') {
+            next++;
+        }
+        if (*next != '\0') {
+            conn->keys = ns_strdup(next);
+            conn->keysEnd = conn->keys + strlen(conn->keys);
+            next = conn->keys;
+            if (NextField(conn->pool, &next, conn->keysEnd, &start) != NS_OK
+                || (next != NULL && NextField(conn->pool, &next, conn->keysEnd, &conn->bound) != NS_OK)) {
+                Ns_DbSetException(handle, "ERROR", "invalid length prefix of key");
+                return NS_ERROR;
+            }
+            if ((conn->scanFlags & DB_SCAN_PREFIX) != 0u) {
+                if (conn->pool->keyType != KeyString) {
+                    Ns_DbSetException(handle, "ERROR", "prefix scans need string keys");
+                    return NS_ERROR;
+                }
+                /*
+                 * The start key is the prefix, without the terminating NUL
+                 * character.
+                 */
+                conn->bound = start;
+                conn->prefixLength = NS_DB_VAL_SIZE(start) - (conn->pool->binary ? 0u : 1u);
+            } else if (NS_DB_VAL_DATA(conn->bound) != NULL) {
+                if (EncodeKey(conn->pool, &conn->bound, conn->boundEnc) != NS_OK) {
+                    Ns_DbSetException(handle, "ERROR", "invalid key");
+                    return NS_ERROR;
+                }
+                conn->scanFlags |= DB_SCAN_END;
+            }
+            /*
+             * An empty start key (e.g. with an end key) starts at the
+             * beginning (or the end in reverse order).
+             */
+            hasStart = ((conn->scanFlags & DB_SCAN_PREFIX) != 0u
+                        || NS_DB_VAL_SIZE(start) > (conn->pool->binary ? 0u : 1u));
+            if (hasStart && EncodeKey(conn->pool, &start, conn->keyEnc) != NS_OK) {
+                Ns_DbSetException(handle, "ERROR", "invalid key");
+                return NS_ERROR;
+            }
+        } else {
+            conn->scanFlags &= ~DB_SCAN_PREFIX;
+        }
+        conn->status = OpenScan(conn, hasStart ? &start : NULL);
+        while (conn->status == 0 && conn->skip > 0 && InScanRange(conn)) {
+            conn->skip--;
+            conn->status = NextScanRow(conn);
+        }
+        switch (conn->status) {
+        case 0:
+        case NS_DB_NOTFOUND:
+            handle->fetchingRows = NS_TRUE;
+            return NS_ROWS;
+        default:
+            NS_DB_ERR0(conn->dbi, conn->status, "DB->c_get");
+            Ns_DbSetException(handle, "ERROR", NS_DB_STRERR(conn->status));
+            return NS_ERROR;
+        }
+    }
+
+    return NS_ERROR;
+}
+
+/*
+ * Execute a query and record its latency.
+ */
+static int DbExec(Ns_DbHandle *handle, char *query)
+{
+    Tcl_WideInt start = LatencyNow();
+    int         rc;
+
+    LatencyBegin();
+    rc = ExecQuery(handle, query);
+    LatencyEnd(QueryOp(query), start, rc == NS_ERROR);
+    return rc;
+}
+
+/*
+ * Copy a value into the row and account the time to the row phase.
+ */
+static void SetRowValue(Ns_Set *row, TCL_SIZE_T index, const void *value, size_t size)
+{
+    Tcl_WideInt start = LatencyNow();
+
+    Ns_SetPutValueSz(row, index, value, (TCL_SIZE_T)size);
+    LatencyPhase(PhaseRow, start);
+}
+
+/*
+ * Copy a key into the row, typed keys as text.
+ */
+static void SetRowKey(Ns_Set *row, TCL_SIZE_T index, const dbPool *poolPtr, const NS_DB_VAL *keyPtr)
+{
+    NS_DB_VAL text;
+    char      buf[TCL_INTEGER_SPACE];
+
+    DecodeKey(poolPtr, keyPtr, buf, &text);
+    SetRowValue(row, index, NS_DB_VAL_DATA(text), NS_DB_VAL_SIZE(text));
+}
+
+static int FetchRow(Ns_DbHandle *handle, Ns_Set *row)
+{
+    int rc = 0;
+    dbConn *conn = handle->connection;
+
+    Ns_Log(BdbDebug, "getrow: %d: %d: %.*s %.*s",
+           conn->cmd, conn->status,
+           (int)NS_DB_VAL_SIZE(conn->key), (char *)NS_DB_VAL_DATA(conn->key),
+           (int)NS_DB_VAL_SIZE(conn->data), (char *)NS_DB_VAL_DATA(conn->data));
+
+    if (handle->fetchingRows == 0) {
+        Ns_Log(Error, "getrow nsdbbdb(%s):  No rows waiting to fetch.", handle->datasource);
+        Ns_DbSetException(handle, "NSDB", "no rows waiting to fetch.");
+        return NS_ERROR;
+    }
+
+    if (conn->status == NS_DB_NOTFOUND) {
+        Ns_Log(BdbDebug, "getrow: NS_END_DATA");
+        handle->statement = 0;
+        handle->fetchingRows = NS_FALSE;
+        return NS_END_DATA;
+    }
+
+    switch (conn->cmd) {
+    case DB_CHECK:
+        Ns_Log(BdbDebug, "getrow: CHECK");
+        // Only one record should be returned
+        conn->status = NS_DB_NOTFOUND;
+        SetRowValue(row, 0, "1", 1u);
+        return NS_OK;
+
+    case DB_GET:
+        // Only one record should be returned
+        Ns_Log(BdbDebug, "getrow: DB_GET");
+        conn->status = NS_DB_NOTFOUND;
+        SetRowValue(row, 0, NS_DB_VAL_DATA(conn->data), NS_DB_VAL_SIZE(conn->data));
+        return NS_OK;
+
+    case DB_GETALL:
+        /*
+         * On the first invocation, the first duplicate is already provided.
+         */
+        if (++conn->count > 1) {
+            conn->status = NextDup(conn, NS_FALSE);
+        }
+        switch (conn->status) {
+        case 0:
+            SetRowValue(row, 0, NS_DB_VAL_DATA(conn->data), NS_DB_VAL_SIZE(conn->data));
+            return NS_OK;
+
+        case NS_DB_NOTFOUND:
+            EndScan(handle);
+            return NS_END_DATA;
+
+        default:
+            NS_DB_ERR0(conn->dbi, conn->status, "DB->c_get");
+            Ns_DbSetException(handle, "ERROR", NS_DB_STRERR(conn->status));
+            EndScan(handle);
+            return NS_ERROR;
+        }
+
+    case DB_MGET: {
+        NS_DB_TXN *txn;
+
+        if (conn->nextKey == NULL) {
+            handle->fetchingRows = NS_FALSE;
+            return NS_END_DATA;
+        }
+        if (NextKey(conn->pool, &conn->nextKey, conn->keysEnd, &conn->key, conn->keyEnc) != NS_OK) {
+            Ns_DbSetException(handle, "ERROR", "invalid key");
+            handle->fetchingRows = NS_FALSE;
+            return NS_ERROR;
+        }
+        RouteKey(conn, &conn->key);
+        if (BloomExcludes(conn, &conn->key) || TtlExpired(conn, conn->txn, &conn->key)) {
+            rc = NS_DB_NOTFOUND;
+        } else {
+            /*
+             * The key might be on a shard without an open read
+             * transaction yet.
+             */
+            rc = GetReadTxn(conn, &txn);
+            if (rc == 0) {
+                rc = DbGetValue(conn, txn, &conn->key, &conn->data);
+            }
+        }
+        switch (rc) {
+        case 0:
+            SetRowKey(row, 0, conn->pool, &conn->key);
+            SetRowValue(row, 1, NS_DB_VAL_DATA(conn->data), NS_DB_VAL_SIZE(conn->data));
+            DbFree(handle);
+            return NS_OK;
+
+        case NS_DB_NOTFOUND:
+            /*
+             * Missing keys are reported with empty data.
+             */
+            SetRowKey(row, 0, conn->pool, &conn->key);
+            SetRowValue(row, 1, "", 0u);
+            DbFree(handle);
+            return NS_OK;
+
+        default:
+            NS_DB_ERR0(conn->dbi, rc, "DB->get");
+            Ns_DbSetException(handle, "ERROR", NS_DB_STRERR(rc));
+            handle->fetchingRows = NS_FALSE;
+            return NS_ERROR;
+        }
+    }
+
+    case DB_SELECT:
+        /*
+         * On the first invocation, data is already provided.
+         * For later calls, we have to get the next item.
+         */
+        conn->count ++;
+        Ns_Log(BdbDebug, "getrow: DB_SELECT data %p cursor %p txn %p count: %d",
+               (void*)NS_DB_VAL_DATA(conn->data),
+               (void*)conn->cursor,
+               (void*)conn->txn,
+               conn->count
+               );
+        if (conn->limit > 0 && conn->count > conn->limit) {
+            conn->status = NS_DB_NOTFOUND;
+        } else if (conn->count > 1) {
+            conn->status = NextScanRow(conn);
+        }
+        if (conn->status == 0 && !InScanRange(conn)) {
+            conn->status = NS_DB_NOTFOUND;
+        }
+        Ns_Log(BdbDebug, "getrow: status %d %s", conn->status, NS_DB_STRERR(conn->status));
+
+        switch (conn->status) {
+        case 0:
+            Ns_Log(BdbDebug, "getrow: set data key <%.*s> data <%.*s>",
+                   (int)NS_DB_VAL_SIZE(conn->key), (char*)NS_DB_VAL_DATA(conn->key),
+                   (int)NS_DB_VAL_SIZE(conn->data), (char*)NS_DB_VAL_DATA(conn->data));
+            SetRowKey(row, 0, conn->pool, &conn->key);
+            SetRowValue(row, 1, NS_DB_VAL_DATA(conn->data), NS_DB_VAL_SIZE(conn->data));
+            return NS_OK;
+
+        case NS_DB_NOTFOUND:
+            EndScan(handle);
+            return NS_END_DATA;
+
+        default:
+            NS_DB_ERR0(conn->dbi, conn->status, "DB->c_get");
+            Ns_DbSetException(handle, "ERROR", NS_DB_STRERR(conn->status));
+            EndScan(handle);
+            return NS_ERROR;
+        }
+        break;
+    }
+    return NS_ERROR;
+}
+
+/*
+ * Fetch the next row and record the latency as GETROW.
+ */
+static int DbGetRow(Ns_DbHandle *handle, Ns_Set *row)
+{
+    Tcl_WideInt start = LatencyNow();
+    int         rc;
+
+    LatencyBegin();
+    rc = FetchRow(handle, row);
+    LatencyEnd(OpGetrow, start, rc == NS_ERROR);
+    return rc;
+}
+
+static int DbFlush(Ns_DbHandle *handle)
+{
+    const dbConn *conn = handle->connection;
+
+    DbCancel(handle);
+#ifndef LMDB
+    if (conn->pool->sync) {
+        int i;
+
+        for (i = 0; i < conn->shared->nShards; i++) {
+            conn->shared->dbis[i]->sync(conn->shared->dbis[i], 0);
+        }
+    }
+#else
+    (void)conn;
+#endif
+    return NS_OK;
+}
+
+#ifndef LMDB
+static void DbError(const NS_DB_ENV *UNUSED(env), const char *errpfx, const char *msg)
+{
+    Ns_Log(Error, "nsdbbdb: %s: %s", errpfx, msg);
+}
+#endif
+
+static void DbFreeVals(dbConn *conn)
+{
+#ifdef LMDB
+    NS_DB_VAL_FLAGS(conn->key) = 0u;
+    NS_DB_VAL_FLAGS(conn->data) = 0u;
+#else
+    /*
+     * Retrieved values live in the buffers of the connection, which are
+     * kept for reuse until the handle is closed.
+     */
+    memset(&conn->key, 0, sizeof(NS_DB_VAL));
+    memset(&conn->data, 0, sizeof(NS_DB_VAL));
+    conn->bulkPtr = NULL;
+    conn->bulkActive = NS_FALSE;
+#endif
+}
+
+static int DbFree(Ns_DbHandle *handle)
+{
+    DbFreeVals(handle->connection);
+    return NS_OK;
+}
+
+static int DbCancel(Ns_DbHandle *handle)
+{
+    dbConn *conn = handle->connection;
+
+    CloseCursors(conn);
+    ReleaseReadTxn(conn);
+    DbFree(handle);
+    if (conn->keys != NULL) {
+        ns_free(conn->keys);
+        conn->keys = conn->keysEnd = conn->nextKey = NULL;
+    }
+    handle->statement = NULL;
+    handle->fetchingRows = NS_FALSE;
+    return NS_OK;
+}
+
+/*
+ * DbCancel() is called before every statement and on flush, so it keeps an
+ * explicit transaction open. A transaction left open when the handle is
+ * returned to the pool is aborted here.
+ */
+static int DbResetHandle(Ns_DbHandle *handle)
+{
+    DbCancel(handle);
+    AbortTxn(handle->connection);
+    return NS_OK;
+}
+
+static Ns_Set *DbBindRow(Ns_DbHandle *handle)
+{
+    const dbConn *conn = handle->connection;
+
+    switch (conn->cmd) {
+    case DB_GET:
+    case DB_GETALL:
+        Ns_SetPutSz(handle->row, "data", 4, NULL, 0);
+        break;
+    default:
+        Ns_SetPutSz(handle->row, "key", 3, NULL, 0);
+        Ns_SetPutSz(handle->row, "data", 4, NULL, 0);
+    }
+    return handle->row;
+}
+
+/*
+ * Conversion between Tcl_Obj and database values for the native
+ * subcommands of "ns_berkeleydb". Values are stored like in the query
+ * interface, i.e. with a terminating NUL character. In binary mode, values
+ * are byte arrays stored with their exact length.
+ */
+static void ObjToVal(const dbPool *poolPtr, Tcl_Obj *objPtr, NS_DB_VAL *valPtr)
+{
+    TCL_SIZE_T length;
+
+    if (poolPtr->binary) {
+        NS_DB_VAL_DATA(*valPtr) = (void *)Tcl_GetByteArrayFromObj(objPtr, &length);
+        NS_DB_VAL_SIZE(*valPtr) = (NS_DB_SIZE_T)length;
+    } else {
+        NS_DB_VAL_DATA(*valPtr) = Tcl_GetStringFromObj(objPtr, &length);
+        NS_DB_VAL_SIZE(*valPtr) = (NS_DB_SIZE_T)length + 1;
+    }
+}
+
+/*
+ * Convert a key, typed keys into their stored form in buf.
+ */
+static int ObjToKey(const dbPool *poolPtr, Tcl_Obj *objPtr, NS_DB_VAL *keyPtr, unsigned char *buf)
+{
+    ObjToVal(poolPtr, objPtr, keyPtr);
+    return EncodeKey(poolPtr, keyPtr, buf);
+}
+
+static Tcl_Obj *ValToObj(const dbPool *poolPtr, const NS_DB_VAL *valPtr)
+{
+    const char *bytes = NS_DB_VAL_DATA(*valPtr);
+    TCL_SIZE_T  length = (TCL_SIZE_T)NS_DB_VAL_SIZE(*valPtr);
+
+    if (poolPtr->binary) {
+        return Tcl_NewByteArrayObj((const unsigned char *)bytes, length);
+    }
+    if (length > 0 && bytes[length - 1] == '\0') {
+        length--;
+    }
+    return Tcl_NewStringObj(bytes, length);
+}
+
+/*
+ * Add a value to a dictionary of statistics. Values of several shards are
+ * summed up, or with sum false, the maximum is taken.
+ */
+static void PutStat(Tcl_Obj *dictObj, const char *name, Tcl_WideInt value, bool sum)
+{
+    Tcl_Obj     *keyObj = Tcl_NewStringObj(name, TCL_INDEX_NONE), *valueObj = NULL;
+    Tcl_WideInt  old;
+
+    Tcl_IncrRefCount(keyObj);
+    if (Tcl_DictObjGet(NULL, dictObj, keyObj, &valueObj) == TCL_OK
+        && valueObj != NULL
+        && Tcl_GetWideIntFromObj(NULL, valueObj, &old) == TCL_OK) {
+        value = sum ? old + value : (old > value ? old : value);
+    }
+    Tcl_DictObjPut(NULL, dictObj, keyObj, Tcl_NewWideIntObj(value));
+    Tcl_DecrRefCount(keyObj);
+}
+
+static void CacheStats(dbCache *cachePtr, Tcl_Obj *dictObj)
+{
+    Tcl_WideInt hits = 0, misses = 0, evictions = 0, entries = 0, bytes = 0;
+    int         i;
+
+    for (i = 0; i < CACHE_STRIPES; i++) {
+        dbCacheStripe *stripePtr = &cachePtr->stripes[i];
+
+        Ns_MutexLock(&stripePtr->lock);
+        hits += stripePtr->hits;
+        misses += stripePtr->misses;
+        evictions += stripePtr->evictions;
+        entries += (Tcl_WideInt)stripePtr->nEntries;
+        bytes += (Tcl_WideInt)stripePtr->bytes;
+        Ns_MutexUnlock(&stripePtr->lock);
+    }
+    PutStat(dictObj, "keycache_hits", hits, NS_FALSE);
+    PutStat(dictObj, "keycache_misses", misses, NS_FALSE);
+    PutStat(dictObj, "keycache_evictions", evictions, NS_FALSE);
+    PutStat(dictObj, "keycache_entries", entries, NS_FALSE);
+    PutStat(dictObj, "keycache_bytes", bytes, NS_FALSE);
+}
+
+static void BloomStats(dbBloom *bloomPtr, Tcl_Obj *dictObj)
+{
+    Ns_MutexLock(&bloomPtr->lock);
+    PutStat(dictObj, "bloom_bits", (Tcl_WideInt)bloomPtr->nBits, NS_FALSE);
+    PutStat(dictObj, "bloom_hashes", (Tcl_WideInt)bloomPtr->nHashes, NS_FALSE);
+    PutStat(dictObj, "bloom_negatives", bloomPtr->negatives, NS_FALSE);
+    PutStat(dictObj, "bloom_adds", bloomPtr->adds, NS_FALSE);
+    PutStat(dictObj, "bloom_deletes", bloomPtr->deletes, NS_FALSE);
+    PutStat(dictObj, "bloom_building", bloomPtr->running, NS_FALSE);
+    Ns_MutexUnlock(&bloomPtr->lock);
+}
+
+#ifndef LMDB
+/*
+ * Fraction of the database file which is free: pages on the free list and
+ * unused bytes in the pages. Traverses the database.
+ */
+static int CompactFreeRatio(DB *dbi, double *ratioPtr)
+{
+    DBTYPE type;
+    void  *sp;
+    double free = 0.0, total = 0.0;
+    int    rc;
+
+    rc = dbi->get_type(dbi, &type);
+    if (rc == 0) {
+        rc = dbi->stat(dbi, NULL, &sp, 0u);
+    }
+    if (rc != 0) {
+        return rc;
+    }
+    if (type == DB_HASH) {
+        const DB_HASH_STAT *hs = sp;
+
+        free = (double)hs->hash_free * hs->hash_pagesize + (double)hs->hash_bfree;
+        total = (double)hs->hash_pagecnt * hs->hash_pagesize;
+    } else {
+        const DB_BTREE_STAT *bs = sp;
+
+        free = (double)bs->bt_free * bs->bt_pagesize + (double)bs->bt_int_pgfree + (double)bs->bt_leaf_pgfree;
+        total = (double)bs->bt_pagecnt * bs->bt_pagesize;
+    }
+    ns_free(sp);
+    *ratioPtr = (total > 0.0) ? free / total : 0.0;
+    return 0;
+}
+
+/*
+ * Compact the next slice of a pass: at most compactPages pages of the
+ * current shard are freed, starting at the key where the previous slice
+ * stopped. DB_FREE_SPACE returns free pages at the end of the file to the
+ * filesystem.
+ */
+static int CompactSlice(dbShared *sharedPtr)
+{
+    dbCompact  *compactPtr = &sharedPtr->compact;
+    DB         *dbi = sharedPtr->dbis[compactPtr->shard];
+    DB_COMPACT  c_data;
+    DBT         start, end;
+    int         rc;
+
+    memset(&c_data, 0, sizeof(c_data));
+    memset(&start, 0, sizeof(start));
+    memset(&end, 0, sizeof(end));
+    c_data.compact_pages = (u_int32_t)compactPages;
+    c_data.compact_timeout = (u_int32_t)compactTimeout * 1000u;
+    start.data = compactPtr->start.string;
+    start.size = (u_int32_t)compactPtr->start.length;
+    end.flags = DB_DBT_MALLOC;
+
+    rc = dbi->compact(dbi, NULL, start.size > 0u ? &start : NULL, NULL, &c_data, DB_FREE_SPACE, &end);
+    if (rc == 0) {
+        Ns_MutexLock(&compactPtr->lock);
+        compactPtr->slices++;
+        compactPtr->pagesFreed += c_data.compact_pages_free;
+        compactPtr->pagesExamined += c_data.compact_pages_examine;
+        compactPtr->pagesTruncated += c_data.compact_pages_truncated;
+        Ns_MutexUnlock(&compactPtr->lock);
+        Tcl_DStringSetLength(&compactPtr->start, 0);
+        if (end.size == 0u || c_data.compact_pages_free < (u_int32_t)compactPages) {
+            /*
+             * The end of the shard was reached.
+             */
+            compactPtr->shard++;
+        } else {
+            Tcl_DStringAppend(&compactPtr->start, end.data, (TCL_SIZE_T)end.size);
+        }
+    }
+    if (end.data != NULL) {
+        ns_free(end.data);
+    }
+    return rc;
+}
+
+/*
+ * Scheduled procedure compacting the opened databases in small slices.
+ * A pass over all shards of a datasource is started by COMPACT, every
+ * compactcheck seconds, or with compactfree, when the free fraction of
+ * one of its shards exceeds compactfree at the check.
+ */
+static void DbCompactSlices(void *UNUSED(arg), int UNUSED(id))
+{
+    Tcl_HashEntry *hPtr;
+    Tcl_HashSearch search;
+    dbShared     **shareds;
+    int            i, n = 0;
+    time_t         now = time(NULL);
+
+    Ns_MutexLock(&dbLock);
+    shareds = ns_malloc(sizeof(dbShared *) * ((size_t)dbTable.numEntries + 1u));
+    for (hPtr = Tcl_FirstHashEntry(&dbTable, &search); hPtr != NULL; hPtr = Tcl_NextHashEntry(&search)) {
+        dbShared *sharedPtr = Tcl_GetHashValue(hPtr);
+
+        sharedPtr->refCount++;
+        shareds[n++] = sharedPtr;
+    }
+    Ns_MutexUnlock(&dbLock);
+
+    for (i = 0; i < n; i++) {
+        dbShared   *sharedPtr = shareds[i];
+        dbCompact  *compactPtr = &sharedPtr->compact;
+        double      threshold = sharedPtr->pool->compactFree;
+        bool        check, start, running;
+        int         rc = 0;
+
+        /*
+         * The free fraction is determined and the slices are compacted
+         * without the lock, only the scheduler thread starts and ends
+         * passes.
+         */
+        Ns_MutexLock(&compactPtr->lock);
+        running = compactPtr->running;
+        check = !running && (compactPtr->requested || now - compactPtr->checked >= compactCheck);
+        start = compactPtr->requested || threshold <= 0.0;
+        if (check) {
+            compactPtr->checked = now;
+        }
+        Ns_MutexUnlock(&compactPtr->lock);
+
+        if (check) {
+            int j;
+
+            for (j = 0; j < sharedPtr->nShards && !start && rc == 0; j++) {
+                double ratio;
+
+                rc = CompactFreeRatio(sharedPtr->dbis[j], &ratio);
+                if (rc == 0) {
+                    Ns_MutexLock(&compactPtr->lock);
+                    compactPtr->freeRatio = ratio;
+                    Ns_MutexUnlock(&compactPtr->lock);
+                    start = (ratio >= threshold);
+                }
+            }
+            if (start) {
+                Ns_MutexLock(&compactPtr->lock);
+                compactPtr->requested = NS_FALSE;
+                compactPtr->running = NS_TRUE;
+                Ns_MutexUnlock(&compactPtr->lock);
+                compactPtr->shard = 0;
+                Tcl_DStringSetLength(&compactPtr->start, 0);
+                running = NS_TRUE;
+                Ns_Log(Notice, "nsdbbdb: compacting %s", (char *)Tcl_GetHashKey(&dbTable, sharedPtr->hPtr));
+            }
+        }
+        if (running && rc == 0) {
+            rc = CompactSlice(sharedPtr);
+            if (rc != 0 || compactPtr->shard == sharedPtr->nShards) {
+                Tcl_WideInt freed, truncated;
+
+                Ns_MutexLock(&compactPtr->lock);
+                compactPtr->running = NS_FALSE;
+                compactPtr->passes++;
+                freed = compactPtr->pagesFreed;
+                truncated = compactPtr->pagesTruncated;
+                Ns_MutexUnlock(&compactPtr->lock);
+                Ns_Log(Notice, "nsdbbdb: compacted %s: %" TCL_LL_MODIFIER "d pages freed, %"
+                       TCL_LL_MODIFIER "d pages returned to the filesystem",
+                       (char *)Tcl_GetHashKey(&dbTable, sharedPtr->hPtr), freed, truncated);
+            }
+        }
+        if (rc != 0) {
+            Ns_Log(Warning, "nsdbbdb: compacting %s: %s",
+                   (char *)Tcl_GetHashKey(&dbTable, sharedPtr->hPtr), NS_DB_STRERR(rc));
+        }
+    }
+
+    Ns_MutexLock(&dbLock);
+    for (i = 0; i < n; i++) {
+        if (--shareds[i]->refCount == 0) {
+            Tcl_DeleteHashEntry(shareds[i]->hPtr);
+            CloseShared(shareds[i]);
+        }
+    }
+    Ns_MutexUnlock(&dbLock);
+    ns_free(shareds);
+}
+
+static void CompactStats(dbCompact *compactPtr, Tcl_Obj *dictObj)
+{
+    Ns_MutexLock(&compactPtr->lock);
+    PutStat(dictObj, "compact_running", compactPtr->running, NS_FALSE);
+    PutStat(dictObj, "compact_passes", compactPtr->passes, NS_FALSE);
+    PutStat(dictObj, "compact_slices", compactPtr->slices, NS_FALSE);
+    PutStat(dictObj, "compact_pages_freed", compactPtr->pagesFreed, NS_FALSE);
+    PutStat(dictObj, "compact_pages_examined", compactPtr->pagesExamined, NS_FALSE);
+    PutStat(dictObj, "compact_pages_truncated", compactPtr->pagesTruncated, NS_FALSE);
+    PutStat(dictObj, "compact_free_percent", (Tcl_WideInt)(compactPtr->freeRatio * 100.0 + 0.5), NS_FALSE);
+    Ns_MutexUnlock(&compactPtr->lock);
+}
+#endif
+
+/*
+ * Collect the statistics of a database (all of its shards) and its
+ * environment into a dictionary. With fast, Berkeley DB does not traverse
+ * the database and might return the last saved number of keys.
+ */
+static int DbStats(dbShared *sharedPtr, Tcl_Obj *dictObj, bool fast)
+{
+    int i, rc = 0;
+
+    PutStat(dictObj, "shards", (Tcl_WideInt)sharedPtr->nShards, NS_FALSE);
+    for (i = 0; i < sharedPtr->nShards && rc == 0; i++) {
+#ifdef LMDB
+        NS_DB_TXN   *txn;
+        MDB_stat     st;
+        MDB_envinfo  info;
+
+        rc = mdb_env_info(sharedPtr->envs[i], &info);
+        if (rc == 0) {
+            rc = mdb_env_stat(sharedPtr->envs[i], &st);
+        }
+        if (rc == 0) {
+            PutStat(dictObj, "map_size", (Tcl_WideInt)info.me_mapsize, NS_TRUE);
+            PutStat(dictObj, "map_used", (Tcl_WideInt)((info.me_last_pgno + 1u) * st.ms_psize), NS_TRUE);
+            PutStat(dictObj, "last_txnid", (Tcl_WideInt)info.me_last_txnid, NS_FALSE);
+            PutStat(dictObj, "max_readers", (Tcl_WideInt)info.me_maxreaders, NS_TRUE);
+            PutStat(dictObj, "readers", (Tcl_WideInt)info.me_numreaders, NS_TRUE);
+            rc = mdb_txn_begin(sharedPtr->envs[i], NULL, MDB_RDONLY, &txn);
+        }
+        if (rc == 0) {
+            rc = mdb_stat(txn, sharedPtr->dbis[i], &st);
+            mdb_txn_abort(txn);
+        }
+        if (rc == 0 && !fast) {
+            Tcl_WideInt freePages;
+
+            rc = FreePages(sharedPtr->envs[i], &freePages);
+            if (rc == 0) {
+                PutStat(dictObj, "free_pages", freePages, NS_TRUE);
+            }
+        }
+        if (rc == 0) {
+            PutStat(dictObj, "keys", (Tcl_WideInt)st.ms_entries, NS_TRUE);
+            PutStat(dictObj, "pagesize", (Tcl_WideInt)st.ms_psize, NS_FALSE);
+            PutStat(dictObj, "depth", (Tcl_WideInt)st.ms_depth, NS_FALSE);
+            PutStat(dictObj, "branch_pages", (Tcl_WideInt)st.ms_branch_pages, NS_TRUE);
+            PutStat(dictObj, "leaf_pages", (Tcl_WideInt)st.ms_leaf_pages, NS_TRUE);
+            PutStat(dictObj, "overflow_pages", (Tcl_WideInt)st.ms_overflow_pages, NS_TRUE);
+        }
+#else
+        DB     *dbi = sharedPtr->dbis[i];
+        DBTYPE  type;
+        void   *sp;
+
+        rc = dbi->get_type(dbi, &type);
+        if (rc == 0) {
+            rc = dbi->stat(dbi, NULL, &sp, fast ? DB_FAST_STAT : 0u);
+        }
+        if (rc != 0) {
+            break;
+        }
+        if (type == DB_HASH) {
+            const DB_HASH_STAT *hs = sp;
+
+            PutStat(dictObj, "keys", (Tcl_WideInt)hs->hash_nkeys, NS_TRUE);
+            PutStat(dictObj, "data", (Tcl_WideInt)hs->hash_ndata, NS_TRUE);
+            PutStat(dictObj, "pages", (Tcl_WideInt)hs->hash_pagecnt, NS_TRUE);
+            PutStat(dictObj, "pagesize", (Tcl_WideInt)hs->hash_pagesize, NS_FALSE);
+            PutStat(dictObj, "buckets", (Tcl_WideInt)hs->hash_buckets, NS_TRUE);
+            if (!fast) {
+                PutStat(dictObj, "free_pages", (Tcl_WideInt)hs->hash_free, NS_TRUE);
+            }
+        } else {
+            const DB_BTREE_STAT *bs = sp;
+
+            PutStat(dictObj, "keys", (Tcl_WideInt)bs->bt_nkeys, NS_TRUE);
+            PutStat(dictObj, "data", (Tcl_WideInt)bs->bt_ndata, NS_TRUE);
+            PutStat(dictObj, "pages", (Tcl_WideInt)bs->bt_pagecnt, NS_TRUE);
+            PutStat(dictObj, "pagesize", (Tcl_WideInt)bs->bt_pagesize, NS_FALSE);
+            PutStat(dictObj, "depth", (Tcl_WideInt)bs->bt_levels, NS_FALSE);
+            PutStat(dictObj, "leaf_pages", (Tcl_WideInt)bs->bt_leaf_pg, NS_TRUE);
+            PutStat(dictObj, "overflow_pages", (Tcl_WideInt)bs->bt_over_pg, NS_TRUE);
+            if (!fast) {
+                PutStat(dictObj, "free_pages", (Tcl_WideInt)bs->bt_free, NS_TRUE);
+            }
+        }
+        ns_free(sp);
+#endif
+    }
+#ifndef LMDB
+    /*
+     * All shards share the environment of the pool.
+     */
+    if (rc == 0) {
+        DB_ENV        *env = sharedPtr->envs[0];
+        unsigned int   envFlags = sharedPtr->pool->envPtr->envFlags;
+        DB_MPOOL_STAT *mp;
+
+        rc = env->memp_stat(env, &mp, NULL, 0u);
+        if (rc == 0) {
+            PutStat(dictObj, "cache_size", (Tcl_WideInt)mp->st_gbytes * 1073741824 + (Tcl_WideInt)mp->st_bytes, NS_FALSE);
+            PutStat(dictObj, "cache_hits", (Tcl_WideInt)mp->st_cache_hit, NS_FALSE);
+            PutStat(dictObj, "cache_misses", (Tcl_WideInt)mp->st_cache_miss, NS_FALSE);
+            PutStat(dictObj, "cache_pages", (Tcl_WideInt)mp->st_pages, NS_FALSE);
+            PutStat(dictObj, "cache_dirty", (Tcl_WideInt)mp->st_page_dirty, NS_FALSE);
+            PutStat(dictObj, "evictions", (Tcl_WideInt)(mp->st_ro_evict + mp->st_rw_evict), NS_FALSE);
+            ns_free(mp);
+        }
+        if (rc == 0 && (envFlags & DB_INIT_LOCK) != 0u) {
+            DB_LOCK_STAT *ls;
+
+            rc = env->lock_stat(env, &ls, 0u);
+            if (rc == 0) {
+                PutStat(dictObj, "locks", (Tcl_WideInt)ls->st_nlocks, NS_FALSE);
+                PutStat(dictObj, "max_locks", (Tcl_WideInt)ls->st_maxnlocks, NS_FALSE);
+                PutStat(dictObj, "lock_waits", (Tcl_WideInt)ls->st_lock_wait, NS_FALSE);
+                PutStat(dictObj, "lock_nowaits", (Tcl_WideInt)ls->st_lock_nowait, NS_FALSE);
+                PutStat(dictObj, "deadlocks", (Tcl_WideInt)ls->st_ndeadlocks, NS_FALSE);
+                ns_free(ls);
+            }
+        }
+        if (rc == 0 && (envFlags & DB_INIT_LOG) != 0u) {
+            DB_LOG_STAT *lg;
+
+            rc = env->log_stat(env, &lg, 0u);
+            if (rc == 0) {
+                PutStat(dictObj, "log_bytes", (Tcl_WideInt)lg->st_w_mbytes * 1048576 + (Tcl_WideInt)lg->st_w_bytes, NS_FALSE);
+                PutStat(dictObj, "log_writes", (Tcl_WideInt)lg->st_wcount, NS_FALSE);
+                PutStat(dictObj, "log_syncs", (Tcl_WideInt)lg->st_scount, NS_FALSE);
+                ns_free(lg);
+            }
+        }
+    }
+#endif
+    if (sharedPtr->cache != NULL) {
+        CacheStats(sharedPtr->cache, dictObj);
+    }
+    if (sharedPtr->bloom != NULL) {
+        BloomStats(sharedPtr->bloom, dictObj);
+    }
+    if (sharedPtr->ttlEnv != NULL) {
+        PutStat(dictObj, "ttl_reaped", sharedPtr->ttlReaped, NS_FALSE);
+    }
+#ifndef LMDB
+    if (compactInterval > 0) {
+        CompactStats(&sharedPtr->compact, dictObj);
+    }
+#endif
+    return rc;
+}
+
+/*
+ * Scheduled procedure writing the statistics of all opened databases to
+ * the log.
+ */
+static void DbSampleStats(void *UNUSED(arg), int UNUSED(id))
+{
+    Tcl_HashEntry *hPtr;
+    Tcl_HashSearch search;
+    dbShared     **shareds;
+    int            i, n = 0;
+
+    /*
+     * The statistics are read outside of dbLock, the datasources are kept
+     * open during the run as in DbReapExpired().
+     */
+    Ns_MutexLock(&dbLock);
+    shareds = ns_malloc(sizeof(dbShared *) * ((size_t)dbTable.numEntries + 1u));
+    for (hPtr = Tcl_FirstHashEntry(&dbTable, &search); hPtr != NULL; hPtr = Tcl_NextHashEntry(&search)) {
+        dbShared *sharedPtr = Tcl_GetHashValue(hPtr);
+
+        sharedPtr->refCount++;
+        shareds[n++] = sharedPtr;
+    }
+    Ns_MutexUnlock(&dbLock);
+
+    for (i = 0; i < n; i++) {
+        const char *name = Tcl_GetHashKey(&dbTable, shareds[i]->hPtr);
+        Tcl_Obj    *dictObj = Tcl_NewDictObj();
+        int         rc;
+
+        Tcl_IncrRefCount(dictObj);
+        rc = DbStats(shareds[i], dictObj, NS_TRUE);
+        if (rc == 0) {
+            Ns_Log(Notice, "nsdbbdb: stats %s: %s", name, Tcl_GetString(dictObj));
+        } else {
+            Ns_Log(Warning, "nsdbbdb: stats %s: %s", name, NS_DB_STRERR(rc));
+        }
+        Tcl_DecrRefCount(dictObj);
+    }
+
+    Ns_MutexLock(&dbLock);
+    for (i = 0; i < n; i++) {
+        if (--shareds[i]->refCount == 0) {
+            Tcl_DeleteHashEntry(shareds[i]->hPtr);
+            CloseShared(shareds[i]);
+        }
+    }
+    Ns_MutexUnlock(&dbLock);
+    ns_free(shareds);
+}
+
+/*
+ * Online backup of a datasource (ns_berkeleydb backup), running in a
+ * thread of its own. In LMDB, every environment of the datasource (its
+ * shards and its expiry index) is copied with mdb_env_copy2() in a
+ * read-only transaction, so writers are not blocked. In Berkeley DB, the
+ * environment of the pool is copied with DB_ENV->backup(), or for older
+ * versions the database files and then the log files are copied, as for
+ * a hot backup with db_archive.
+ */
+typedef struct _dbBackup {
+    Ns_Mutex lock;
+    dbShared *shared;
+    char *path;                 /* target directory */
+    bool compact;               /* LMDB: omit free pages, renumber pages */
+    bool running;               /* the thread holds a reference to the datasource */
+    int done;                   /* number of copies finished */
+    int total;                  /* number of copies */
+    Tcl_WideInt bytes;          /* bytes copied */
+    time_t started;
+    time_t finished;
+    int status;                 /* result of the last backup */
+} dbBackup;
+
+static Ns_ThreadProc BackupThread;
+
+static void BackupProgress(dbBackup *backupPtr, Tcl_WideInt bytes)
+{
+    Ns_MutexLock(&backupPtr->lock);
+    backupPtr->done++;
+    backupPtr->bytes += bytes;
+    Ns_MutexUnlock(&backupPtr->lock);
+}
+
+#ifndef LMDB
+/*
+ * Berkeley DB writes the backup into an existing directory and would mix
+ * it with files found there, so only a missing or empty one is accepted.
+ */
+static bool BackupPathEmpty(const char *path)
+{
+    DIR                 *dir = opendir(path);
+    const struct dirent *entry;
+    bool                 empty = NS_TRUE;
+
+    if (dir == NULL) {
+        return (errno == ENOENT);
+    }
+    while (empty && (entry = readdir(dir)) != NULL) {
+        empty = (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0);
+    }
+    closedir(dir);
+    return empty;
+}
+#endif
+
+#ifdef LMDB
+/*
+ * Copy an environment into the directory path, which is created. Returns
+ * the size of the copy in bytes in *bytesPtr.
+ */
+static int BackupEnv(NS_DB_ENV *env, const char *path, bool compact, Tcl_WideInt *bytesPtr)
+{
+    Tcl_DString ds;
+    struct stat st;
+    int         rc;
+
+    if (mkdir(path, 0777) != 0 && errno != EEXIST) {
+        return errno;
+    }
+    rc = mdb_env_copy2(env, path, compact ? MDB_CP_COMPACT : 0u);
+    if (rc == 0) {
+        Tcl_DStringInit(&ds);
+        Ns_DStringPrintf(&ds, "%s/data.mdb", path);
+        *bytesPtr = (stat(ds.string, &st) == 0) ? (Tcl_WideInt)st.st_size : 0;
+        Tcl_DStringFree(&ds);
+    }
+    return rc;
+}
+
+/*
+ * Target of an environment other than the one of the pool: a directory
+ * with the same name below the backup directory.
+ */
+static void BackupEnvPath(NS_DB_ENV *env, const char *path, Tcl_DString *dsPtr)
+{
+    const char *home = NULL, *name;
+
+    (void) mdb_env_get_path(env, &home);
+    name = (home != NULL) ? strrchr(home, '/') : NULL;
+    Ns_DStringPrintf(dsPtr, "%s/%s", path, (name != NULL) ? name + 1 : home);
+}
+
+static int BackupRun(dbBackup *backupPtr)
+{
+    const dbShared *sharedPtr = backupPtr->shared;
+    Tcl_DString     ds;
+    Tcl_WideInt     bytes = 0;
+    int             i, rc = 0;
+
+    Tcl_DStringInit(&ds);
+    for (i = 0; i < sharedPtr->nShards && rc == 0; i++) {
+        Tcl_DStringSetLength(&ds, 0);
+        if (sharedPtr->nShards == 1) {
+            Tcl_DStringAppend(&ds, backupPtr->path, TCL_INDEX_NONE);
+        } else {
+            BackupEnvPath(sharedPtr->envs[i], backupPtr->path, &ds);
+        }
+        rc = BackupEnv(sharedPtr->envs[i], ds.string, backupPtr->compact, &bytes);
+        if (rc == 0) {
+            BackupProgress(backupPtr, bytes);
+        }
+    }
+    if (rc == 0 && sharedPtr->ttlEnv != NULL) {
+        Tcl_DStringSetLength(&ds, 0);
+        BackupEnvPath(sharedPtr->ttlEnv, backupPtr->path, &ds);
+        rc = BackupEnv(sharedPtr->ttlEnv, ds.string, backupPtr->compact, &bytes);
+        if (rc == 0) {
+            BackupProgress(backupPtr, bytes);
+        }
+    }
+    Tcl_DStringFree(&ds);
+    return rc;
+}
+
+static int BackupTotal(const dbShared *sharedPtr)
+{
+    return sharedPtr->nShards + (sharedPtr->ttlEnv != NULL ? 1 : 0);
+}
+
+#elif DB_VERSION_MAJOR > 5 || (DB_VERSION_MAJOR == 5 && DB_VERSION_MINOR >= 3)
+
+static int BackupRun(dbBackup *backupPtr)
+{
+    NS_DB_ENV *env = backupPtr->shared->pool->env;
+    int        rc;
+
+    if (!BackupPathEmpty(backupPtr->path)) {
+        return EEXIST;
+    }
+    rc = env->backup(env, backupPtr->path, DB_CREATE);
+    if (rc == 0) {
+        BackupProgress(backupPtr, 0);
+    }
+    return rc;
+}
+
+static int BackupTotal(const dbShared *UNUSED(sharedPtr))
+{
+    return 1;
+}
+
+#else
+
+/*
+ * Copy a file into the directory path.
+ */
+static int BackupFile(const char *file, const char *path, Tcl_WideInt *bytesPtr)
+{
+    Tcl_DString ds;
+    FILE       *in, *out;
+    const char *name = strrchr(file, '/');
+    char        buf[16384];
+    size_t      n;
+    int         rc = 0;
+
+    *bytesPtr = 0;
+    Tcl_DStringInit(&ds);
+    Ns_DStringPrintf(&ds, "%s/%s", path, (name != NULL) ? name + 1 : file);
+    in = fopen(file, "rb");
+    out = (in != NULL) ? fopen(ds.string, "wb") : NULL;
+    if (out == NULL) {
+        rc = errno;
+    } else {
+        while ((n = fread(buf, 1u, sizeof(buf), in)) > 0u) {
+            if (fwrite(buf, 1u, n, out) != n) {
+                rc = errno;
+                break;
+            }
+            *bytesPtr += (Tcl_WideInt)n;
+        }
+        if (rc == 0 && ferror(in)) {
+            rc = EIO;
+        }
+        if (fclose(out) != 0 && rc == 0) {
+            rc = errno;
+        }
+    }
+    if (in != NULL) {
+        fclose(in);
+    }
+    Tcl_DStringFree(&ds);
+    return rc;
+}
+
+/*
+ * Copy the files returned by DB_ENV->log_archive() with the given flags.
+ */
+static int BackupFiles(dbBackup *backupPtr, u_int32_t flags)
+{
+    NS_DB_ENV   *env = backupPtr->shared->pool->env;
+    char       **files = NULL, **filePtr;
+    Tcl_WideInt  bytes;
+    int          rc;
+
+    rc = env->log_archive(env, &files, flags | DB_ARCH_ABS);
+    if (rc == 0 && files != NULL) {
+        for (filePtr = files; *filePtr != NULL && rc == 0; filePtr++) {
+            rc = BackupFile(*filePtr, backupPtr->path, &bytes);
+            if (rc == 0) {
+                BackupProgress(backupPtr, bytes);
+            }
+        }
+        ns_free(files);
+    }
+    return rc;
+}
+
+static int BackupRun(dbBackup *backupPtr)
+{
+    NS_DB_ENV *env = backupPtr->shared->pool->env;
+    int        rc;
+
+    /*
+     * First the database files, then the log files written meanwhile,
+     * recovery of the copy (db_recover -c) makes it consistent.
+     */
+    if (!BackupPathEmpty(backupPtr->path)) {
+        return EEXIST;
+    }
+    if (mkdir(backupPtr->path, 0777) != 0 && errno != EEXIST) {
+        return errno;
+    }
+    rc = env->memp_sync(env, NULL);
+    if (rc == 0) {
+        rc = BackupFiles(backupPtr, DB_ARCH_DATA);
+    }
+    if (rc == 0) {
+        rc = BackupFiles(backupPtr, DB_ARCH_LOG);
+    }
+    return rc;
+}
+
+static int BackupTotal(const dbShared *UNUSED(sharedPtr))
+{
+    return 0;
+}
+#endif
+
+static void BackupThread(void *arg)
+{
+    dbBackup *backupPtr = arg;
+    dbShared *sharedPtr = backupPtr->shared;
+    int       rc;
+
+    Ns_ThreadSetName("-backup-");
+    Ns_Log(Notice, "nsdbbdb: backup to %s started", backupPtr->path);
+    rc = BackupRun(backupPtr);
+    if (rc == 0) {
+        Ns_Log(Notice, "nsdbbdb: backup to %s finished, %d copies, %" TCL_LL_MODIFIER "d bytes",
+               backupPtr->path, backupPtr->done, backupPtr->bytes);
+    } else {
+        Ns_Log(Error, "nsdbbdb: backup to %s failed: %s", backupPtr->path, NS_DB_STRERR(rc));
+    }
+    Ns_MutexLock(&backupPtr->lock);
+    backupPtr->status = rc;
+    backupPtr->finished = time(NULL);
+    backupPtr->running = NS_FALSE;
+    Ns_MutexUnlock(&backupPtr->lock);
+    ReleaseShared(sharedPtr);
+}
+
+/*
+ * Start a backup of the datasource into the directory path. Returns
+ * EBUSY, when a backup is already running. The detached thread keeps the
+ * datasource open until it is done, so closing it never waits for the
+ * thread.
+ */
+static int BackupStart(dbShared *sharedPtr, const char *path, bool compact)
+{
+    dbBackup *backupPtr;
+
+    Ns_MutexLock(&dbLock);
+    if (sharedPtr->backup == NULL) {
+        backupPtr = ns_calloc(1u, sizeof(dbBackup));
+        Ns_MutexInit(&backupPtr->lock);
+        Ns_MutexSetName2(&backupPtr->lock, "nsdbbdb:backup", path);
+        backupPtr->shared = sharedPtr;
+        sharedPtr->backup = backupPtr;
+    }
+    backupPtr = sharedPtr->backup;
+    sharedPtr->refCount++;
+    Ns_MutexUnlock(&dbLock);
+
+    Ns_MutexLock(&backupPtr->lock);
+    if (backupPtr->running) {
+        Ns_MutexUnlock(&backupPtr->lock);
+        ReleaseShared(sharedPtr);
+        return EBUSY;
+    }
+    ns_free(backupPtr->path);
+    backupPtr->path = ns_strdup(path);
+    backupPtr->compact = compact;
+    backupPtr->running = NS_TRUE;
+    backupPtr->done = 0;
+    backupPtr->total = BackupTotal(sharedPtr);
+    backupPtr->bytes = 0;
+    backupPtr->started = time(NULL);
+    backupPtr->finished = 0;
+    backupPtr->status = 0;
+    Ns_ThreadCreate(BackupThread, backupPtr, 0, NULL);
+    Ns_MutexUnlock(&backupPtr->lock);
+    return 0;
+}
+
+/*
+ * Status of the last backup of the datasource as a dict.
+ */
+static Tcl_Obj *BackupStatus(dbShared *sharedPtr)
+{
+    dbBackup *backupPtr;
+    Tcl_Obj  *dictObj = Tcl_NewDictObj();
+
+    Ns_MutexLock(&dbLock);
+    backupPtr = sharedPtr->backup;
+    Ns_MutexUnlock(&dbLock);
+    if (backupPtr == NULL) {
+        PutStat(dictObj, "running", 0, NS_FALSE);
+        return dictObj;
+    }
+    Ns_MutexLock(&backupPtr->lock);
+    PutStat(dictObj, "running", backupPtr->running, NS_FALSE);
+    Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("path", 4), Tcl_NewStringObj(backupPtr->path, TCL_INDEX_NONE));
+    PutStat(dictObj, "compact", backupPtr->compact, NS_FALSE);
+    PutStat(dictObj, "done", backupPtr->done, NS_FALSE);
+    PutStat(dictObj, "total", backupPtr->total, NS_FALSE);
+    PutStat(dictObj, "bytes", backupPtr->bytes, NS_FALSE);
+    PutStat(dictObj, "started", (Tcl_WideInt)backupPtr->started, NS_FALSE);
+    PutStat(dictObj, "finished", (Tcl_WideInt)backupPtr->finished, NS_FALSE);
+    Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("error", 5),
+                   Tcl_NewStringObj(backupPtr->status != 0 ? NS_DB_STRERR(backupPtr->status) : "", TCL_INDEX_NONE));
+    Ns_MutexUnlock(&backupPtr->lock);
+    return dictObj;
+}
+
+/*
+ * Free the backup status, when the datasource is closed. A running backup
+ * holds a reference to the datasource, so none is running here.
+ */
+static void BackupDestroy(dbBackup *backupPtr)
+{
+    ns_free(backupPtr->path);
+    Ns_MutexDestroy(&backupPtr->lock);
+    ns_free(backupPtr);
+}
+
+/*
+ * Bulk loading of a file into a datasource (ns_berkeleydb load), running
+ * in a thread of its own. Unless the input is known to be sorted, it is
+ * sorted in runs of LOAD_MEMORY bytes, which are written to temporary
+ * files and merged. The records are inserted in key order, which fills
+ * the pages of the B-trees completely: LMDB appends with MDB_APPEND,
+ * Berkeley DB splits the rightmost page at its end. The inserts are
+ * committed every LOAD_BATCH records (or LOAD_MEMORY bytes queued for the
+ * shards of a sharded LMDB datasource).
+ */
+#define LOAD_MEMORY (64 * 1024 * 1024)
+#define LOAD_BATCH  100000
+
+typedef enum {
+    LoadTsv,                    /* key<tab>value<newline> */
+    LoadBinary,                 /* <length>:<key><length>:<value> */
+    LoadRun                     /* sorted run, see LoadWriteRun() */
+} dbLoadFormat;
+
+typedef struct _dbLoad {
+    Ns_Mutex lock;
+    dbShared *shared;
+    char *file;
+    dbLoadFormat format;
+    bool sorted;                /* input is sorted by key */
+    bool running;               /* the thread holds a reference to the datasource */
+    const char *phase;          /* "sort", "merge" or "insert" */
+    int runs;                   /* number of sorted runs */
+    Tcl_WideInt bytes;          /* bytes read from the file */
+    Tcl_WideInt records;        /* records inserted */
+    time_t started;
+    time_t finished;
+    int status;                 /* result of the last load */
+    const char *error;          /* format error of the last load */
+} dbLoad;
+
+/*
+ * Reader of records of an input file or of a run. Key and value are kept
+ * in buf, each followed by a null byte.
+ */
+typedef struct _dbLoadReader {
+    FILE *in;
+    dbLoadFormat format;
+    char *buf;
+    size_t bufSize;
+    char *key;
+    size_t keyLength;
+    char *data;
+    size_t dataLength;
+    Tcl_WideInt bytes;          /* bytes read */
+    const dbPool *pool;         /* input: pool of typed keys to convert */
+    unsigned char keyEnc[9];    /* typed key, followed by a null byte */
+} dbLoadReader;
+
+/*
+ * Destination of the records: a connection and a write transaction. The
+ * records of a sharded LMDB datasource are queued instead and inserted
+ * shard by shard at the commit, see ShardQueue(), so the loader holds the
+ * writer lock of a single shard at a time (Berkeley DB uses the
+ * transaction for all shards).
+ */
+typedef struct _dbLoader {
+    dbLoad *load;
+    dbConn conn;
+    NS_DB_TXN *txn;
+#ifdef LMDB
+    Tcl_DString queue;          /* records of a sharded datasource */
+#endif
+    int pending;                /* records not yet committed */
+} dbLoader;
+
+static Ns_ThreadProc LoadThread;
+
+static void LoadReserve(dbLoadReader *readerPtr, size_t size)
+{
+    if (size > readerPtr->bufSize) {
+        readerPtr->bufSize = size * 2u;
+        readerPtr->buf = ns_realloc(readerPtr->buf, readerPtr->bufSize);
+    }
+}
+
+/*
+ * Read the length of a field in binary format, "<length>:".
+ */
+static bool LoadReadLength(dbLoadReader *readerPtr, size_t *lengthPtr, bool *eofPtr)
+{
+    size_t length = 0u;
+    int    c, digits = 0;
+
+    while ((c = getc(readerPtr->in)) != EOF && c >= '0' && c <= '9' && digits < 10) {
+        length = length * 10u + (size_t)(c - '0');
+        digits++;
+    }
+    readerPtr->bytes += digits + 1;
+    *eofPtr = (c == EOF && digits == 0);
+    *lengthPtr = length;
+    return (c == ':' && digits > 0);
+}
+
+/*
+ * Undo the escapes of a tsv field written by dump (\t, \n, \r and \\) in
+ * place and return the new length. Other backslashes are kept.
+ */
+static size_t LoadUnescape(char *field, size_t length)
+{
+    size_t i, n = 0u;
+
+    for (i = 0u; i < length; i++) {
+        char c = field[i];
+
+        if (c == '\\' && i + 1u < length) {
+            switch (field[i + 1u]) {
+            case 't':
+                c = '\t';
+                i++;
+                break;
+            case 'n':
+                c = '\n';
+                i++;
+                break;
+            case 'r':
+                c = '\r';
+                i++;
+                break;
+            case '\\':
+                i++;
+                break;
+            default:
+                break;
+            }
+        }
+        field[n++] = c;
     }
+    return n;
+}
 
-    if (strncasecmp(query, "TRUNCATE", 8) == 0) {
-#ifdef LMDB
-        int rc;
-        NS_DB_TXN  *txn;
+/*
+ * Read the next record. Returns 1 for a record, 0 at the end of the
+ * input and -1 for an invalid record.
+ */
+static int LoadRead(dbLoadReader *readerPtr)
+{
+    size_t keyLength, dataLength;
 
-        rc = mdb_txn_begin(dbEnv, NULL, 0, &txn);
-        if (rc == 0) {
-            conn->status = mdb_drop(txn, conn->dbi, 0);
-            mdb_txn_commit(txn);
+    if (readerPtr->format == LoadTsv) {
+        size_t n = 0u;
+        int    c;
+        char  *tab;
+
+        while ((c = getc(readerPtr->in)) != EOF && c != '\n') {
+            LoadReserve(readerPtr, n + 2u);
+            readerPtr->buf[n++] = (char)c;
         }
-#else
-        u_int32_t count;
-        conn->status = conn->dbi->truncate(conn->dbi, NULL, &count, 0);
-#endif
-        if (conn->status == 0) {
-            return NS_DML;
+        if (c == EOF && n == 0u) {
+            return 0;
         }
+        readerPtr->bytes += (Tcl_WideInt)n + 1;
+        LoadReserve(readerPtr, n + 1u);
+        readerPtr->buf[n] = '\0';
+        tab = memchr(readerPtr->buf, '\t', n);
+        if (tab == NULL) {
+            return -1;
+        }
+        dataLength = LoadUnescape(tab + 1, n - (size_t)(tab - readerPtr->buf) - 1u);
+        keyLength = LoadUnescape(readerPtr->buf, (size_t)(tab - readerPtr->buf));
+        readerPtr->buf[keyLength] = '\0';
+        memmove(readerPtr->buf + keyLength + 1u, tab + 1, dataLength);
+        readerPtr->buf[keyLength + 1u + dataLength] = '\0';
+    } else {
+        bool eof;
 
-        NS_DB_ENV_ERR(dbEnv, conn->status, "DB->truncate");
-        Ns_DbSetException(handle, "ERROR", NS_DB_STRERR(conn->status));
-        return NS_ERROR;
-    }
+        if (readerPtr->format == LoadRun) {
+            uint32_t lengths[2];
 
-    if (strncasecmp(query, "COMPACT", 7) == 0) {
-#ifdef LMDB
-        Ns_Log(Warning, "nsdbbdb: command COMPACT is not supported."
-               "Future versions might support 'mdb_env_copy2' with the COMPACT option");
-        return NS_DML;
-#else
-        DB_COMPACT c_data;
-        memset(&c_data, 0, sizeof(c_data));
-        conn->status = conn->dbi->compact(conn->dbi, NULL, NULL, NULL, NULL, 0, NULL);
-        if (conn->status == 0) {
-            return NS_DML;
+            if (fread(lengths, sizeof(lengths), 1u, readerPtr->in) != 1u) {
+                return 0;
+            }
+            keyLength = lengths[0];
+            dataLength = lengths[1];
+        } else if (!LoadReadLength(readerPtr, &keyLength, &eof)) {
+            return eof ? 0 : -1;
         }
-        NS_DB_ENV_ERR(dbEnv, conn->status, "DB->compact");
-        Ns_DbSetException(handle, "ERROR", NS_DB_STRERR(conn->status));
-        return NS_ERROR;
-#endif
-    }
-
-    if (strncasecmp(query, "BEGIN", 5) == 0) {
-        if (conn->txn == NULL) {
-            conn->status = NS_DB_ENV_TXN_BEGIN(dbEnv, &conn->txn);
+        LoadReserve(readerPtr, keyLength + 1u);
+        if (fread(readerPtr->buf, 1u, keyLength, readerPtr->in) != keyLength) {
+            return -1;
         }
-        if (conn->status != 0) {
-            return NS_DML;
+        if (readerPtr->format == LoadBinary && !LoadReadLength(readerPtr, &dataLength, &eof)) {
+            return -1;
         }
-        NS_DB_ENV_ERR(dbEnv, conn->status, "NS_DB_ENV->txn_begin");
-        Ns_DbSetException(handle, "ERROR", NS_DB_STRERR(conn->status));
-        return NS_ERROR;
+        LoadReserve(readerPtr, keyLength + dataLength + 2u);
+        readerPtr->buf[keyLength] = '\0';
+        if (fread(readerPtr->buf + keyLength + 1u, 1u, dataLength, readerPtr->in) != dataLength) {
+            return -1;
+        }
+        readerPtr->buf[keyLength + 1u + dataLength] = '\0';
+        readerPtr->bytes += (Tcl_WideInt)(keyLength + dataLength);
     }
+    readerPtr->key = readerPtr->buf;
+    readerPtr->keyLength = keyLength;
+    readerPtr->data = readerPtr->buf + keyLength + 1u;
+    readerPtr->dataLength = dataLength;
+    if (readerPtr->pool != NULL && readerPtr->pool->keyType != KeyString) {
+        NS_DB_VAL key;
 
-    if (strncasecmp(query, "COMMIT", 6) == 0) {
-        if (conn->txn != NULL) {
-            conn->status = NS_DB_ENV_TXN_COMMIT(conn->txn);
-        }
-        conn->txn = 0;
-        if (conn->status != 0) {
-            return NS_DML;
+        memset(&key, 0, sizeof(key));
+        NS_DB_VAL_DATA(key) = readerPtr->key;
+        NS_DB_VAL_SIZE(key) = (NS_DB_SIZE_T)keyLength;
+        if (EncodeKey(readerPtr->pool, &key, readerPtr->keyEnc) != NS_OK) {
+            return -1;
         }
-        NS_DB_ENV_ERR(dbEnv, conn->status, "NS_DB_ENV->txn_commit");
-        Ns_DbSetException(handle, "ERROR", NS_DB_STRERR(conn->status));
-        return NS_ERROR;
+        readerPtr->key = (char *)readerPtr->keyEnc;
+        readerPtr->keyLength = NS_DB_VAL_SIZE(key);
     }
+    return 1;
+}
 
-    if (strncasecmp(query, "ABORT", 5) == 0) {
-        if (conn->txn != NULL) {
-            conn->status = NS_DB_ENV_TXN_ABORT(conn->txn);
-        }
-        conn->txn = NULL;
-        if (conn->status != 0) {
-            return NS_DML;
+/*
+ * Records of a run in memory: two 32-bit lengths followed by the key and
+ * the value, each with a null byte. This is the format of the run files as
+ * well, without the null bytes.
+ */
+static int LoadCompare(const void *a, const void *b)
+{
+    const char *recA = *(const char *const *)a, *recB = *(const char *const *)b;
+    uint32_t    lengthsA[2], lengthsB[2];
+    NS_DB_VAL   keyA, keyB;
+    int         rc;
+
+    memcpy(lengthsA, recA, sizeof(lengthsA));
+    memcpy(lengthsB, recB, sizeof(lengthsB));
+    memset(&keyA, 0, sizeof(keyA));
+    memset(&keyB, 0, sizeof(keyB));
+    NS_DB_VAL_DATA(keyA) = (void *)(recA + sizeof(lengthsA));
+    NS_DB_VAL_SIZE(keyA) = lengthsA[0];
+    NS_DB_VAL_DATA(keyB) = (void *)(recB + sizeof(lengthsB));
+    NS_DB_VAL_SIZE(keyB) = lengthsB[0];
+    rc = CompareBytes(&keyA, &keyB);
+    if (rc == 0) {
+        /*
+         * Keep the order of the input, so the last value of a key wins.
+         */
+        rc = (recA > recB) - (recA < recB);
+    }
+    return rc;
+}
+
+static void LoadRecord(const char *rec, const char **keyPtr, size_t *keyLengthPtr,
+                       const char **dataPtr, size_t *dataLengthPtr)
+{
+    uint32_t lengths[2];
+
+    memcpy(lengths, rec, sizeof(lengths));
+    *keyPtr = rec + sizeof(lengths);
+    *keyLengthPtr = lengths[0];
+    *dataPtr = *keyPtr + lengths[0] + 1u;
+    *dataLengthPtr = lengths[1];
+}
+
+static void LoadSetPhase(dbLoad *loadPtr, const char *phase, const dbLoadReader *readerPtr)
+{
+    Ns_MutexLock(&loadPtr->lock);
+    loadPtr->phase = phase;
+    if (readerPtr != NULL) {
+        loadPtr->bytes = readerPtr->bytes;
+    }
+    Ns_MutexUnlock(&loadPtr->lock);
+}
+
+/*
+ * Insert a record in the transaction of the current shard.
+ */
+static int LoadInsert(dbConn *conn, NS_DB_TXN *txn, NS_DB_VAL *keyPtr, NS_DB_VAL *dataPtr)
+{
+    int rc;
+
+    rc = TtlUpdate(conn, txn, keyPtr, 0);
+    if (rc == 0) {
+#ifdef LMDB
+        rc = mdb_put(txn, conn->dbi, keyPtr, dataPtr, MDB_APPEND);
+        if (rc == MDB_KEYEXIST) {
+            /*
+             * The key is not beyond the last key of the database.
+             */
+            rc = mdb_put(txn, conn->dbi, keyPtr, dataPtr, 0u);
         }
-        NS_DB_ENV_ERR(dbEnv, conn->status, "NS_DB_ENV->txn_commit");
-        Ns_DbSetException(handle, "ERROR", NS_DB_STRERR(conn->status));
-        return NS_ERROR;
+#else
+        rc = conn->dbi->put(conn->dbi, txn, keyPtr, dataPtr, 0u);
+#endif
+    }
+    if (rc == 0) {
+        BloomAdd(conn, keyPtr);
     }
+    return rc;
+}
 
-    if (strncasecmp(query, "PUT ", 4) == 0
-        || strncasecmp(query, "PUT/", 4) == 0) {
-        unsigned int  flags = 0;
-        char         *ptr, orig = 0;
+#ifdef LMDB
+/*
+ * Insert the queued records of a sharded datasource in ascending shard
+ * order, with a transaction per shard, and add the number of committed
+ * records to *countPtr.
+ */
+static int LoadShards(dbLoader *loaderPtr, int *countPtr)
+{
+    dbConn *conn = &loaderPtr->conn;
+    int     i, rc = 0;
 
-        if (query[3] == '/') {
-            for (ptr = query + 3; *ptr && *ptr != ' '; ptr++) {
-                if (*ptr == 'a') {
-                    flags |= NS_DB_APPEND;
-                } else
-                if (*ptr == 'd') {
-                    flags |= NS_DB_NODUPDATA;
-                } else
-                if (*ptr == 'o') {
-                    flags |= NS_DB_NOOVERWRITE;
-                }
+    for (i = 0; i < conn->shared->nShards && rc == 0; i++) {
+        NS_DB_TXN  *txn = NULL;
+        NS_DB_VAL   key, data;
+        TCL_SIZE_T  offset = 0;
+        int         count = 0;
+
+        UseShard(conn, i);
+        while (rc == 0 && ShardNext(&loaderPtr->queue, i, &offset, &key, &data)) {
+            if (txn == NULL) {
+                rc = mdb_txn_begin(conn->env, NULL, 0u, &txn);
+            }
+            if (rc == 0) {
+                rc = LoadInsert(conn, txn, &key, &data);
+                count++;
             }
-            NS_DB_VAL_DATA(conn->key) = ptr + 1;
-        } else {
-            NS_DB_VAL_DATA(conn->key) = query + 4;
         }
-        conn->cmd = DB_UPDATE;
-        if ((ptr = strstr(NS_DB_VAL_DATA(conn->key), dbDelimiter))) {
-            orig = *ptr;
-            *ptr = 0;
-            NS_DB_VAL_DATA(conn->data) = ptr + 1;
-            NS_DB_VAL_SIZE(conn->data) = ((NS_DB_SIZE_T)strlen(NS_DB_VAL_DATA(conn->data))) + 1;
+        if (txn != NULL) {
+            if (rc == 0) {
+                rc = TtlCommit(conn, txn);
+            } else {
+                mdb_txn_abort(txn);
+                TtlDiscard(conn);
+            }
+            if (rc == 0) {
+                *countPtr += count;
+            }
         }
-        NS_DB_VAL_SIZE(conn->key) = ((NS_DB_SIZE_T)strlen(NS_DB_VAL_DATA(conn->key))) + 1;
+    }
+    Tcl_DStringSetLength(&loaderPtr->queue, 0);
+    return rc;
+}
+#endif
+
+/*
+ * Commit the pending inserts.
+ */
+static int LoadCommit(dbLoader *loaderPtr, bool abort)
+{
+    dbLoad *loadPtr = loaderPtr->load;
+    int     rc = 0, count = 0;
+
+    if (loaderPtr->txn != NULL) {
 #ifdef LMDB
-        conn->status = GetTempTxn(conn, &tempTxn);
-        if (conn->status == 0) {
-            conn->status = mdb_put(tempTxn, conn->dbi, &conn->key, &conn->data, flags);
-            CleanTempTxn(conn, tempTxn);
+        if (abort) {
+            mdb_txn_abort(loaderPtr->txn);
+            TtlDiscard(&loaderPtr->conn);
+        } else {
+            rc = TtlCommit(&loaderPtr->conn, loaderPtr->txn);
         }
 #else
-        conn->status = conn->dbi->put(conn->dbi, 0, &conn->key, &conn->data, flags);
+        rc = abort ? NS_DB_ENV_TXN_ABORT(loaderPtr->txn) : NS_DB_ENV_TXN_COMMIT(loaderPtr->txn);
 #endif
-        // Restore original delimiter
-        if (orig != 0) {
-            *ptr = orig;
-        }
-        if (conn->status == 0) {
-            return NS_DML;
+        if (!abort && rc == 0) {
+            count = loaderPtr->pending;
         }
-        // Report error situation
-        NS_DB_ERR0(conn->dbi, conn->status, "DB->put");
-        Ns_DbSetException(handle, "ERROR", NS_DB_STRERR(conn->status));
-        return NS_ERROR;
+        loaderPtr->txn = NULL;
     }
+#ifdef LMDB
+    if (abort) {
+        Tcl_DStringSetLength(&loaderPtr->queue, 0);
+    } else if (loaderPtr->queue.length > 0) {
+        rc = LoadShards(loaderPtr, &count);
+    }
+#endif
+    Ns_MutexLock(&loadPtr->lock);
+    loadPtr->records += count;
+    Ns_MutexUnlock(&loadPtr->lock);
+    loaderPtr->pending = 0;
+    return rc;
+}
 
-    if (strncasecmp(query, "DEL ", 4) == 0) {
-        conn->cmd = DB_DELETE;
-        NS_DB_VAL_DATA(conn->key) = query + 4;
-        NS_DB_VAL_SIZE(conn->key) = ((NS_DB_SIZE_T)strlen(NS_DB_VAL_DATA(conn->key))) + 1;
+static int LoadPut(dbLoader *loaderPtr, const char *keyData, size_t keyLength,
+                   const char *valueData, size_t valueLength)
+{
+    dbConn    *conn = &loaderPtr->conn;
+    NS_DB_VAL  key, data;
+    int        rc = 0;
+    size_t     extra = conn->pool->binary ? 0u : 1u;
+
+    memset(&key, 0, sizeof(key));
+    memset(&data, 0, sizeof(data));
+    NS_DB_VAL_DATA(key) = (void *)keyData;
+    NS_DB_VAL_SIZE(key) = (NS_DB_SIZE_T)(keyLength + (conn->pool->keyType == KeyString ? extra : 0u));
+    NS_DB_VAL_DATA(data) = (void *)valueData;
+    NS_DB_VAL_SIZE(data) = (NS_DB_SIZE_T)(valueLength + extra);
+    RouteKey(conn, &key);
 #ifdef LMDB
-        conn->status = GetTempTxn(conn, &tempTxn);
-        if (conn->status == 0) {
-            conn->status = mdb_del(tempTxn, conn->dbi, &conn->key, &conn->data);
-            CleanTempTxn(conn, tempTxn);
+    if (conn->shared->nShards > 1) {
+        ShardQueue(&loaderPtr->queue, conn->shard, &key, &data);
+        if (++loaderPtr->pending >= LOAD_BATCH || loaderPtr->queue.length >= LOAD_MEMORY) {
+            rc = LoadCommit(loaderPtr, NS_FALSE);
         }
+        return rc;
+    }
+    if (loaderPtr->txn == NULL) {
+        rc = mdb_txn_begin(conn->env, NULL, 0u, &loaderPtr->txn);
+    }
 #else
-        conn->status = conn->dbi->del(conn->dbi, 0, &conn->key, 0);
+    if (loaderPtr->txn == NULL && (conn->shared->pool->envPtr->envFlags & DB_INIT_TXN) != 0u) {
+        rc = NS_DB_ENV_TXN_BEGIN(conn->env, &loaderPtr->txn);
+    }
 #endif
-        if (conn->status == 0) {
-            return NS_DML;
+    if (rc == 0) {
+        rc = LoadInsert(conn, loaderPtr->txn, &key, &data);
+    }
+    if (rc == 0 && ++loaderPtr->pending >= LOAD_BATCH) {
+        rc = LoadCommit(loaderPtr, NS_FALSE);
+    }
+    return rc;
+}
+
+/*
+ * Sort the records of a run and insert them, or write them to a
+ * temporary file.
+ */
+static int LoadSortRun(dbLoader *loaderPtr, char *arena, size_t count, FILE *out)
+{
+    char  **recs = ns_malloc(count * sizeof(char *));
+    size_t  i, offset = 0u;
+    int     rc = 0;
+
+    for (i = 0u; i < count; i++) {
+        uint32_t lengths[2];
+
+        recs[i] = arena + offset;
+        memcpy(lengths, recs[i], sizeof(lengths));
+        offset += sizeof(lengths) + lengths[0] + lengths[1] + 2u;
+    }
+    qsort(recs, count, sizeof(char *), LoadCompare);
+    for (i = 0u; i < count && rc == 0; i++) {
+        const char *key, *data;
+        size_t      keyLength, dataLength;
+
+        LoadRecord(recs[i], &key, &keyLength, &data, &dataLength);
+        if (out == NULL) {
+            rc = LoadPut(loaderPtr, key, keyLength, data, dataLength);
+        } else if (fwrite(recs[i], sizeof(uint32_t) * 2u, 1u, out) != 1u
+                   || fwrite(key, 1u, keyLength, out) != keyLength
+                   || fwrite(data, 1u, dataLength, out) != dataLength) {
+            rc = errno;
         }
-        // Report error situation
-        NS_DB_ERR0(conn->dbi, conn->status, "DB->del");
-        Ns_DbSetException(handle, "ERROR", NS_DB_STRERR(conn->status));
-        return NS_ERROR;
     }
+    ns_free(recs);
+    return rc;
+}
 
-    /*
-     * Open cursor and retrieve all matching records
-     */
-    if (strncasecmp(query, "CURSOR", 6) == 0) {
-        Ns_Log(BdbDebug, "... CURSOR");
+/*
+ * Open an anonymous temporary file in the home directory of the pool.
+ */
+static FILE *LoadTempFile(const dbShared *sharedPtr)
+{
+    Tcl_DString ds;
+    FILE       *f = NULL;
+    int         fd;
 
-        conn->cmd = DB_SELECT;
-        conn->count = 0;
-#ifdef LMDB
-        /*
-         * Do not use the usual tmpTxn, but allocate a transaction for the
-         * cursor in the connection data. This txn is managed on the usual
-         * cleanup.
-         */
-        if (conn->txn == NULL) {
-            Ns_Log(BdbDebug, "... CURSOR allocating txn");
-            conn->status = mdb_txn_begin(dbEnv, NULL, 0, &conn->txn);
+    Tcl_DStringInit(&ds);
+    Ns_DStringPrintf(&ds, "%s/load.XXXXXX", sharedPtr->pool->envPtr->home);
+    fd = mkstemp(ds.string);
+    if (fd != -1) {
+        (void) unlink(ds.string);
+        f = fdopen(fd, "w+b");
+        if (f == NULL) {
+            close(fd);
         }
-#endif
-        conn->status = NS_DB_DBI_CURSOR_OPEN(conn->txn, conn->dbi, &conn->cursor);
-        if (conn->status != 0) {
-            NS_DB_ERR0(conn->dbi, conn->status, "DB->cursor");
-            Ns_DbSetException(handle, "ERROR", NS_DB_STRERR(conn->status));
-            return NS_ERROR;
+    }
+    Tcl_DStringFree(&ds);
+    return f;
+}
+
+static bool LoadKeyLess(const dbLoadReader *a, const dbLoadReader *b)
+{
+    NS_DB_VAL keyA, keyB;
+
+    memset(&keyA, 0, sizeof(keyA));
+    memset(&keyB, 0, sizeof(keyB));
+    NS_DB_VAL_DATA(keyA) = a->key;
+    NS_DB_VAL_SIZE(keyA) = (NS_DB_SIZE_T)a->keyLength;
+    NS_DB_VAL_DATA(keyB) = b->key;
+    NS_DB_VAL_SIZE(keyB) = (NS_DB_SIZE_T)b->keyLength;
+    return CompareBytes(&keyA, &keyB) < 0;
+}
+
+/*
+ * Merge the sorted runs. Of equal keys, the ones of earlier runs are
+ * inserted first, so the last value of a key in the input wins.
+ */
+static int LoadMerge(dbLoader *loaderPtr, FILE **runs, int nRuns)
+{
+    dbLoadReader *readers = ns_calloc((size_t)nRuns, sizeof(dbLoadReader));
+    int          *status = ns_calloc((size_t)nRuns, sizeof(int));
+    int           i, rc = 0;
+
+    for (i = 0; i < nRuns; i++) {
+        readers[i].in = runs[i];
+        readers[i].format = LoadRun;
+        rewind(runs[i]);
+        status[i] = LoadRead(&readers[i]);
+    }
+    for (;;) {
+        int min = -1;
+
+        for (i = 0; i < nRuns; i++) {
+            if (status[i] < 0) {
+                rc = EIO;
+            } else if (status[i] == 1 && (min < 0 || LoadKeyLess(&readers[i], &readers[min]))) {
+                min = i;
+            }
+        }
+        if (min < 0 || rc != 0) {
+            break;
         }
+        rc = LoadPut(loaderPtr, readers[min].key, readers[min].keyLength,
+                     readers[min].data, readers[min].dataLength);
+        status[min] = LoadRead(&readers[min]);
+    }
+    for (i = 0; i < nRuns; i++) {
+        ns_free(readers[i].buf);
+    }
+    ns_free(readers);
+    ns_free(status);
+    return rc;
+}
 
-#ifndef LMDB
-        /*
-         * LMDB: The memory pointed to by the returned values is owned by the
-         * database, no need to free.
-         */
-        NS_DB_VAL_FLAGS(conn->key) = NS_DB_VAL_FLAGS(conn->data) = NS_DB_DBT_REALLOC;
-#endif
+/*
+ * Read the input and insert its records, sorting them first unless the
+ * input is sorted.
+ */
+static int LoadFile(dbLoad *loadPtr, dbLoader *loaderPtr, FILE *in)
+{
+    dbLoadReader reader;
+    FILE       **runs = NULL;
+    char        *arena = NULL;
+    size_t       arenaSize = 0u, used = 0u, count = 0u;
+    int          i, nRuns = 0, rc = 0, result;
 
-        /*
-         * Range request, try to position cursor to the closest key
-         */
-        if (*(query + 6) != 0) {
-            NS_DB_VAL_DATA(conn->key) = ns_strdup(query + 7);
-            NS_DB_VAL_SIZE(conn->key) = ((NS_DB_SIZE_T)strlen(NS_DB_VAL_DATA(conn->key))) + 1;
-            conn->status = NS_DB_CURSOR_GET(conn->cursor, &conn->key, &conn->data, NS_DB_SET_RANGE);
+    memset(&reader, 0, sizeof(reader));
+    reader.in = in;
+    reader.format = loadPtr->format;
+    reader.pool = loaderPtr->conn.pool;
 
-        } else {
+    while ((result = LoadRead(&reader)) == 1) {
+        uint32_t lengths[2];
+        size_t   size;
+
+        if (loadPtr->sorted) {
+            rc = LoadPut(loaderPtr, reader.key, reader.keyLength, reader.data, reader.dataLength);
+            if (rc != 0) {
+                break;
+            }
+            continue;
+        }
+        if (reader.keyLength > UINT32_MAX || reader.dataLength > UINT32_MAX) {
+            result = -1;
+            break;
+        }
+        lengths[0] = (uint32_t)reader.keyLength;
+        lengths[1] = (uint32_t)reader.dataLength;
+        size = sizeof(lengths) + reader.keyLength + reader.dataLength + 2u;
+        if (used > 0u && used + size > LOAD_MEMORY) {
+            FILE *out = LoadTempFile(loadPtr->shared);
+
+            if (out == NULL) {
+                rc = errno;
+                break;
+            }
+            runs = ns_realloc(runs, (size_t)(nRuns + 1) * sizeof(FILE *));
+            runs[nRuns++] = out;
+            LoadSetPhase(loadPtr, "sort", &reader);
+            rc = LoadSortRun(loaderPtr, arena, count, out);
+            if (rc != 0) {
+                break;
+            }
+            used = 0u;
+            count = 0u;
+        }
+        if (used + size > arenaSize) {
+            arenaSize = (used + size) * 2u;
+            arena = ns_realloc(arena, arenaSize);
+        }
+        memcpy(arena + used, lengths, sizeof(lengths));
+        memcpy(arena + used + sizeof(lengths), reader.key, reader.keyLength + 1u);
+        memcpy(arena + used + sizeof(lengths) + reader.keyLength + 1u, reader.data, reader.dataLength + 1u);
+        used += size;
+        count++;
+    }
+    if (rc == 0 && result < 0) {
+        loadPtr->error = "invalid record";
+        rc = EINVAL;
+    }
+    LoadSetPhase(loadPtr, (nRuns > 0) ? "sort" : "insert", &reader);
+    if (rc == 0 && count > 0u) {
+        if (nRuns == 0) {
             /*
-             * Full table scan
+             * The input fits into memory.
              */
-            conn->status = NS_DB_CURSOR_GET(conn->cursor, &conn->key, &conn->data, NS_DB_FIRST);
-        }
-        switch (conn->status) {
-        case 0:
-        case NS_DB_NOTFOUND:
-            handle->fetchingRows = NS_TRUE;
-            return NS_ROWS;
-        default:
-            NS_DB_ERR0(conn->dbi, conn->status, "DB->c_get");
-            Ns_DbSetException(handle, "ERROR", NS_DB_STRERR(conn->status));
-            return NS_ERROR;
+            rc = LoadSortRun(loaderPtr, arena, count, NULL);
+        } else {
+            FILE *out = LoadTempFile(loadPtr->shared);
+
+            if (out == NULL) {
+                rc = errno;
+            } else {
+                runs = ns_realloc(runs, (size_t)(nRuns + 1) * sizeof(FILE *));
+                runs[nRuns++] = out;
+                rc = LoadSortRun(loaderPtr, arena, count, out);
+            }
         }
     }
-
-    return NS_ERROR;
+    ns_free(arena);
+    if (rc == 0 && nRuns > 0) {
+        Ns_MutexLock(&loadPtr->lock);
+        loadPtr->runs = nRuns;
+        Ns_MutexUnlock(&loadPtr->lock);
+        LoadSetPhase(loadPtr, "merge", NULL);
+        rc = LoadMerge(loaderPtr, runs, nRuns);
+    }
+    for (i = 0; i < nRuns; i++) {
+        fclose(runs[i]);
+    }
+    ns_free(runs);
+    ns_free(reader.buf);
+    return rc;
+}
+
+static void LoadThread(void *arg)
+{
+    dbLoad   *loadPtr = arg;
+    dbShared *sharedPtr = loadPtr->shared;
+    dbLoader  loader;
+    FILE     *in;
+    int       rc;
+
+    Ns_ThreadSetName("-load-");
+    memset(&loader, 0, sizeof(loader));
+    loader.load = loadPtr;
+    loader.conn.pool = (struct _dbPool *)sharedPtr->pool;
+    loader.conn.shared = sharedPtr;
+    UseShard(&loader.conn, 0);
+#ifdef LMDB
+    Tcl_DStringInit(&loader.conn.ttlKeys);
+    Tcl_DStringInit(&loader.queue);
+#endif
+
+    Ns_Log(Notice, "nsdbbdb: loading %s", loadPtr->file);
+    in = fopen(loadPtr->file, "rb");
+    if (in == NULL) {
+        rc = errno;
+    } else {
+        rc = LoadFile(loadPtr, &loader, in);
+        fclose(in);
+    }
+    if (rc == 0) {
+        rc = LoadCommit(&loader, NS_FALSE);
+    } else {
+        (void) LoadCommit(&loader, NS_TRUE);
+    }
+#ifdef LMDB
+    if (loader.conn.ttlRtxn != NULL) {
+        mdb_txn_abort(loader.conn.ttlRtxn);
+    }
+    Tcl_DStringFree(&loader.conn.ttlKeys);
+    Tcl_DStringFree(&loader.queue);
+#endif
+    if (sharedPtr->cache != NULL) {
+        CacheClear(sharedPtr->cache);
+    }
+    if (rc == 0) {
+        Ns_Log(Notice, "nsdbbdb: loaded %s, %" TCL_LL_MODIFIER "d records",
+               loadPtr->file, loadPtr->records);
+    } else {
+        Ns_Log(Error, "nsdbbdb: loading %s failed after %" TCL_LL_MODIFIER "d records: %s",
+               loadPtr->file, loadPtr->records,
+               loadPtr->error != NULL ? loadPtr->error : NS_DB_STRERR(rc));
+    }
+    Ns_MutexLock(&loadPtr->lock);
+    loadPtr->status = rc;
+    loadPtr->finished = time(NULL);
+    loadPtr->running = NS_FALSE;
+    Ns_MutexUnlock(&loadPtr->lock);
+    ReleaseShared(sharedPtr);
 }
 
-static int DbGetRow(Ns_DbHandle *handle, Ns_Set *row)
+/*
+ * Start loading a file into the datasource. Returns EBUSY, when a load
+ * is already running. As for backups, the detached thread keeps the
+ * datasource open until it is done.
+ */
+static int LoadStart(dbShared *sharedPtr, const char *file, dbLoadFormat format, bool sorted)
 {
-    int rc = 0;
-    dbConn *conn = handle->connection;
+    dbLoad *loadPtr;
 
-    Ns_Log(BdbDebug, "getrow: %d: %d: %s %s",
-           conn->cmd, conn->status, (char *) NS_DB_VAL_DATA(conn->key),
-           (char *)NS_DB_VAL_DATA(conn->data));
+    Ns_MutexLock(&dbLock);
+    if (sharedPtr->load == NULL) {
+        loadPtr = ns_calloc(1u, sizeof(dbLoad));
+        Ns_MutexInit(&loadPtr->lock);
+        Ns_MutexSetName2(&loadPtr->lock, "nsdbbdb:load", file);
+        loadPtr->shared = sharedPtr;
+        sharedPtr->load = loadPtr;
+    }
+    loadPtr = sharedPtr->load;
+    sharedPtr->refCount++;
+    Ns_MutexUnlock(&dbLock);
 
-    if (handle->fetchingRows == 0) {
-        Ns_Log(Error, "getrow nsdbbdb(%s):  No rows waiting to fetch.", handle->datasource);
-        Ns_DbSetException(handle, "NSDB", "no rows waiting to fetch.");
-        return NS_ERROR;
+    Ns_MutexLock(&loadPtr->lock);
+    if (loadPtr->running) {
+        Ns_MutexUnlock(&loadPtr->lock);
+        ReleaseShared(sharedPtr);
+        return EBUSY;
     }
+    ns_free(loadPtr->file);
+    loadPtr->file = ns_strdup(file);
+    loadPtr->format = format;
+    loadPtr->sorted = sorted;
+    loadPtr->running = NS_TRUE;
+    loadPtr->phase = sorted ? "insert" : "sort";
+    loadPtr->runs = 0;
+    loadPtr->bytes = 0;
+    loadPtr->records = 0;
+    loadPtr->started = time(NULL);
+    loadPtr->finished = 0;
+    loadPtr->status = 0;
+    loadPtr->error = NULL;
+    Ns_ThreadCreate(LoadThread, loadPtr, 0, NULL);
+    Ns_MutexUnlock(&loadPtr->lock);
+    return 0;
+}
 
-    if (conn->status == NS_DB_NOTFOUND) {
-        Ns_Log(BdbDebug, "getrow: NS_END_DATA");
-        handle->statement = 0;
-        handle->fetchingRows = NS_FALSE;
-        return NS_END_DATA;
+/*
+ * Status of the last load of the datasource as a dict.
+ */
+static Tcl_Obj *LoadStatus(dbShared *sharedPtr)
+{
+    dbLoad  *loadPtr;
+    Tcl_Obj *dictObj = Tcl_NewDictObj();
+
+    Ns_MutexLock(&dbLock);
+    loadPtr = sharedPtr->load;
+    Ns_MutexUnlock(&dbLock);
+    if (loadPtr == NULL) {
+        PutStat(dictObj, "running", 0, NS_FALSE);
+        return dictObj;
     }
+    Ns_MutexLock(&loadPtr->lock);
+    PutStat(dictObj, "running", loadPtr->running, NS_FALSE);
+    Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("file", 4), Tcl_NewStringObj(loadPtr->file, TCL_INDEX_NONE));
+    Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("phase", 5), Tcl_NewStringObj(loadPtr->phase, TCL_INDEX_NONE));
+    PutStat(dictObj, "runs", loadPtr->runs, NS_FALSE);
+    PutStat(dictObj, "bytes", loadPtr->bytes, NS_FALSE);
+    PutStat(dictObj, "records", loadPtr->records, NS_FALSE);
+    PutStat(dictObj, "started", (Tcl_WideInt)loadPtr->started, NS_FALSE);
+    PutStat(dictObj, "finished", (Tcl_WideInt)loadPtr->finished, NS_FALSE);
+    Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("error", 5),
+                   Tcl_NewStringObj(loadPtr->status == 0 ? ""
+                                    : loadPtr->error != NULL ? loadPtr->error
+                                    : NS_DB_STRERR(loadPtr->status), TCL_INDEX_NONE));
+    Ns_MutexUnlock(&loadPtr->lock);
+    return dictObj;
+}
 
-    switch (conn->cmd) {
-    case DB_CHECK:
-        Ns_Log(BdbDebug, "getrow: CHECK");
-        // Only one record should be returned
-        conn->status = NS_DB_NOTFOUND;
-        Ns_SetPutValueSz(row, 0, "1", 1);
-        return NS_OK;
+/*
+ * Free the load status, when the datasource is closed. A running load
+ * holds a reference to the datasource, so none is running here.
+ */
+static void LoadDestroy(dbLoad *loadPtr)
+{
+    ns_free(loadPtr->file);
+    Ns_MutexDestroy(&loadPtr->lock);
+    ns_free(loadPtr);
+}
 
-    case DB_GET:
-        // Only one record should be returned
-        Ns_Log(BdbDebug, "getrow: DB_GET");
-        conn->status = NS_DB_NOTFOUND;
-        Ns_SetPutValueSz(row, 0,
-                         NS_DB_VAL_DATA(conn->data), (TCL_SIZE_T)NS_DB_VAL_SIZE(conn->data));
-        return NS_OK;
+/*
+ * Streaming dump of a key range. The records are formatted straight from
+ * the cursor into a buffer, which is written to a Tcl channel or to the
+ * current connection whenever it is full.
+ */
 
-    case DB_SELECT:
-        /*
-         * On the first invocation, data is already provided.
-         * For later calls, we have to get the next item.
-         */
-        conn->count ++;
-        Ns_Log(BdbDebug, "getrow: DB_SELECT data %p cursor %p txn %p count: %d",
-               (void*)NS_DB_VAL_DATA(conn->data),
-               (void*)conn->cursor,
-               (void*)conn->txn,
-               conn->count
-               );
-        if (conn->count > 1) {
-            conn->status = NS_DB_CURSOR_GET(conn->cursor, &conn->key, &conn->data, NS_DB_NEXT);
+#define DUMP_BUFFER 65536
 
-        }
-        Ns_Log(BdbDebug, "getrow: status %d %s", conn->status, NS_DB_STRERR(conn->status));
+typedef enum {
+    DumpTsv,                    /* <key>\t<value>\n */
+    DumpJson,                   /* [{"key":"..","value":".."},..] */
+    DumpBinary                  /* <length>:<key><length>:<value> */
+} dbDumpFormat;
 
-        switch (conn->status) {
-        case 0:
-            Ns_Log(BdbDebug, "getrow: set data key <%s> data <%s>",
-                   (char*)NS_DB_VAL_DATA(conn->key),
-                   (char*)NS_DB_VAL_DATA(conn->data));
-            Ns_SetPutValueSz(row, 0, NS_DB_VAL_DATA(conn->key), (TCL_SIZE_T)NS_DB_VAL_SIZE(conn->key));
-            Ns_SetPutValueSz(row, 1, NS_DB_VAL_DATA(conn->data),(TCL_SIZE_T)NS_DB_VAL_SIZE(conn->data));
-            DbFree(handle);
-            return NS_OK;
+typedef struct _dbDump {
+    dbDumpFormat format;
+    Tcl_Channel  chan;          /* NULL when writing to the connection */
+    Ns_Conn     *nsConn;
+    Tcl_DString  buf;
+    Tcl_WideInt  records;
+} dbDump;
 
-        case NS_DB_NOTFOUND:
-            handle->fetchingRows = NS_FALSE;
-            return NS_END_DATA;
+/*
+ * Write the buffer, the last write ends a streamed response. The channel
+ * was switched to binary translation, so the bytes are written unchanged
+ * through the buffer of the channel.
+ */
+static int DumpFlush(dbDump *dumpPtr, bool last)
+{
+    int rc = 0;
 
-        default:
-            NS_DB_ERR0(conn->dbi, rc, "DB->c_get");
-            Ns_DbSetException(handle, "ERROR", NS_DB_STRERR(rc));
-            handle->fetchingRows = NS_FALSE;
-            return NS_ERROR;
+    if (dumpPtr->chan != NULL) {
+        TCL_SIZE_T length = Tcl_DStringLength(&dumpPtr->buf);
+
+        if (length > 0 && Tcl_Write(dumpPtr->chan, Tcl_DStringValue(&dumpPtr->buf), length) != length) {
+            rc = Tcl_GetErrno();
+            if (rc == 0) {
+                rc = EIO;
+            }
         }
-        break;
+    } else if (Ns_ConnWriteData(dumpPtr->nsConn, Tcl_DStringValue(&dumpPtr->buf),
+                                (size_t)Tcl_DStringLength(&dumpPtr->buf),
+                                last ? 0u : NS_CONN_STREAM) != NS_OK) {
+        rc = EPIPE;
     }
-    return NS_ERROR;
+    Tcl_DStringSetLength(&dumpPtr->buf, 0);
+    return rc;
 }
 
-static int DbFlush(Ns_DbHandle *handle)
+static void DumpJsonString(Tcl_DString *dsPtr, const unsigned char *bytes, size_t length)
 {
-    DbCancel(handle);
-#ifndef LMDB
-    if (dbSync) {
-        dbConn *conn = handle->connection;
-        conn->dbi->sync(conn->dbi, 0);
+    size_t i, start = 0u;
+
+    Tcl_DStringAppend(dsPtr, "\"", 1);
+    for (i = 0u; i < length; i++) {
+        char esc[8];
+
+        if (bytes[i] >= 0x20u && bytes[i] != '"' && bytes[i] != '\\') {
+            continue;
+        }
+        Tcl_DStringAppend(dsPtr, (const char *)bytes + start, (TCL_SIZE_T)(i - start));
+        switch (bytes[i]) {
+        case '\n':
+            Tcl_DStringAppend(dsPtr, "\\n", 2);
+            break;
+        case '\r':
+            Tcl_DStringAppend(dsPtr, "\\r", 2);
+            break;
+        case '\t':
+            Tcl_DStringAppend(dsPtr, "\\t", 2);
+            break;
+        case '"':
+        case '\\':
+            esc[0] = '\\';
+            esc[1] = (char)bytes[i];
+            Tcl_DStringAppend(dsPtr, esc, 2);
+            break;
+        default:
+            snprintf(esc, sizeof(esc), "\\u%.4x", bytes[i]);
+            Tcl_DStringAppend(dsPtr, esc, 6);
+            break;
+        }
+        start = i + 1u;
     }
-#endif
-    return NS_OK;
+    Tcl_DStringAppend(dsPtr, (const char *)bytes + start, (TCL_SIZE_T)(length - start));
+    Tcl_DStringAppend(dsPtr, "\"", 1);
 }
 
-#ifndef LMDB
-static void DbError(const NS_DB_ENV *UNUSED(env), const char *errpfx, const char *msg)
+/*
+ * Tabs, line ends and backslashes are escaped in tsv, see LoadUnescape().
+ */
+static void DumpTsvString(Tcl_DString *dsPtr, const unsigned char *bytes, size_t length)
 {
-    Ns_Log(Error, "nsdbbdb: %s: %s", errpfx, msg);
-}
-#endif
+    size_t i, start = 0u;
 
-static int DbFree(Ns_DbHandle *handle)
-{
-    dbConn *conn = handle->connection;
+    for (i = 0u; i < length; i++) {
+        const char *esc;
 
-#ifdef LMDB
-    NS_DB_VAL_FLAGS(conn->key) = 0u;
-    NS_DB_VAL_FLAGS(conn->data) = 0u;
-#else
-    if (NS_DB_VAL_FLAGS(conn->key) & (NS_DB_DBT_MALLOC | NS_DB_DBT_REALLOC)) {
-        Ns_Log(BdbDebug, "... free key %p flags %8x", (void*)NS_DB_VAL_DATA(conn->key), NS_DB_VAL_FLAGS(conn->key));
-        ns_free(NS_DB_VAL_DATA(conn->key));
-    }
-    if (NS_DB_VAL_FLAGS(conn->data) & (NS_DB_DBT_MALLOC | NS_DB_DBT_REALLOC)) {
-        Ns_Log(BdbDebug, "... free data %p flags %8x", (void*)NS_DB_VAL_DATA(conn->data), NS_DB_VAL_FLAGS(conn->data));
-        ns_free(NS_DB_VAL_DATA(conn->data));
+        switch (bytes[i]) {
+        case '\t':
+            esc = "\\t";
+            break;
+        case '\n':
+            esc = "\\n";
+            break;
+        case '\r':
+            esc = "\\r";
+            break;
+        case '\\':
+            esc = "\\\\";
+            break;
+        default:
+            continue;
+        }
+        Tcl_DStringAppend(dsPtr, (const char *)bytes + start, (TCL_SIZE_T)(i - start));
+        Tcl_DStringAppend(dsPtr, esc, 2);
+        start = i + 1u;
     }
-    memset(&conn->key, 0, sizeof(NS_DB_VAL));
-    memset(&conn->data, 0, sizeof(NS_DB_VAL));
-#endif
-    return NS_OK;
+    Tcl_DStringAppend(dsPtr, (const char *)bytes + start, (TCL_SIZE_T)(length - start));
 }
 
-static int DbCancel(Ns_DbHandle *handle)
+static void DumpValue(dbDump *dumpPtr, const dbPool *poolPtr, const NS_DB_VAL *valPtr)
 {
-    dbConn *conn = handle->connection;
+    const unsigned char *bytes = NS_DB_VAL_DATA(*valPtr);
+    size_t               length = NS_DB_VAL_SIZE(*valPtr);
 
-    if (conn->cursor != NULL) {
-        Ns_Log(BdbDebug, "... DbCancel closes cursor %p", (void*)conn->cursor);
-        NS_DB_DBI_CURSOR_CLOSE(conn->cursor);
-        conn->cursor = NULL;
+    /*
+     * Strings are stored with their terminating null byte.
+     */
+    if (!poolPtr->binary && length > 0u && bytes[length - 1u] == '\0') {
+        length--;
     }
-    if (conn->txn != NULL) {
-        Ns_Log(BdbDebug, "... DbCancel aborts transaction %p", (void*)conn->txn);
-        NS_DB_ENV_TXN_ABORT(conn->txn);
-        conn->txn = NULL;
+    switch (dumpPtr->format) {
+    case DumpJson:
+        DumpJsonString(&dumpPtr->buf, bytes, length);
+        break;
+    case DumpBinary: {
+        char prefix[TCL_INTEGER_SPACE + 1];
+
+        snprintf(prefix, sizeof(prefix), "%lu:", (unsigned long)length);
+        Tcl_DStringAppend(&dumpPtr->buf, prefix, TCL_INDEX_NONE);
+        Tcl_DStringAppend(&dumpPtr->buf, (const char *)bytes, (TCL_SIZE_T)length);
+        break;
+    }
+    case DumpTsv:
+        DumpTsvString(&dumpPtr->buf, bytes, length);
+        break;
     }
-    DbFree(handle);
-    handle->statement = NULL;
-    handle->fetchingRows = NS_FALSE;
-    return NS_OK;
 }
 
-static int DbResetHandle(Ns_DbHandle *handle)
+static void DumpRecord(dbDump *dumpPtr, const dbConn *conn)
 {
-    return DbCancel(handle);
+    NS_DB_VAL key;
+    char      buf[TCL_INTEGER_SPACE];
+
+    DecodeKey(conn->pool, &conn->key, buf, &key);
+    if (dumpPtr->format == DumpJson) {
+        Tcl_DStringAppend(&dumpPtr->buf, dumpPtr->records == 0 ? "\n{\"key\":" : ",\n{\"key\":", TCL_INDEX_NONE);
+        DumpValue(dumpPtr, conn->pool, &key);
+        Tcl_DStringAppend(&dumpPtr->buf, ",\"value\":", 9);
+        DumpValue(dumpPtr, conn->pool, &conn->data);
+        Tcl_DStringAppend(&dumpPtr->buf, "}", 1);
+    } else {
+        DumpValue(dumpPtr, conn->pool, &key);
+        if (dumpPtr->format == DumpTsv) {
+            Tcl_DStringAppend(&dumpPtr->buf, "\t", 1);
+        }
+        DumpValue(dumpPtr, conn->pool, &conn->data);
+        if (dumpPtr->format == DumpTsv) {
+            Tcl_DStringAppend(&dumpPtr->buf, "\n", 1);
+        }
+    }
+    dumpPtr->records++;
 }
 
-static Ns_Set *DbBindRow(Ns_DbHandle *handle)
+/*
+ * Dump the records from the start key up to (not including) the end key.
+ * The cursor and the read transaction are released when done.
+ */
+static int DumpScan(dbConn *conn, dbDump *dumpPtr, const NS_DB_VAL *startPtr, const NS_DB_VAL *endPtr)
 {
-    const dbConn *conn = handle->connection;
+    int rc;
 
-    switch (conn->cmd) {
-    case DB_GET:
-        Ns_SetPutSz(handle->row, "data", 4, NULL, 0);
-        break;
-    default:
-        Ns_SetPutSz(handle->row, "key", 3, NULL, 0);
-        Ns_SetPutSz(handle->row, "data", 3, NULL, 0);
+    conn->scanFlags = 0u;
+    memset(&conn->bound, 0, sizeof(conn->bound));
+    if (endPtr != NULL) {
+        conn->bound = *endPtr;
+        conn->scanFlags |= DB_SCAN_END;
     }
-    return handle->row;
+    if (dumpPtr->format == DumpJson) {
+        Tcl_DStringAppend(&dumpPtr->buf, "[", 1);
+    }
+    rc = OpenScan(conn, startPtr);
+    while (rc == 0 && InScanRange(conn)) {
+        DumpRecord(dumpPtr, conn);
+        if (Tcl_DStringLength(&dumpPtr->buf) >= DUMP_BUFFER) {
+            rc = DumpFlush(dumpPtr, NS_FALSE);
+            if (rc != 0) {
+                break;
+            }
+        }
+        rc = NextScanRow(conn);
+    }
+    CloseCursors(conn);
+    ReleaseReadTxn(conn);
+    if (rc == NS_DB_NOTFOUND) {
+        rc = 0;
+    } else if (rc != 0) {
+        NS_DB_ERR0(conn->dbi, rc, "dump");
+        return rc;
+    }
+    if (dumpPtr->format == DumpJson) {
+        Tcl_DStringAppend(&dumpPtr->buf, "\n]\n", 3);
+    }
+    return DumpFlush(dumpPtr, NS_TRUE);
 }
 
 /*
  * DbCmd - This function implements the "ns_berkeleydb" Tcl command installed
  * into each interpreter of each virtual server.  It provides access to
- * features specific to the Db driver.
+ * features specific to the Db driver and direct access to the data without
+ * going through the query interface.
+ *
+ *   ns_berkeleydb backup handle ?path? ?-compact?
+ *   ns_berkeleydb deadlock handle
+ *   ns_berkeleydb get handle key ?varName?
+ *   ns_berkeleydb put handle key value ?flags?
+ *   ns_berkeleydb del handle key
+ *   ns_berkeleydb dump handle channel ?-start key? ?-end key? ?-format tsv|json|binary?
+ *   ns_berkeleydb exists handle key
+ *   ns_berkeleydb load handle ?file? ?-format tsv|binary? ?-sorted?
+ *   ns_berkeleydb stats handle ?-fast?
+ *   ns_berkeleydb latency ?-reset?
  */
 
-static int DbCmd(ClientData UNUSED(dummy), Tcl_Interp *interp, int argc, const char **argv)
+static int DbCmd(ClientData UNUSED(dummy), Tcl_Interp *interp, int objc, Tcl_Obj *const* objv)
 {
     Ns_DbHandle *handle;
+    dbConn      *conn;
+    NS_DB_TXN   *txn;
+    NS_DB_VAL    key, data;
+    int          cmd, rc = 0, result = TCL_OK;
+
+    static const char *const cmds[] = {
+        "backup", "deadlock", "del", "dump", "exists", "get", "latency", "load", "put", "stats", NULL
+    };
+    enum {
+        CBackupIdx, CDeadlockIdx, CDelIdx, CDumpIdx, CExistsIdx, CGetIdx, CLatencyIdx, CLoadIdx, CPutIdx, CStatsIdx
+    };
 
-    if (argc != 3) {
-        Tcl_AppendResult(interp, "wrong # args: should be ", argv[0], " cmd handle", 0);
+    if (objc < 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "cmd ?handle? ?args?");
         return TCL_ERROR;
     }
-    if (Ns_TclDbGetHandle(interp, (char *) argv[2], &handle) != TCL_OK) {
+    if (Tcl_GetIndexFromObj(interp, objv[1], cmds, "cmd", 0, &cmd) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    if (cmd == CLatencyIdx) {
+        /*
+         * The latency statistics are collected over all handles.
+         */
+        if (objc != 2 && (objc != 3 || strcmp(Tcl_GetString(objv[2]), "-reset") != 0)) {
+            Tcl_WrongNumArgs(interp, 2, objv, "?-reset?");
+            return TCL_ERROR;
+        }
+        Tcl_SetObjResult(interp, LatencyObj(objc == 3));
+        return TCL_OK;
+    }
+    if (objc < 3) {
+        Tcl_WrongNumArgs(interp, 1, objv, "cmd handle ?args?");
+        return TCL_ERROR;
+    }
+    if (Ns_TclDbGetHandle(interp, Tcl_GetString(objv[2]), &handle) != TCL_OK) {
         return TCL_ERROR;
     }
     /*
      * Make sure this is an Db handle before accessing handle->connection.
      */
     if (Ns_DbDriverName(handle) != dbName) {
-        Tcl_AppendResult(interp, argv[1], " is not of type ", dbName, 0);
+        Tcl_AppendResult(interp, Tcl_GetString(objv[2]), " is not of type ", dbName, (char *)0L);
         return TCL_ERROR;
     }
-    // Deadlock detection
-    if (strcmp(argv[1], "deadlock") == 0) {
+    conn = handle->connection;
+    memset(&key, 0, sizeof(key));
+    memset(&data, 0, sizeof(data));
+
+    switch (cmd) {
+    case CBackupIdx:
+        /*
+         * Without a path, the status of the last backup is returned.
+         */
+        if (objc == 3) {
+            Tcl_SetObjResult(interp, BackupStatus(conn->shared));
+            return TCL_OK;
+        }
+        if (objc > 5 || (objc == 5 && strcmp(Tcl_GetString(objv[4]), "-compact") != 0)) {
+            Tcl_WrongNumArgs(interp, 2, objv, "handle ?path? ?-compact?");
+            return TCL_ERROR;
+        }
+        rc = BackupStart(conn->shared, Tcl_GetString(objv[3]), objc == 5);
+        break;
+
+    case CLoadIdx: {
+        dbLoadFormat format = LoadTsv;
+        bool         sorted = NS_FALSE;
+        int          i;
+
+        /*
+         * Without a file, the status of the last load is returned.
+         */
+        if (objc == 3) {
+            Tcl_SetObjResult(interp, LoadStatus(conn->shared));
+            return TCL_OK;
+        }
+        for (i = 4; i < objc; i++) {
+            const char *option = Tcl_GetString(objv[i]);
+
+            if (strcmp(option, "-sorted") == 0) {
+                sorted = NS_TRUE;
+            } else if (strcmp(option, "-format") == 0 && i + 1 < objc) {
+                const char *value = Tcl_GetString(objv[++i]);
+
+                if (strcmp(value, "binary") == 0) {
+                    format = LoadBinary;
+                } else if (strcmp(value, "tsv") != 0) {
+                    Tcl_AppendResult(interp, "invalid format \"", value, "\", expected tsv or binary", (char *)0L);
+                    return TCL_ERROR;
+                }
+            } else {
+                Tcl_WrongNumArgs(interp, 2, objv, "handle ?file? ?-format tsv|binary? ?-sorted?");
+                return TCL_ERROR;
+            }
+        }
+        rc = LoadStart(conn->shared, Tcl_GetString(objv[3]), format, sorted);
+        break;
+    }
+
+    case CDumpIdx: {
+        dbDump        dump;
+        NS_DB_VAL     start, end;
+        unsigned char startEnc[8], endEnc[8];
+        bool          hasStart = NS_FALSE, hasEnd = NS_FALSE;
+        const char   *channelName;
+        int           i;
+
+        if (objc < 4) {
+            Tcl_WrongNumArgs(interp, 2, objv, "handle channel ?-start key? ?-end key? ?-format tsv|json|binary?");
+            return TCL_ERROR;
+        }
+        memset(&dump, 0, sizeof(dump));
+        memset(&start, 0, sizeof(start));
+        memset(&end, 0, sizeof(end));
+        dump.format = DumpTsv;
+        for (i = 4; i < objc; i++) {
+            const char *option = Tcl_GetString(objv[i]);
+
+            if (i + 1 >= objc) {
+                Tcl_WrongNumArgs(interp, 2, objv, "handle channel ?-start key? ?-end key? ?-format tsv|json|binary?");
+                return TCL_ERROR;
+            } else if (strcmp(option, "-start") == 0) {
+                ObjToVal(conn->pool, objv[++i], &start);
+                hasStart = NS_TRUE;
+            } else if (strcmp(option, "-end") == 0) {
+                ObjToVal(conn->pool, objv[++i], &end);
+                hasEnd = NS_TRUE;
+            } else if (strcmp(option, "-format") == 0) {
+                const char *value = Tcl_GetString(objv[++i]);
+
+                if (strcmp(value, "json") == 0) {
+                    dump.format = DumpJson;
+                } else if (strcmp(value, "binary") == 0) {
+                    dump.format = DumpBinary;
+                } else if (strcmp(value, "tsv") != 0) {
+                    Tcl_AppendResult(interp, "invalid format \"", value, "\", expected tsv, json or binary", (char *)0L);
+                    return TCL_ERROR;
+                }
+            } else {
+                Tcl_WrongNumArgs(interp, 2, objv, "handle channel ?-start key? ?-end key? ?-format tsv|json|binary?");
+                return TCL_ERROR;
+            }
+        }
+
+        if ((hasStart && EncodeKey(conn->pool, &start, startEnc) != NS_OK)
+            || (hasEnd && EncodeKey(conn->pool, &end, endEnc) != NS_OK)) {
+            Tcl_AppendResult(interp, "invalid key", (char *)0L);
+            return TCL_ERROR;
+        }
+
+        /*
+         * The channel "-" is the current connection, the records are sent
+         * as a streamed response.
+         */
+        channelName = Tcl_GetString(objv[3]);
+        if (strcmp(channelName, "-") == 0) {
+            dump.nsConn = Ns_GetConn();
+            if (dump.nsConn == NULL) {
+                Tcl_AppendResult(interp, "no current connection", (char *)0L);
+                return TCL_ERROR;
+            }
+            Ns_ConnSetTypeHeader(dump.nsConn,
+                                 dump.format == DumpJson ? "application/json"
+                                 : dump.format == DumpBinary ? "application/octet-stream"
+                                 : "text/tab-separated-values");
+        } else if ((dump.chan = Tcl_GetChannel(interp, channelName, NULL)) == NULL
+                   || Tcl_SetChannelOption(interp, dump.chan, "-translation", "binary") != TCL_OK) {
+            return TCL_ERROR;
+        }
+        DbCancel(handle);
+        Tcl_DStringInit(&dump.buf);
+        rc = DumpScan(conn, &dump, hasStart ? &start : NULL, hasEnd ? &end : NULL);
+        Tcl_DStringFree(&dump.buf);
+        if (rc == 0) {
+            Tcl_SetObjResult(interp, Tcl_NewWideIntObj(dump.records));
+        }
+        break;
+    }
+
+    case CDeadlockIdx:
+        // Deadlock detection
 #ifdef LMDB
         Ns_Log(Warning, "nsdbbdb: 'ns_berkeleydb deadlock' is not supported by LMDB.");
 #else
-        if (dbEnv != NULL) {
-            dbEnv->lock_detect(dbEnv, 0, DB_LOCK_DEFAULT, 0);
+        conn->pool->env->lock_detect(conn->pool->env, 0, DB_LOCK_DEFAULT, 0);
+#endif
+        return TCL_OK;
+
+    case CGetIdx:
+    case CExistsIdx:
+        if (objc != 4 && (cmd != CGetIdx || objc != 5)) {
+            Tcl_WrongNumArgs(interp, 2, objv, cmd == CGetIdx ? "handle key ?varName?" : "handle key");
+            return TCL_ERROR;
+        }
+        DbCancel(handle);
+        if (ObjToKey(conn->pool, objv[3], &key, conn->keyEnc) != NS_OK) {
+            Tcl_AppendResult(interp, "invalid key \"", Tcl_GetString(objv[3]), "\"", (char *)0L);
+            return TCL_ERROR;
+        }
+        RouteKey(conn, &key);
+#ifndef LMDB
+        if (cmd == CExistsIdx) {
+            /*
+             * Do not retrieve the data, when we are only interested in the
+             * existence of the key.
+             */
+            NS_DB_VAL_FLAGS(data) = DB_DBT_USERMEM | DB_DBT_PARTIAL;
         }
 #endif
+        rc = (BloomExcludes(conn, &key) || TtlExpired(conn, conn->txn, &key))
+            ? NS_DB_NOTFOUND : GetReadTxn(conn, &txn);
+        if (rc == 0) {
+            rc = cmd == CExistsIdx
+                ? NS_DB_DBI_GET(txn, conn->dbi, &key, &data)
+                : DbGetValue(conn, txn, &key, &data);
+        }
+        if (rc == 0) {
+            if (cmd == CExistsIdx) {
+                Tcl_SetObjResult(interp, Tcl_NewBooleanObj(1));
+            } else if (objc == 5) {
+                if (Tcl_ObjSetVar2(interp, objv[4], NULL, ValToObj(conn->pool, &data), TCL_LEAVE_ERR_MSG) == NULL) {
+                    result = TCL_ERROR;
+                } else {
+                    Tcl_SetObjResult(interp, Tcl_NewBooleanObj(1));
+                }
+            } else {
+                Tcl_SetObjResult(interp, ValToObj(conn->pool, &data));
+            }
+        } else if (rc == NS_DB_NOTFOUND) {
+            if (cmd == CExistsIdx || objc == 5) {
+                Tcl_SetObjResult(interp, Tcl_NewBooleanObj(0));
+            } else {
+                Tcl_AppendResult(interp, "no such key: ", Tcl_GetString(objv[3]), (char *)0L);
+                result = TCL_ERROR;
+            }
+            rc = 0;
+        }
+        ReleaseReadTxn(conn);
+        break;
+
+    case CPutIdx: {
+        unsigned int flags = 0;
+        Tcl_WideInt  ttl = 0;
+
+        if (objc != 5 && objc != 6) {
+            Tcl_WrongNumArgs(interp, 2, objv, "handle key value ?flags?");
+            return TCL_ERROR;
+        }
+        if (objc == 6) {
+            if (ParsePutFlags(Tcl_GetString(objv[5]), &flags, &ttl) == NULL) {
+                Tcl_AppendResult(interp, "invalid flags \"", Tcl_GetString(objv[5]), "\"", (char *)0L);
+                return TCL_ERROR;
+            }
+            if (ttl != 0 && CheckTtl(handle, ttl) != NS_OK) {
+                Tcl_SetObjResult(interp, Tcl_NewStringObj(Tcl_DStringValue(&handle->dsExceptionMsg), TCL_INDEX_NONE));
+                return TCL_ERROR;
+            }
+        }
+        DbCancel(handle);
+        if (ObjToKey(conn->pool, objv[3], &key, conn->keyEnc) != NS_OK) {
+            Tcl_AppendResult(interp, "invalid key \"", Tcl_GetString(objv[3]), "\"", (char *)0L);
+            return TCL_ERROR;
+        }
+        ObjToVal(conn->pool, objv[4], &data);
+        RouteKey(conn, &key);
+        BloomAdd(conn, &key);
+        conn->status = GetWriteTxn(conn, &txn);
+        if (conn->status == 0) {
+            conn->status = DbPut(conn, txn, &key, &data, flags, TtlExpiry(ttl));
+            conn->status = CleanTempTxn(conn, txn);
+        }
+        if (conn->status == 0) {
+            CacheWrite(conn, &key);
+        }
+        rc = conn->status;
+        break;
+    }
+
+    case CDelIdx:
+        if (objc != 4) {
+            Tcl_WrongNumArgs(interp, 2, objv, "handle key");
+            return TCL_ERROR;
+        }
+        DbCancel(handle);
+        if (ObjToKey(conn->pool, objv[3], &key, conn->keyEnc) != NS_OK) {
+            Tcl_AppendResult(interp, "invalid key \"", Tcl_GetString(objv[3]), "\"", (char *)0L);
+            return TCL_ERROR;
+        }
+        RouteKey(conn, &key);
+        conn->status = GetWriteTxn(conn, &txn);
+        if (conn->status == 0) {
+            conn->status = TtlUpdate(conn, txn, &key, 0);
+            if (conn->status == 0) {
+                conn->status = NS_DB_DBI_DEL(txn, conn->dbi, &key);
+            }
+            conn->status = CleanTempTxn(conn, txn);
+        }
+        if (conn->status == 0) {
+            CacheWrite(conn, &key);
+            BloomDelete(conn);
+        }
+        rc = conn->status;
+        if (rc == 0 || rc == NS_DB_NOTFOUND) {
+            Tcl_SetObjResult(interp, Tcl_NewBooleanObj(rc == 0));
+            rc = 0;
+        }
+        break;
+
+    case CStatsIdx: {
+        Tcl_Obj *dictObj;
+
+        if (objc != 3 && (objc != 4 || strcmp(Tcl_GetString(objv[3]), "-fast") != 0)) {
+            Tcl_WrongNumArgs(interp, 2, objv, "handle ?-fast?");
+            return TCL_ERROR;
+        }
+        dictObj = Tcl_NewDictObj();
+        rc = DbStats(conn->shared, dictObj, objc == 4);
+        if (rc == 0) {
+            Tcl_SetObjResult(interp, dictObj);
+        } else {
+            Tcl_DecrRefCount(dictObj);
+        }
+        break;
+    }
     }
-    return TCL_OK;
-}
 
+    if (rc != 0) {
+        Tcl_AppendResult(interp, Tcl_GetString(objv[1]), " failed: ", NS_DB_STRERR(rc), (char *)0L);
+        result = TCL_ERROR;
+    }
+    return result;
+}
 
 static Ns_ReturnCode DbInterpInit(Tcl_Interp *interp, const void *arg)
 {
-    Tcl_CreateCommand(interp, "ns_berkeleydb", DbCmd, (void*)arg, NULL);
+    Tcl_CreateObjCommand(interp, "ns_berkeleydb", DbCmd, (void*)arg, NULL);
     return NS_OK;
 }
 
@@ -18,6 +18,55 @@ if { $query != "" } {
   ns_log notice EXISTS: key1
 }
 
+# Retrieve multiple records
+set result ""
+set query [ns_db select $db "MGET key1\nkey2\nnokey"]
+while { [ns_db getrow $db $query] } {
+  lappend result [ns_set value $query 0] [ns_set value $query 1]
+}
+ns_log notice MGET: $result
+
+# Direct access without query strings
+ns_berkeleydb put $db key6 data6
+if { [ns_berkeleydb get $db key6 result] } {
+  ns_log notice NATIVE GET: $result
+}
+ns_log notice NATIVE EXISTS: [ns_berkeleydb exists $db key6]
+ns_log notice NATIVE DEL: [ns_berkeleydb del $db key6]
+ns_log notice STATS: [ns_berkeleydb stats $db]
+
+# Multiple pairs in one transaction, the sample pool runs with
+# envflags "notxn", which opens a transactional environment
+ns_db exec $db "MPUT key7\ndata7\nkey8\ndata8"
+set result ""
+set query [ns_db select $db "MGET key7\nkey8"]
+while { [ns_db getrow $db $query] } {
+  lappend result [ns_set value $query 0] [ns_set value $query 1]
+}
+ns_log notice MPUT: $result
+ns_db exec $db "BEGIN"
+ns_db exec $db "MPUT key9\ndata9\nkey10\ndata10"
+ns_db exec $db "MDEL key7\nkey8"
+ns_db exec $db "COMMIT"
+ns_log notice MDEL: [ns_db 0or1row $db "GET key7"]
+
+# Counters
+ns_db 1row $db "INCR counter"
+set query [ns_db 1row $db "INCR counter\n10"]
+ns_log notice INCR: [ns_set value $query 0]
+
+# Compare and swap, the second one fails since the value has changed
+set query [ns_db 1row $db "CAS key2\ndata2\nnewdata2"]
+ns_log notice CAS: [ns_set value $query 0]
+set query [ns_db 1row $db "CAS/m key2\n[ns_md5 data2]\ndata2"]
+ns_log notice CAS/m: [ns_set value $query 0]
+
+# Expiry, only for pools with "ns_param ttl true"
+#ns_db exec $db "PUT/t60 session1\ndata"
+
+# All values of a key, only for pools with "ns_param dbflags dup"
+#set query [ns_db select $db "GETALL key1"]
+
 # Delete one record
 catch { ns_db exec $db "DEL key1" }
 ns_log notice DELETED: key1
@@ -34,4 +83,21 @@ while { [ns_db getrow $db $query] } {
 }
 ns_log notice CURSOR: $result
 
+# Retrieve the last two records in reverse order
+set result ""
+set query [ns_db select $db "CURSOR/prl2 key"]
+while { [ns_db getrow $db $query] } {
+  lappend result [ns_set value $query 0]
+}
+ns_log notice CURSOR REVERSE: $result
+
+# Export the records as tab separated values
+set f [open /tmp/export.tsv w]
+ns_log notice DUMP: [ns_berkeleydb dump $db $f]
+close $f
+
+# Latency of the operations above, counting starts again afterwards,
+# only recorded with "ns_param latency true" in the section of the driver
+ns_log notice LATENCY: [ns_berkeleydb latency -reset]
+
 #ns_db releasehandle $db